@@ -58,3 +58,140 @@ center_set_pointer_t fused_kernel_conditional_free_malloc(center_set_pointer_t*
     return new_address;
 }
 
+
+// Bitmap sets (CENTER_SET_BITMAP). The candidates are taken in index order, like
+// the entries of a list: the lowest set bit, located with a popcount of the bits
+// below it.
+#ifdef CENTER_SET_BITMAP
+
+center_index_t center_set_first(center_set_t s)
+{
+    center_index_t first = 0;
+    bool found = false;
+    #pragma unroll
+    for (uint w=0; w<CENTER_SET_WORDS; w++) {
+        uint x = s.w[w];
+        if (!found && (x != 0)) {
+            first = (w << 5) + popcount((x & (0-x)) - 1);
+            found = true;
+        }
+    }
+    return first;
+}
+
+void center_set_remove(center_set_t *s, center_index_t i)
+{
+    s->w[i >> 5] &= ~(1u << (i & 31));
+}
+
+void center_set_insert(center_set_t *s, center_index_t i)
+{
+    s->w[i >> 5] |= (1u << (i & 31));
+}
+
+void center_set_clear(center_set_t *s)
+{
+    #pragma unroll
+    for (uint w=0; w<CENTER_SET_WORDS; w++) {
+        s->w[w] = 0;
+    }
+}
+
+// centres 0..k-1
+void center_set_all(center_set_t *s, uint k)
+{
+    #pragma unroll
+    for (uint w=0; w<CENTER_SET_WORDS; w++) {
+        uint lo = w << 5;
+        s->w[w] = (k >= lo+32) ? 0xFFFFFFFF : ((k > lo) ? ((1u << (k-lo)) - 1) : 0);
+    }
+}
+
+#endif
+
+
+// Second tier of the centre-set heap: sets are evicted from the on-chip pool to
+// slots in host memory and loaded back when they are needed again. Slots are
+// handed out with kernel_malloc/kernel_free on their own free list.
+
+#ifdef CENTER_SET_BITMAP
+
+#define CENTER_SET_SLOT_BYTES   (((CENTER_SET_WORDS*4)+63) & ~63)       // whole 512-bit lines
+#define CENTER_SET_LINES        ((CENTER_SET_WORDS+15)/16)
+
+// the whole bitmap, one 32-bit store per word
+void center_set_spill(__global int *restrict z0, svm_pointer_t ttbr0,
+                      center_set_t* pool, center_set_pointer_t address, uint k,
+                      svm_pointer_t tier2, center_set_pointer_t slot)
+{
+    svm_pointer_t base = tier2 + slot*CENTER_SET_SLOT_BYTES;
+    for (uint w=0; w<CENTER_SET_WORDS; w++) {
+        host_memory_bridge_st_32bit(z0, ttbr0, base + (w << 2), pool[address].w[w]);
+    }
+}
+
+// 16 words per 512-bit load (the upper half carries the bridge counters)
+void center_set_fill(__global int *restrict z0, svm_pointer_t ttbr0,
+                     center_set_t* pool, center_set_pointer_t address, uint k,
+                     svm_pointer_t tier2, center_set_pointer_t slot)
+{
+    svm_pointer_t base = tier2 + slot*CENTER_SET_SLOT_BYTES;
+    for (uint l=0; l<CENTER_SET_LINES; l++) {
+        ulong16 line = host_memory_bridge_ld_512bit(z0, ttbr0, base + (l << 6));
+        ulong r[8] = {line.s0, line.s1, line.s2, line.s3, line.s4, line.s5, line.s6, line.s7};
+        #pragma unroll
+        for (uint j=0; j<16; j++) {
+            uint w = (l << 4) + j;
+            if (w < CENTER_SET_WORDS) {
+                pool[address].w[w] = (uint)(r[j >> 1] >> ((j & 1) << 5));
+            }
+        }
+    }
+}
+
+#else
+
+#define CENTER_SET_SLOT_BYTES   (((KMAX*sizeof(center_index_t))+63) & ~63)     // whole 512-bit lines
+#define CENTER_INDICES_PER_WORD (4/sizeof(center_index_t))
+#define CENTER_INDICES_PER_LINE (64/sizeof(center_index_t))
+#define CENTER_INDEX_BITS       (8*sizeof(center_index_t))
+
+// packed into 32-bit stores
+void center_set_spill(__global int *restrict z0, svm_pointer_t ttbr0,
+                      center_index_t* pool, center_set_pointer_t address, uint k,
+                      svm_pointer_t tier2, center_set_pointer_t slot)
+{
+    svm_pointer_t base = tier2 + slot*CENTER_SET_SLOT_BYTES;
+    for (uint w=0; w*CENTER_INDICES_PER_WORD<k; w++) {
+        uint v = 0;
+        #pragma unroll
+        for (uint j=0; j<CENTER_INDICES_PER_WORD; j++) {
+            uint i = w*CENTER_INDICES_PER_WORD + j;
+            uint idx = (i < k) ? pool[(address << KMAX_BITS) + i] : 0;
+            v |= idx << (j*CENTER_INDEX_BITS);
+        }
+        host_memory_bridge_st_32bit(z0, ttbr0, base + (w << 2), v);
+    }
+}
+
+// one 512-bit load per line (the upper half carries the bridge counters)
+void center_set_fill(__global int *restrict z0, svm_pointer_t ttbr0,
+                     center_index_t* pool, center_set_pointer_t address, uint k,
+                     svm_pointer_t tier2, center_set_pointer_t slot)
+{
+    svm_pointer_t base = tier2 + slot*CENTER_SET_SLOT_BYTES;
+    for (uint l=0; l*CENTER_INDICES_PER_LINE<k; l++) {
+        ulong16 line = host_memory_bridge_ld_512bit(z0, ttbr0, base + (l << 6));
+        ulong r[8] = {line.s0, line.s1, line.s2, line.s3, line.s4, line.s5, line.s6, line.s7};
+        #pragma unroll
+        for (uint j=0; j<CENTER_INDICES_PER_LINE; j++) {
+            uint i = l*CENTER_INDICES_PER_LINE + j;
+            uint bit = j*CENTER_INDEX_BITS;
+            if (i < k) {
+                pool[(address << KMAX_BITS) + i] = (center_index_t)(r[bit >> 6] >> (bit & 63));
+            }
+        }
+    }
+}
+
+#endif
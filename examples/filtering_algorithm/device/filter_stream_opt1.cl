@@ -14,13 +14,79 @@
 #include "snode.cl"
 #include "dyn_mem_alloc.cl"
 
+#ifndef CENTER_SET_POOL_SIZE
 #define CENTER_SET_POOL_SIZE    512
-#define STACK_SIZE              1024
-
+#endif
+
+// Second tier of the centre-set heap: sets owned by records below the next
+// batch are evicted to slots in host memory (SVM) once the pool runs full, and
+// always when their record is spilled. A record points to slot s with
+// c = CENTER_SET_POOL_SIZE+s. Before a batch, its records get their sets back on
+// chip, or all k centres if the pool has no room left.
+#ifndef CENTER_SET_SPILL_SLOTS
+#define CENTER_SET_SPILL_SLOTS  4096    // size of the on-chip free list, the host passes the actual number of slots
+#endif
+
+// evict down to CENTER_SET_LOW once the pool is above CENTER_SET_HIGH: a batch
+// and the loads before it allocate at most BATCH_SIZE sets each
+#define CENTER_SET_HIGH         (CENTER_SET_POOL_SIZE-4-2*BATCH_SIZE)
+#define CENTER_SET_LOW          (CENTER_SET_HIGH-32)
+
+// Traversal stack: the top STACK_SIZE records are held on chip in a ring, the
+// ones below are spilled in blocks of SPILL_BATCH records to host memory (SVM) and
+// filled back once fewer than BATCH_SIZE records are left on chip. Both happen
+// between batches. The sizes can be set with -D, e.g. small ones to make the
+// emulator spill.
+#ifndef STACK_SIZE
+#define STACK_SIZE              1024    // power of two
+#endif
+#define STACK_MASK              (STACK_SIZE-1)
+#define SPILL_BATCH             64      // multiple of 8, the records in a 512-bit line
+
+// A batch takes records from the top of the stack until the candidates they
+// carry (the sum of their k, the iterations of loops 0 and 1) reach the
+// batch_work argument, or until it holds BATCH_SIZE records. BATCH_SIZE sizes
+// the channels and the room kept on the stack and in the pool, batch_work can
+// be tuned per run: enough work to cover the pipeline latency of the two
+// loops, not much more, so that the children are pushed early. 0: BATCH_SIZE
+// records per batch.
+#ifndef BATCH_SIZE
 #define BATCH_SIZE              128
+#endif
+
+// spill above this: a batch pushes at most one record more than it pops, per popped record
+#define STACK_HIGH              (STACK_SIZE-BATCH_SIZE)
+
+#define MAX_ROOTS               256     // max number of subtree roots passed to filter0 (must be well below STACK_SIZE)
+
+#if (STACK_SIZE & STACK_MASK) != 0
+#error "STACK_SIZE must be a power of two"
+#endif
+#if CENTER_SET_HIGH < 64
+#error "CENTER_SET_POOL_SIZE too small for BATCH_SIZE"
+#endif
+#if CENTER_SET_POOL_SIZE+CENTER_SET_SPILL_SLOTS > 0x8000
+#error "centre-set pointers must fit into the 15 bits of a spilled stack record"
+#endif
+#if (STACK_HIGH < BATCH_SIZE+SPILL_BATCH) || (STACK_HIGH < MAX_ROOTS)
+#error "STACK_SIZE too small for BATCH_SIZE, SPILL_BATCH and MAX_ROOTS"
+#endif
+
+// filter1 accumulates into ACC_BANKS copies of its centroid buffer, one after
+// the other, and adds them up at the end: the same copy is read and written
+// again only every ACC_BANKS updates, which covers the latency of the
+// read-add-write and keeps the loop at one update per cycle
+#ifndef ACC_BANKS
+#define ACC_BANKS               4       // power of two
+#endif
+
+#if (ACC_BANKS & (ACC_BANKS-1)) != 0
+#error "ACC_BANKS must be a power of two"
+#endif
 
 //#define DEBUG
 //#define PROFILE
+//#define LSU_PROFILE_DELTAS    // profile_data[1]: bridge LSU counter deltas of this run, accumulated per batch (lane sf: number of batches)
 
 #pragma OPENCL EXTENSION cl_altera_channels : enable
 
@@ -141,19 +207,64 @@ void tooFar(data_type closest_cand, data_type cand, data_type bnd_lo, data_type
 }
 
 
+// Move the on-chip set owned by stack record i (d set, i.e. it frees the set) to
+// a second-tier slot. Its sibling at i+1, if still on the stack, shares the set
+// and is redirected as well. Returns false if there was nothing to evict or no
+// slot left.
+bool evict_center_set(__global int *restrict z0, svm_pointer_t ttbr0, __local stack_t *stack, uint i, uint sp,
+                      center_set_pool_t *cs_pool, center_set_pointer_t *freelist, center_set_pointer_t *next_free_location,
+                      center_set_pointer_t *spill_flist, center_set_pointer_t *next_spill_slot, uint spill_slots,
+                      svm_pointer_t set_spill)
+{
+    stack_t s = stack[i & STACK_MASK];
+    if (!s.d || (s.c >= CENTER_SET_POOL_SIZE) || (*next_spill_slot >= spill_slots)) {
+        return false;
+    }
+
+    center_set_pointer_t slot = kernel_malloc(spill_flist, next_spill_slot);
+    center_set_spill(z0, ttbr0, cs_pool, s.c, s.k, set_spill, slot);
+    kernel_free(freelist, next_free_location, s.c);
+
+    center_set_pointer_t tier2_c = CENTER_SET_POOL_SIZE + slot;
+    if (i+1 < sp) {
+        stack_t sibling = stack[(i+1) & STACK_MASK];
+        if (!sibling.d && (sibling.c == s.c)) {
+            sibling.c = tier2_c;
+            stack[(i+1) & STACK_MASK] = sibling;
+        }
+    }
+    s.c = tier2_c;
+    stack[i & STACK_MASK] = s;
+
+    return true;
+}
+
+
 
 __kernel void filter0 ( __global int *restrict z0,              // z0 is just a dummy pointer required to pass the first level of OpenCL compilation                      
-                        svm_pointer_t root,                     // the actual pointer to the host-allocated data structure is root (pointers are represented as uint and carry standard Linux virtual addresses)
+                        __global uint *restrict roots,          // the actual pointers to the host-allocated data structure are the subtree roots (pointers are represented as uint and carry standard Linux virtual addresses)
+                        uint n_roots,                           // number of subtree roots (1 if the whole tree is processed on the device, at most MAX_ROOTS)
                         svm_pointer_t ttbr0,                    // in addition to the host pointer arguments, the value of the ARM ttbr0 register must be passed to find the entry to the Linux page table
                         uint k,
                         __global int4 *restrict initial_centers,
                         __global uint *restrict visited_nodes,
-                        __global uint16 *restrict profile_data
+                        __global uint16 *restrict profile_data, // [0]: last LSU counter snapshot, [1]: deltas of this run (LSU_PROFILE_DELTAS)
+                        svm_pointer_t spill_stack,              // host-allocated spill region of the stack (64-byte aligned, 8 bytes per record)
+                        uint spill_capacity,                    // records that fit into it
+                        __global uint *restrict stack_info,     // spilled blocks, filled blocks, max depth, overflow, sets spilled, sets filled, fallback nodes, max heap, batches, batch work, capped batches, drained batches (accumulated)
+                        svm_pointer_t set_spill,                // host-allocated second tier of the centre-set heap (64-byte aligned, CENTER_SET_SLOT_BYTES per slot)
+                        uint set_spill_slots,                   // slots that fit into it
+                        uint label_pass,                        // != 0: each dead end is written back with its owner and this tag
+                        uint batch_work                         // candidates per batch (sum of k) to aim for, 0: BATCH_SIZE records
                      )
 {
 
     // initialize dynamically allocated pool of center sets   
+    #ifdef CENTER_SET_BITMAP
+    center_set_t cs_pool[CENTER_SET_POOL_SIZE];
+    #else
     center_index_t cs_pool[KMAX*CENTER_SET_POOL_SIZE];
+    #endif
     center_set_pointer_t freelist[CENTER_SET_POOL_SIZE];
 
     center_set_pointer_t next_free_location;
@@ -161,21 +272,40 @@ __kernel void filter0 ( __global int *restrict z0,              // z0 is just a
     center_set_pointer_t cs_0 = kernel_malloc(freelist, &next_free_location);
     center_set_pointer_t max_alloc = 0;
     center_set_pointer_t heap_consumption = 1;
+    #ifdef CENTER_SET_BITMAP
+    center_set_all(&cs_pool[cs_0], k);
+    #else
     for (center_index_t i=0; i<k; i++) {
         cs_pool[(cs_0 << KMAX_BITS) + i] = i;
     }
+    #endif
 
+    // second tier, slot 0 is not used
+    center_set_pointer_t spill_flist[CENTER_SET_SPILL_SLOTS];
+    center_set_pointer_t next_spill_slot;
+    kernel_init_allocator(spill_flist, &next_spill_slot, CENTER_SET_SPILL_SLOTS);
+    uint spill_slots = (set_spill_slots < CENTER_SET_SPILL_SLOTS) ? set_spill_slots : CENTER_SET_SPILL_SLOTS;
+    uint set_spills = 0;
+    uint set_fills = 0;
+    uint fallback_nodes = 0;   // nodes processed with all k centres for lack of room in the pool
 
-    // initialize stack
-    stack_t s0;
-    s0.u = root;
-    s0.c = cs_0;
-    s0.d = false;
-    s0.k = k;
 
+    // initialize stack with all subtree roots (the first root ends up on top), all of them share cs_0
     __local stack_t stack[STACK_SIZE];
-    stack[0] = s0;
-    uint sp = 1;
+    for (uint i=0; i<n_roots; i++) {
+        stack_t s0;
+        s0.u = roots[n_roots-1-i];
+        s0.c = cs_0;
+        s0.d = false;
+        s0.k = k;
+        stack[i] = s0;
+    }
+    uint sp = n_roots;      // depth, records [bottom, sp) are on chip at stack[i & STACK_MASK]
+    uint bottom = 0;        // records [0, bottom) are in the spill region
+    uint spills = 0;
+    uint fills = 0;
+    uint max_sp = sp;
+    bool overflow = false;
  
     // buffer current centers locally
     data_type current_centers[KMAX];
@@ -187,6 +317,14 @@ __kernel void filter0 ( __global int *restrict z0,              // z0 is just a
     // initialize visited nodes counter
     uint vn = 0;
 
+    // pipeline occupancy: batches, their candidates, and the batches closed
+    // below batch_work at BATCH_SIZE records or with the stack on chip drained
+    const uint work_target = (batch_work != 0) ? batch_work : 0xFFFFFFFF;
+    uint batches = 0;
+    uint batch_work_sum = 0;
+    uint capped_batches = 0;
+    uint drained_batches = 0;
+
     bool terminate = false;
 
     #ifdef PROFILE
@@ -197,8 +335,112 @@ __kernel void filter0 ( __global int *restrict z0,              // z0 is just a
     // hardware lsu profiling
     uint16 pinfo;
 
+    #ifdef LSU_PROFILE_DELTAS
+    // the bridge counters run from reset, the previous run's last snapshot is the baseline
+    pinfo = profile_data[0];
+    uint16 pinfo_prev = pinfo;
+    uint16 pinfo_acc = 0;
+    uint lsu_batches = 0;
+    #endif
+
     do {    
 
+        // room on chip for the pushes of this batch: spill the oldest records
+        while ((sp - bottom > STACK_HIGH) && !overflow) {
+            if (bottom + SPILL_BATCH > spill_capacity) {
+                overflow = true;
+            } else {
+                // the sets these records own leave the chip with them
+                for (uint i=0; i<SPILL_BATCH; i++) {
+                    if (evict_center_set(z0, ttbr0, stack, bottom+i, sp, cs_pool, freelist, &next_free_location, spill_flist, &next_spill_slot, spill_slots, set_spill)) {
+                        heap_consumption--;
+                        set_spills++;
+                    }
+                }
+                for (uint i=0; i<SPILL_BATCH; i++) {
+                    uint2 v = stack_t_2_vector(stack[(bottom+i) & STACK_MASK]);
+                    svm_pointer_t a = spill_stack + ((bottom+i) << 3);
+                    host_memory_bridge_st_32bit(z0, ttbr0, a, v.s0);
+                    host_memory_bridge_st_32bit(z0, ttbr0, a+4, v.s1);
+                }
+                bottom += SPILL_BATCH;
+                spills++;
+            }
+        }
+
+        // the spill region is full: end the traversal instead of overwriting records
+        if (overflow) {
+            sp = 0;
+            bottom = 0;
+        }
+
+        // the on-chip part drains: fill back the most recent block
+        if ((sp - bottom < BATCH_SIZE) && (bottom > 0)) {
+            // one 512-bit load per 8 records (the upper half carries the bridge counters)
+            for (uint l=0; l<SPILL_BATCH/8; l++) {
+                uint first = bottom - SPILL_BATCH + (l << 3);
+                ulong16 line = host_memory_bridge_ld_512bit(z0, ttbr0, spill_stack + (first << 3));
+                ulong r[8] = {line.s0, line.s1, line.s2, line.s3, line.s4, line.s5, line.s6, line.s7};
+                #pragma unroll
+                for (uint j=0; j<8; j++) {
+                    uint2 v;
+                    v.s0 = r[j] & 0xFFFFFFFF;
+                    v.s1 = r[j] >> 32;
+                    stack[(first+j) & STACK_MASK] = vector_2_stack_t(v);
+                }
+            }
+            bottom -= SPILL_BATCH;
+            fills++;
+        }
+
+        // the next batch takes records from [lo, sp), top first
+        uint lo = (sp - bottom > BATCH_SIZE) ? sp - BATCH_SIZE : bottom;
+
+        // keep room in the pool for the batch: free the sets of dead ends still queued in
+        // chan2 (nothing reads them any more), then evict the sets of records below it, oldest first
+        if (heap_consumption > CENTER_SET_HIGH) {
+            bool not_empty = true;
+            while (not_empty && (heap_consumption > CENTER_SET_LOW)) {
+                center_set_pointer_t delayed_cs = read_channel_nb_altera(chan2_data, &not_empty);
+                if (not_empty) {
+                    kernel_free(freelist, &next_free_location, delayed_cs);
+                    heap_consumption--;
+                }
+            }
+            for (uint i=bottom; (i+1 < lo) && (heap_consumption > CENTER_SET_LOW); i++) {
+                if (evict_center_set(z0, ttbr0, stack, i, sp, cs_pool, freelist, &next_free_location, spill_flist, &next_spill_slot, spill_slots, set_spill)) {
+                    heap_consumption--;
+                    set_spills++;
+                }
+            }
+        }
+
+        // the batch reads its sets from the pool: load the ones in the second tier
+        // (the record owns the copy), or fall back to all k centres if there is no room
+        for (uint i=lo; i<sp; i++) {
+            stack_t s = stack[i & STACK_MASK];
+            if (s.c >= CENTER_SET_POOL_SIZE) {
+                center_set_pointer_t slot = s.c - CENTER_SET_POOL_SIZE;
+                if (heap_consumption + (sp - lo) < CENTER_SET_POOL_SIZE-4) {
+                    center_set_pointer_t a = kernel_malloc(freelist, &next_free_location);
+                    center_set_fill(z0, ttbr0, cs_pool, a, s.k, set_spill, slot);
+                    heap_consumption++;
+                    set_fills++;
+                    s.c = a;
+                } else {
+                    s.c = cs_0;
+                    s.k = k;
+                    fallback_nodes++;
+                }
+                // the owner gives the slot up; a sibling further up can still load from it,
+                // nothing takes slots in this loop
+                if (s.d) {
+                    kernel_free(spill_flist, &next_spill_slot, slot);
+                }
+                s.d = (s.c != cs_0);
+                stack[i & STACK_MASK] = s;
+            }
+        }
 
         uint read_counter = 0;
         uint cumulative_k = 0;
@@ -206,14 +448,21 @@ __kernel void filter0 ( __global int *restrict z0,              // z0 is just a
 
         do {    
             r_sp--; 
-            stack_t s = stack[(sp!=0) ? r_sp : 0];
+            stack_t s = stack[((sp!=0) ? r_sp : 0) & STACK_MASK];
             chan0_t ch0_data;
             ch0_data.ctrl = (sp!=0) ? 1 : 0;
             ch0_data.s = s;
             cumulative_k += (sp!=0) ? s.k : 1;
             read_counter++;
             write_channel_altera(chan0_data,ch0_data);
-        }  while ( (sp!=0) && (r_sp!=0) && (read_counter < BATCH_SIZE));
+        }  while ( (sp!=0) && (r_sp!=bottom) && (read_counter < BATCH_SIZE) && (cumulative_k < work_target));
+
+        if (sp != 0) {
+            batches++;
+            batch_work_sum += cumulative_k;
+            capped_batches += ((cumulative_k < work_target) && (read_counter == BATCH_SIZE)) ? 1 : 0;
+            drained_batches += ((cumulative_k < work_target) && (read_counter < BATCH_SIZE)) ? 1 : 0;
+        }
 
         #ifdef PROFILE
         cumulative_rd_count = cumulative_rd_count+cumulative_k;
@@ -236,6 +485,12 @@ __kernel void filter0 ( __global int *restrict z0,              // z0 is just a
         center_index_t new_idx;
         bool max_heap_usage_reached1;
 
+        #ifdef CENTER_SET_BITMAP
+        center_set_t rest0;     // candidates of the current node not yet visited (loop 0, loop 1)
+        center_set_t rest1;
+        center_set_t new_set1;  // surviving candidates (loop 1), stored to new_cs1 at the end of the node
+        #endif
+
         uint inner_iteration_index0 = 0;
         uint outer_iteration_index0 = 0;
         uint readout_counter = 0;
@@ -283,10 +538,19 @@ __kernel void filter0 ( __global int *restrict z0,              // z0 is just a
             // find closest center (and its index) to comp_point              
             distance_type tmp_dist;
             center_index_t tmp_idx;
+            #ifdef CENTER_SET_BITMAP
+            // the candidates in index order: take the lowest bit left
+            if (batch_start) {
+                rest0 = cs_pool[(!terminate_loop) ? cs : cs_0];
+            }
+            tmp_idx = center_set_first(rest0);
+            center_set_remove(&rest0, tmp_idx);
+            #else
             if (!terminate_loop)
                 tmp_idx = cs_pool[(cs << KMAX_BITS)+inner_iteration_index0];
             else
                 tmp_idx = 0;
+            #endif
             data_type c = current_centers[tmp_idx];
             compute_distance(comp_point, c, &tmp_dist);
 
@@ -361,16 +625,27 @@ __kernel void filter0 ( __global int *restrict z0,              // z0 is just a
 
 
             center_index_t idx;
+            #ifdef CENTER_SET_BITMAP
+            // same order as loop 0; the register copy stays valid when new_cs1 reuses cs
+            if (batch_start) {
+                rest1 = cs_pool[(!terminate_loop) ? cs : cs_0];
+                center_set_clear(&new_set1);
+            }
+            idx = center_set_first(rest1);
+            center_set_remove(&rest1, idx);
+            #else
             if (!terminate_loop)
                 idx = cs_pool[(cs << KMAX_BITS)+inner_iteration_index1];
             else
                 idx = 0;
+            #endif
             data_type c = current_centers[idx];
 
             if (batch_start && !terminate_loop) {
                 
                 max_alloc = (max_alloc<heap_consumption) ? heap_consumption : max_alloc;
                 max_heap_usage_reached1 = (heap_consumption >= CENTER_SET_POOL_SIZE-4);
+                fallback_nodes = (max_heap_usage_reached1) ? fallback_nodes+1 : fallback_nodes;
                 
                 /*
                 bool not_empty;
@@ -406,7 +681,11 @@ __kernel void filter0 ( __global int *restrict z0,              // z0 is just a
             tooFar(search_centre1, c, tn1.bnd_lo, tn1.bnd_hi, &too_far);
             bool write_new_center = (too_far==false);
             if (write_new_center && !max_heap_usage_reached1 && !terminate_loop) {        
+                #ifdef CENTER_SET_BITMAP
+                center_set_insert(&new_set1, idx);
+                #else
                 cs_pool[(new_cs1 << KMAX_BITS)+new_idx] = idx;
+                #endif
                 #ifdef DEBUG
                 printf("%u: new center %u\n",new_idx, idx);
                 #endif 
@@ -445,6 +724,12 @@ __kernel void filter0 ( __global int *restrict z0,              // z0 is just a
 
             if (batch_end && !terminate_loop) {
 
+                #ifdef CENTER_SET_BITMAP
+                if (!max_heap_usage_reached1) {
+                    cs_pool[new_cs1] = new_set1;
+                }
+                #endif
+
                 if (deadend && !max_heap_usage_reached1) {
                     write_channel_altera(chan2_data, new_cs1);
                 }  
@@ -456,19 +741,24 @@ __kernel void filter0 ( __global int *restrict z0,              // z0 is just a
                     st0.c = new_cs1;
                     st0.k = new_k1;
                     st0.d = (max_heap_usage_reached1) ? false : true;
-                    stack[sp] = st0;                    
+                    stack[sp & STACK_MASK] = st0;                    
 
                     stack_t st1;
                     st1.u = tn1.left;
                     st1.c = new_cs1;
                     st1.k = new_k1;
                     st1.d = false;
-                    stack[sp+1] = st1;          
+                    stack[(sp+1) & STACK_MASK] = st1;          
                     sp+=2;
 
                 } 
             }
 
+            // node ownership: all points below a dead end belong to its closest centre
+            if (batch_end && deadend && !terminate_loop && (label_pass != 0)) {
+                write_snode_bundled(z0, ttbr0, u, tn1, search_idx1, label_pass);
+            }
+
             if ((batch_end && deadend) || terminate_loop ) {
                 
                 terminate = terminate_loop;
@@ -486,6 +776,15 @@ __kernel void filter0 ( __global int *restrict z0,              // z0 is just a
             inner_iteration_index1 = (batch_end) ? 0 : inner_iteration_index1 +1; 
 
         } // end of for
+
+        #ifdef LSU_PROFILE_DELTAS
+        pinfo_acc += pinfo - pinfo_prev;    // modulo 2^32, the counters wrap
+        pinfo_prev = pinfo;
+        lsu_batches += (terminate) ? 0 : 1;
+        #endif
+
+        // depth sampled between batches (sp wraps around in the terminating one)
+        max_sp = (!terminate && (sp > max_sp)) ? sp : max_sp;
         
     } while (!terminate);
 
@@ -497,6 +796,25 @@ __kernel void filter0 ( __global int *restrict z0,              // z0 is just a
     visited_nodes[0]    = vn;
     profile_data[0]     = pinfo;
 
+    // accumulated over the passes since the host cleared them
+    stack_info[0] += spills;
+    stack_info[1] += fills;
+    stack_info[2] = (max_sp > stack_info[2]) ? max_sp : stack_info[2];
+    stack_info[3] |= (overflow) ? 1 : 0;
+    stack_info[4] += set_spills;
+    stack_info[5] += set_fills;
+    stack_info[6] += fallback_nodes;
+    stack_info[7] = (max_alloc > stack_info[7]) ? max_alloc : stack_info[7];
+    stack_info[8] += batches;
+    stack_info[9] += batch_work_sum;
+    stack_info[10] += capped_batches;
+    stack_info[11] += drained_batches;
+
+    #ifdef LSU_PROFILE_DELTAS
+    pinfo_acc.sf        = lsu_batches;
+    profile_data[1]     = pinfo_acc;
+    #endif
+
 
 
 }
@@ -504,16 +822,27 @@ __kernel void filter0 ( __global int *restrict z0,              // z0 is just a
 
 __kernel void filter1 ( uint k,
                         __global int4 *restrict new_centers,
-                        __global int *restrict distortion
+                        __global int *restrict distortion,
+                        __global int4 *restrict partial_sums     // per-centre wgtCent (xyz) and count (w), used to merge with host-side results
                      )
 {
-    // set up centroid buffer
-    centroid_t centroid_buffer[KMAX];
+    // set up centroid buffer (ACC_BANKS partial copies)
+    centroid_t centroid_buffer[ACC_BANKS][KMAX];
+    for (uint b=0; b<ACC_BANKS; b++) {
+        for (uint i=0; i<k; i++) {
+            #pragma unroll
+            for (uint d=0; d<D; d++) {
+                centroid_buffer[b][i].wgtCent.value[d] = 0;
+            }
+            centroid_buffer[b][i].sum_sq = 0;
+            centroid_buffer[b][i].count = 0;
+        }
+    }
 
     bool terminate;
 
-    bool one_hot = true;
-    //#pragma ivdep
+    uint bank = 0;
+    #pragma ivdep safelen(ACC_BANKS)
     do {
 
         chan3_t ch3_data = read_channel_altera(chan3_data);   
@@ -525,39 +854,50 @@ __kernel void filter1 ( uint k,
         data_type wgtCent = ch3_data.wgtCent;
     
         if (!terminate) {
-            centroid_t selected_centroid = centroid_buffer[search_idx];
-            distance_type prev_sum_sq = (!one_hot) ? centroid_buffer[search_idx].sum_sq : 0;
-            data_type prev_wgtCent;
-            #pragma unroll
-            for (uint d=0; d<D; d++) {
-                prev_wgtCent.value[d] = (!one_hot) ? centroid_buffer[search_idx].wgtCent.value[d] : 0;
-            }
-            uint prev_count = (!one_hot) ? centroid_buffer[search_idx].count : 0;
+            centroid_t selected_centroid = centroid_buffer[bank][search_idx];
             
             #pragma unroll
             for (uint d=0; d<D; d++) {
-                centroid_buffer[search_idx].wgtCent.value[d] = /*prev_wgtCent.value[d] +*/ wgtCent.value[d];
+                selected_centroid.wgtCent.value[d] += wgtCent.value[d];
             }
-            centroid_buffer[search_idx].sum_sq = /*prev_sum_sq  +*/ sum_sq;
-            centroid_buffer[search_idx].count = /*prev_count +*/ count; 
+            selected_centroid.sum_sq += sum_sq;
+            selected_centroid.count += count; 
+
+            centroid_buffer[bank][search_idx] = selected_centroid;
         }
 
-        one_hot = false;
+        bank = (bank+1) & (ACC_BANKS-1);
 
     } while (!terminate);
 
     for(uint i=0; i<k; i++) {
         
+        // merge the banks
+        centroid_t sum = centroid_buffer[0][i];
+        #pragma unroll
+        for (uint b=1; b<ACC_BANKS; b++) {
+            #pragma unroll
+            for (uint d=0; d<D; d++) {
+                sum.wgtCent.value[d] += centroid_buffer[b][i].wgtCent.value[d];
+            }
+            sum.sum_sq += centroid_buffer[b][i].sum_sq;
+            sum.count += centroid_buffer[b][i].count;
+        }
+
         data_type c; 
-        uint count = centroid_buffer[i].count;
+        uint count = sum.count;
         count = (count == 0) ? 1 : count;
         #pragma unroll 1
         for (uint d=0; d<D; d++) {
-            c.value[d] = centroid_buffer[i].wgtCent.value[d] / (coord_type)count;
+            c.value[d] = sum.wgtCent.value[d] / (coord_type)count;
         }
         new_centers[i] = data_type_2_vector(c);
         
-        distortion[i] = centroid_buffer[i].sum_sq;
+        distortion[i] = sum.sum_sq;
+
+        int4 p = data_type_2_vector(sum.wgtCent);
+        p.s3 = sum.count;
+        partial_sums[i] = p;
     }
 
 }
@@ -32,6 +32,28 @@ int4 data_type_2_vector(data_type d) {
 }
 
 
+// stack_t as a spilled record: u, then c (bits 0-14), d (bit 15) and k (bits 16-31)
+uint2 stack_t_2_vector(stack_t s) {
+    uint2 v;
+
+    v.s0 = s.u;
+    v.s1 = (s.c & 0x7FFF) | ((s.d ? 1 : 0) << 15) | ((uint)s.k << 16);
+
+    return v;
+}
+
+stack_t vector_2_stack_t(uint2 v) {
+    stack_t s;
+
+    s.u = v.s0;
+    s.c = v.s1 & 0x7FFF;
+    s.d = ((v.s1 >> 15) & 0x1) != 0;
+    s.k = v.s1 >> 16;
+
+    return s;
+}
+
+
 void vector_2_kdTree_t(ulong16 v, kdTree_t *tn, uint16 *profiling) {        
 
     tn->count = (v.s0 >> 0) & 0xFFFFFFFF;
@@ -122,13 +144,17 @@ kdTree_t read_snode_bundled(__global int *p0,
 }
 
 
+// Write a node back as one 512-bit line. The first 14 words are the node as it
+// was read, the last two carry its owner and the tag of the pass that found it
+// (the host node is padded to 64 bytes for them).
 void write_snode_bundled(__global int *p0,
-                             svm_pointer_t ttbr0, svm_pointer_t addr, kdTree_t data)
+                             svm_pointer_t ttbr0, svm_pointer_t addr, kdTree_t data,
+                             center_index_t owner, uint pass)
 {
-    // FIXME: implement
-    // uint16 data_conv = kdTree_t_2_vector(data);
-    // host_memory_bridge_512bit (p0, ttbr0, addr, 1, data_conv);
-
+    uint16 data_conv = kdTree_t_2_vector(data);
+    data_conv.se = owner;
+    data_conv.sf = pass;
+    host_memory_bridge_st_512bit (p0, ttbr0, addr, data_conv);
 }
 
 
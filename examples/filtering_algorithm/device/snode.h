@@ -14,7 +14,9 @@
 #include "../../../svm_common/rtl_src/host_memory_bridge.h"
 
 #define D 3                         // data dimensionality
-#define KMAX_BITS 8                 // number of bits to index a center in a center set of maximal size
+#ifndef KMAX_BITS
+#define KMAX_BITS 8                 // number of bits to index a center in a center set of maximal size (up to 12 with CENTER_SET_BITMAP)
+#endif
 #define KMAX (1<<KMAX_BITS)         // max number of centers
 
 #define FRACTIONAL_BITS  6
@@ -27,6 +29,24 @@ typedef ushort center_index_t;
 typedef uint center_index_t;
 #endif
 
+// -DCENTER_SET_BITMAP: a centre set is a bitmap over the KMAX centres (bit i%32
+// of word i/32 set: centre i is a candidate) instead of a list of indices, KMAX/8
+// bytes per set instead of KMAX*sizeof(center_index_t)
+#ifdef CENTER_SET_BITMAP
+#if KMAX_BITS < 5
+#error "CENTER_SET_BITMAP needs KMAX_BITS >= 5"
+#endif
+#define CENTER_SET_WORDS (KMAX/32)
+typedef struct _center_set_t {
+    uint w[CENTER_SET_WORDS];
+} center_set_t;
+typedef center_set_t center_set_pool_t;         // element of the on-chip pool: one set
+typedef uint center_set_spill_t;                // element of a second-tier slot: one word
+#else
+typedef center_index_t center_set_pool_t;       // element of the on-chip pool: one index
+typedef center_index_t center_set_spill_t;      // element of a second-tier slot: one index
+#endif
+
 typedef uint center_set_pointer_t;
 
 typedef int coord_type;
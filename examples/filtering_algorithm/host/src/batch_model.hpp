@@ -0,0 +1,176 @@
+/**********************************************************************
+* Felix Winterstein, Imperial College London, 2016
+*
+* File: batch_model.hpp
+*
+* Revision 1.01
+* Additional Comments: distributed under an Apache-2.0 license, see LICENSE
+*
+**********************************************************************/
+
+/*
+ * Model of filter0's batch schedule.
+ *
+ * filter0 (device/filter_stream_opt1.cl) pops records from the top of its stack
+ * until the candidates they carry (the sum of their k) reach batch_work, or
+ * until the batch holds BATCH_SIZE records. Loops 0 and 1 then run one
+ * iteration per candidate each, and the batch adds the latency of the two
+ * pipelines on top: a batch with W candidates keeps them busy for about W of
+ * W+overhead cycles.
+ *
+ * The model prunes the candidate sets itself (closest candidate to the
+ * midpoint, then tooFar as in filter_cpu, model_visit) and walks
+ * the tree in filter0's order: pop the batch top first, push the children of
+ * each node that is not a dead end, right before left. It counts the batches,
+ * their candidates, the deepest stack and the most sets owned by records on the
+ * stack (one per pushed right child, as in the kernel) plus the batch's own. The
+ * spill region and the fallback to all k centres are not modelled.
+ *
+ * The tree is read through the engine's tree types (pointer_tree_t,
+ * tree_memory_tree_t). The occupancy formula is in batch_occupancy.hpp, which
+ * the no_svm host includes from this directory for its kernel counters.
+ */
+
+#ifndef BATCH_MODEL_H
+#define BATCH_MODEL_H
+
+#include <vector>
+#include <memory>
+
+#include "my_util.hpp"
+#include "filter_cpu.hpp"
+#include "batch_occupancy.hpp"
+
+struct batch_model_stats_t {
+    cl_ulong batches;
+    cl_ulong records;       // nodes visited
+    cl_ulong work;          // candidates, the iterations of loop 0 (and loop 1)
+    cl_ulong capped;        // batches closed at the record limit below the work target
+    cl_ulong drained;       // batches closed below the target because the stack ran out
+    uint max_depth;
+    uint max_sets;
+};
+
+
+// One node of filter0 (tn, as Tree::fetch gives it) with the candidates cs: the
+// candidates left for its children, NULL if it is a dead end (a leaf, or one
+// candidate left)
+typedef std::shared_ptr< std::vector<center_index_t> > model_set_ptr;
+
+static model_set_ptr model_visit(const filter_node_t &tn, const std::vector<center_index_t> &cs, const data_type *centres)
+{
+    if (tn.leaf) {
+        return model_set_ptr();
+    }
+
+    data_type comp_point;
+    for (uint d=0; d<D; d++) {
+        comp_point.value[d] = (tn.bnd_lo.value[d] + tn.bnd_hi.value[d]) >> 1;
+    }
+    center_index_t closest = cs[0];
+    distance_type min_dist = filter_cpu::compute_distance(centres[cs[0]], comp_point);
+    for (uint j=1; j<cs.size(); j++) {
+        const distance_type dist = filter_cpu::compute_distance(centres[cs[j]], comp_point);
+        if (dist < min_dist) {
+            min_dist = dist;
+            closest = cs[j];
+        }
+    }
+
+    model_set_ptr new_cs(new std::vector<center_index_t>());
+    for (uint j=0; j<cs.size(); j++) {
+        if (!filter_cpu::tooFar(centres[closest], centres[cs[j]], tn.bnd_lo, tn.bnd_hi)) {
+            new_cs->push_back(cs[j]);
+        }
+    }
+    return (new_cs->size() > 1) ? new_cs : model_set_ptr();
+}
+
+
+// all k centres, the set of a subtree root
+static model_set_ptr model_all_centres(uint k)
+{
+    model_set_ptr cs_0(new std::vector<center_index_t>(k));
+    for (center_index_t i=0; i<k; i++) {
+        (*cs_0)[i] = i;
+    }
+    return cs_0;
+}
+
+
+template<class Tree>
+static batch_model_stats_t batch_replay(const Tree &tree, typename Tree::node_ref root, const data_type *centres, uint k, uint max_records, uint batch_work)
+{
+    typedef typename Tree::node_ref node_ref;
+
+    batch_model_stats_t s = {0, 0, 0, 0, 0, 0, 0};
+
+    struct record_t {
+        node_ref u;
+        model_set_ptr cs;
+        bool owner;         // the right child, it frees the set in the kernel
+    };
+
+    const cl_ulong target = (batch_work != 0) ? batch_work : ~(cl_ulong)0;
+    std::vector<record_t> stack(1);
+    stack[0].u = root;
+    stack[0].cs = model_all_centres(k);
+    stack[0].owner = false;
+    uint owners = 0;        // records on the stack that own a set
+    std::vector<record_t> batch;
+    batch.reserve(max_records);
+    while (!stack.empty()) {
+
+        s.max_depth = (stack.size() > s.max_depth) ? stack.size() : s.max_depth;
+
+        // pop the batch, top first
+        batch.clear();
+        cl_ulong work = 0;
+        while (!stack.empty() && (batch.size() < max_records) && (work < target)) {
+            batch.push_back(stack.back());
+            stack.pop_back();
+            work += batch.back().cs->size();
+            owners -= (batch.back().owner) ? 1 : 0;
+        }
+        s.batches++;
+        s.records += batch.size();
+        s.work += work;
+        s.capped += ((work < target) && (batch.size() == max_records)) ? 1 : 0;
+        s.drained += ((work < target) && (batch.size() < max_records)) ? 1 : 0;
+
+        // each record of the batch allocates a set for its children
+        s.max_sets = (owners + batch.size() > s.max_sets) ? owners + batch.size() : s.max_sets;
+
+        for (uint i=0; i<batch.size(); i++) {
+            filter_node_t tn;
+            node_ref left_child, right_child;
+            tree.fetch(batch[i].u, &tn, &left_child, &right_child);
+            model_set_ptr new_cs = model_visit(tn, *batch[i].cs, centres);
+            if (!new_cs) {
+                continue;
+            }
+
+            record_t right = {right_child, new_cs, true};
+            record_t left = {left_child, new_cs, false};
+            stack.push_back(right);
+            stack.push_back(left);
+            owners++;
+        }
+    }
+
+    return s;
+}
+
+
+static void batch_print(const char *label, const batch_model_stats_t &s, uint overhead)
+{
+    printf("batches (%s): %llu, %.1f records and %.1f candidates each, %llu capped, %llu drained, occupancy %.1f%%, max depth %u, max sets %u\n",
+            label, (unsigned long long)s.batches,
+            (s.batches > 0) ? (double)s.records / (double)s.batches : 0.0,
+            (s.batches > 0) ? (double)s.work / (double)s.batches : 0.0,
+            (unsigned long long)s.capped, (unsigned long long)s.drained,
+            batch_occupancy(s.batches, s.work, overhead) * 100.0, s.max_depth, s.max_sets);
+}
+
+
+#endif
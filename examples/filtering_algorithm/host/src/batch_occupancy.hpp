@@ -0,0 +1,29 @@
+/**********************************************************************
+* Felix Winterstein, Imperial College London, 2016
+*
+* File: batch_occupancy.hpp
+*
+* Revision 1.01
+* Additional Comments: distributed under an Apache-2.0 license, see LICENSE
+*
+**********************************************************************/
+
+/*
+ * Pipeline occupancy of filter0's batches, shared by the SVM host (batch_model.hpp)
+ * and the no_svm host, which only reports the kernel's batch counters.
+ */
+
+#ifndef BATCH_OCCUPANCY_H
+#define BATCH_OCCUPANCY_H
+
+#include "CL/opencl.h"
+
+
+// overhead: cycles a batch adds to its candidates (the two pipelines filling and draining)
+static inline double batch_occupancy(cl_ulong batches, cl_ulong work, uint overhead)
+{
+    return (work > 0) ? (double)work / ((double)work + (double)batches * (double)overhead) : 0.0;
+}
+
+
+#endif
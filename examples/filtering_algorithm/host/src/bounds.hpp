@@ -0,0 +1,476 @@
+/**********************************************************************
+* Felix Winterstein, Imperial College London, 2016
+*
+* File: bounds.hpp
+*
+* Revision 1.01
+* Additional Comments: distributed under an Apache-2.0 license, see LICENSE
+*
+**********************************************************************/
+
+/*
+ * Distance bounds carried across Lloyd iterations (Hamerly's algorithm).
+ *
+ * An entry (a point, or a node with its box) keeps its owner a and two bounds
+ * over its points x:
+ *
+ *   u >= |x-a|,    l <= |x-c| for every other centre c
+ *
+ * An iteration that moves each centre i by delta_i adds delta_a to u and takes
+ * the largest delta off l. With s(a) the distance from a to its nearest other
+ * centre, |x-c| >= s(a) - u as well, so the owner cannot have changed while
+ *
+ *   max(l, s(a) - u) - u
+ *
+ * stays above the resolution of the fixed-point distances (otherwise
+ * compute_distance could pick another owner). If it does not, u is tightened to
+ * the farthest point of the entry from a (one distance) and the test repeated.
+ *
+ *   hamerly_points     bounds only, one entry per point (the leaves of the
+ *                      tree). A point that fails the test takes the distances
+ *                      to all k centres, which give a, u and l again.
+ *   hamerly_tree       the bounds combined with the host engine, one entry per
+ *                      dead end of the previous pass. An entry that passes is
+ *                      settled (bounded_tree_t::settled): run() adds it to its
+ *                      owner without the closest-centre search or the tooFar
+ *                      checks. If it fails, l is taken again from the nearest
+ *                      point of the box, over the other centres nearest first
+ *                      until |c-a| - u exceeds it, and the test repeated. A
+ *                      node that still fails is filtered as usual, and the dead
+ *                      ends of the pass get new entries.
+ *
+ * Both count every distance they compute: those of the bounds (bound_evals),
+ * including the k(k-1)/2 between the centres and the k of the centre shifts,
+ * and the fixed-point closest-centre distances (distance_evals), k per
+ * unsettled point or those of the engine.
+ */
+
+#ifndef BOUNDS_H
+#define BOUNDS_H
+
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <math.h>
+
+#include "my_util.hpp"
+#include "filter_cpu.hpp"
+
+// one pass with bounds
+struct bounds_stats_t {
+    cl_ulong bound_evals;       // distances of the bounds (exact, in doubles)
+    cl_ulong distance_evals;    // closest-centre distances (fixed point): of the engine, or of the unsettled points
+    cl_ulong toofar_evals;      // tooFar checks of the engine (hamerly_tree)
+    cl_ulong visited_nodes;     // node fetches of the engine (hamerly_tree)
+    uint entries;               // points or dead ends with bounds before the pass
+    uint settled;               // of those, owner unchanged by the bounds
+    double ms;
+};
+
+
+static double exact_distance(const data_type &a, const data_type &b)
+{
+    double sum = 0.0;
+    for (uint d=0; d<D; d++) {
+        const double diff = (double)a.value[d] - (double)b.value[d];
+        sum += diff*diff;
+    }
+    return sqrt(sum);
+}
+
+
+// nearest and farthest point of the box lo..hi from c
+static void box_distances(const data_type &lo, const data_type &hi, const data_type &c, double *dmin, double *dmax)
+{
+    double sum_min = 0.0;
+    double sum_max = 0.0;
+    for (uint d=0; d<D; d++) {
+        const double l = (double)lo.value[d] - (double)c.value[d];
+        const double h = (double)hi.value[d] - (double)c.value[d];
+        const double near = (l > 0.0) ? l : ((h < 0.0) ? -h : 0.0);
+        const double far = (-l > h) ? -l : h;
+        sum_min += near*near;
+        sum_max += far*far;
+    }
+    *dmin = sqrt(sum_min);
+    *dmax = sqrt(sum_max);
+}
+
+
+// the box of the points below u: a leaf's is its point
+static void node_box(const kdTree_t *u, data_type *lo, data_type *hi)
+{
+    const bool leaf = (u->left == NULL) && (u->right == NULL);
+    *lo = (leaf) ? u->wgtCent : u->bnd_lo;
+    *hi = (leaf) ? u->wgtCent : u->bnd_hi;
+}
+
+
+// compute_distance rounds D products by up to 2^-FRACTIONAL_BITS each: a point
+// whose distances differ by m has squared distances at least m^2 apart
+static double fixed_point_resolution()
+{
+    return sqrt((double)(D << FRACTIONAL_BITS));
+}
+
+
+// movement of each centre since previous (one distance each), and the largest;
+// false if previous does not hold k centres
+static bool centre_shifts(const std::vector<data_type> &previous, const data_type *centres, uint k,
+                          std::vector<double> *shift, double *max_shift, cl_ulong *evals)
+{
+    shift->assign(k, 0.0);
+    *max_shift = 0.0;
+    if (previous.size() != k) {
+        return false;
+    }
+    for (uint i=0; i<k; i++) {
+        (*shift)[i] = exact_distance(centres[i], previous[i]);
+        *max_shift = ((*shift)[i] > *max_shift) ? (*shift)[i] : *max_shift;
+    }
+    *evals += k;
+    return true;
+}
+
+
+// distances between the centres (k(k-1)/2), and per centre the others from the nearest
+struct centre_neighbours_t {
+    uint k;
+    std::vector<double> dist;                   // dist[i*k+j]
+    std::vector<center_index_t> order;          // order[i*(k-1)..]: the other centres of i, nearest first
+
+    double nearest(center_index_t i) const { return (k > 1) ? dist[i*k+order[i*(k-1)]] : HUGE_VAL; }
+
+    void compute(const data_type *centres, uint k_, cl_ulong *evals) {
+        k = k_;
+        dist.assign(k*k, 0.0);
+        for (uint i=0; i<k; i++) {
+            for (uint j=i+1; j<k; j++) {
+                dist[i*k+j] = dist[j*k+i] = exact_distance(centres[i], centres[j]);
+            }
+        }
+        *evals += k*(k-1)/2;
+        order.resize(k*(k-1));
+        for (uint i=0; i<k; i++) {
+            center_index_t *o = order.data() + i*(k-1);
+            uint n = 0;
+            for (uint j=0; j<k; j++) {
+                if (j != i) {
+                    o[n++] = j;
+                }
+            }
+            const double *row = dist.data() + i*k;
+            std::sort(o, o + n, [row](center_index_t a, center_index_t b) { return row[a] < row[b]; });
+        }
+    }
+};
+
+
+// parent of each node below root
+static void tree_parents(const kdTree_t *root, std::unordered_map<const kdTree_t*, const kdTree_t*> *parent)
+{
+    std::vector<const kdTree_t*> stack(1, root);
+    while (!stack.empty()) {
+        const kdTree_t *v = stack.back();
+        stack.pop_back();
+        if ((v->left != NULL) && (v->right != NULL)) {
+            (*parent)[v->left] = v;
+            (*parent)[v->right] = v;
+            stack.push_back(v->left);
+            stack.push_back(v->right);
+        }
+    }
+}
+
+
+// the leaf (a point) or node u as filter_cpu_accumulate takes it
+static filter_node_t bounds_node(const kdTree_t *u)
+{
+    filter_node_t tn;
+    tn.count    = u->count;
+    tn.wgtCent  = u->wgtCent;
+    tn.sum_sq   = u->sum_sq;
+    tn.bnd_lo   = u->bnd_lo;
+    tn.bnd_hi   = u->bnd_hi;
+    tn.leaf     = (u->left == NULL) && (u->right == NULL);
+    return tn;
+}
+
+
+// Bounds only: Hamerly's algorithm over the points (leaves) of the tree.
+class hamerly_points {
+public:
+
+    explicit hamerly_points(const kdTree_t *root);
+
+    // One pass from centres; centroids receives the per-centre sums.
+    void iterate(const data_type *centres, uint k, centroid_t *centroids, bounds_stats_t *stats);
+
+    uint points() const { return leaves.size(); }
+
+private:
+
+    struct entry_t {
+        center_index_t owner;
+        double u;
+        double l;
+    };
+
+    std::vector<const kdTree_t*> leaves;
+    std::vector<entry_t> bounds;        // per leaf, valid if previous holds the centres
+    std::vector<data_type> previous;
+};
+
+
+hamerly_points::hamerly_points(const kdTree_t *root)
+{
+    std::vector<const kdTree_t*> stack(1, root);
+    while (!stack.empty()) {
+        const kdTree_t *v = stack.back();
+        stack.pop_back();
+        if ((v->left == NULL) && (v->right == NULL)) {
+            leaves.push_back(v);
+        } else {
+            stack.push_back(v->right);
+            stack.push_back(v->left);
+        }
+    }
+    bounds.resize(leaves.size());
+}
+
+
+void hamerly_points::iterate(const data_type *centres, uint k, centroid_t *centroids, bounds_stats_t *stats)
+{
+    const double start_time = aocl_utils::getCurrentTimestamp();
+
+    bounds_stats_t s = {0, 0, 0, 0, 0, 0, 0.0};
+    for (uint i=0; i<k; i++) {
+        centroids[i] = filter_cpu_zero_centroid();
+    }
+
+    std::vector<double> shift;
+    double max_shift;
+    const bool have_bounds = centre_shifts(previous, centres, k, &shift, &max_shift, &s.bound_evals);
+    centre_neighbours_t neighbours;
+    neighbours.compute(centres, k, &s.bound_evals);
+    const double resolution = fixed_point_resolution();
+
+    for (uint j=0; j<leaves.size(); j++) {
+        const data_type &x = leaves[j]->wgtCent;
+        entry_t &e = bounds[j];
+
+        bool settled = false;
+        if (have_bounds) {
+            s.entries++;
+            const double s_a = neighbours.nearest(e.owner);
+            e.u += shift[e.owner];
+            e.l -= max_shift;
+            const double lower = (e.l > s_a - e.u) ? e.l : s_a - e.u;
+            settled = (lower - e.u > resolution);
+            if (!settled) {
+                e.u = exact_distance(x, centres[e.owner]);
+                s.bound_evals++;
+                const double tight = (e.l > s_a - e.u) ? e.l : s_a - e.u;
+                settled = (tight - e.u > resolution);
+            }
+            s.settled += (settled) ? 1 : 0;
+        }
+
+        // all k distances: the closest centre as the engine picks it (fixed
+        // point, ties to the lower index) and the bounds
+        if (!settled) {
+            distance_type min_dist = filter_cpu::compute_distance(centres[0], x);
+            center_index_t owner = 0;
+            for (uint i=1; i<k; i++) {
+                const distance_type dist = filter_cpu::compute_distance(centres[i], x);
+                if (dist < min_dist) {
+                    min_dist = dist;
+                    owner = i;
+                }
+            }
+            e.owner = owner;
+            e.l = HUGE_VAL;
+            for (uint i=0; i<k; i++) {
+                const double dist = exact_distance(x, centres[i]);
+                if (i == owner) {
+                    e.u = dist;
+                } else {
+                    e.l = (dist < e.l) ? dist : e.l;
+                }
+            }
+            s.distance_evals += k;
+            s.bound_evals += k;
+        }
+
+        filter_cpu_accumulate(&centroids[e.owner], centres[e.owner], bounds_node(leaves[j]));
+    }
+
+    previous.assign(centres, centres + k);
+    s.ms = (aocl_utils::getCurrentTimestamp() - start_time) * 1e3;
+    *stats = s;
+}
+
+
+// pointer_tree_t with the entries of hamerly_tree that the bounds settled for this pass
+struct bounded_tree_t : public pointer_tree_t<kdTree_t> {
+
+    struct entry_t {
+        center_index_t owner;
+        double u;
+        double l;               // -HUGE_VAL: not taken yet
+        cl_uint settled_pass;   // the pass the bounds settled the node for, 0: none
+    };
+    typedef std::unordered_map<const kdTree_t*, entry_t> bounds_map_t;
+
+    const bounds_map_t *bounds;
+
+    bounded_tree_t() : bounds(NULL) {}
+
+    bool settled(node_ref u, center_index_t *owner) const {
+        const bounds_map_t::const_iterator e = bounds->find(u);
+        if ((e == bounds->end()) || (e->second.settled_pass != pass)) {
+            return false;
+        }
+        *owner = e->second.owner;
+        return true;
+    }
+};
+
+
+// The bounds combined with the host engine: one entry per dead end of the previous pass.
+class hamerly_tree {
+public:
+
+    // pass_tag: counter of the dead-end tags (shared with the other passes that tag the tree)
+    hamerly_tree(const filter_cpu &engine, const kdTree_t *root, cl_uint *pass_tag)
+        : engine(engine), root(root), pass_tag(pass_tag) {}
+
+    // One pass from centres; centroids receives the per-centre sums.
+    void iterate(const data_type *centres, uint k, centroid_t *centroids, bounds_stats_t *stats);
+
+private:
+
+    typedef bounded_tree_t::entry_t entry_t;
+    typedef bounded_tree_t::bounds_map_t bounds_map_t;
+
+    bool settle(const kdTree_t *v, entry_t *e, const data_type *centres, const centre_neighbours_t &neighbours, cl_ulong *evals) const;
+
+    const filter_cpu &engine;
+    const kdTree_t *root;
+    cl_uint *pass_tag;
+    bounds_map_t bounds;
+    std::vector<data_type> previous;
+};
+
+
+// true if e's bounds (already moved with the centres) prove its owner; tightens them if needed
+bool hamerly_tree::settle(const kdTree_t *v, entry_t *e, const data_type *centres, const centre_neighbours_t &neighbours, cl_ulong *evals) const
+{
+    const double resolution = fixed_point_resolution();
+    const double s_a = neighbours.nearest(e->owner);
+    if (((e->l > s_a - e->u) ? e->l : s_a - e->u) - e->u > resolution) {
+        return true;
+    }
+
+    // u: the farthest point of the box, if it is closer than the moved bound
+    data_type lo, hi;
+    node_box(v, &lo, &hi);
+    double owner_min, owner_max;
+    box_distances(lo, hi, centres[e->owner], &owner_min, &owner_max);
+    (*evals)++;
+    e->u = (owner_max < e->u) ? owner_max : e->u;
+    if (((e->l > s_a - e->u) ? e->l : s_a - e->u) - e->u > resolution) {
+        return true;
+    }
+
+    // l: the nearest point of the box from the other centres, nearest centre
+    // first; centre c is at least |c-owner| - u away, which ends the search
+    const uint k = neighbours.k;
+    const center_index_t *order = neighbours.order.data() + e->owner*(k-1);
+    double l = HUGE_VAL;
+    for (uint j=0; j<k-1; j++) {
+        const double sep = neighbours.dist[e->owner*k+order[j]];
+        if (sep - e->u >= l) {
+            break;
+        }
+        double c_min, c_max;
+        box_distances(lo, hi, centres[order[j]], &c_min, &c_max);
+        (*evals)++;
+        l = (c_min < l) ? c_min : l;
+    }
+    e->l = (l > e->l) ? l : e->l;
+    return ((e->l > s_a - e->u) ? e->l : s_a - e->u) - e->u > resolution;
+}
+
+
+void hamerly_tree::iterate(const data_type *centres, uint k, centroid_t *centroids, bounds_stats_t *stats)
+{
+    const double start_time = aocl_utils::getCurrentTimestamp();
+
+    bounds_stats_t s = {0, 0, 0, 0, 0, 0, 0.0};
+
+    std::vector<double> shift;
+    double max_shift;
+    if (!centre_shifts(previous, centres, k, &shift, &max_shift, &s.bound_evals)) {
+        bounds.clear();
+    }
+    centre_neighbours_t neighbours;
+    neighbours.compute(centres, k, &s.bound_evals);
+
+    bounded_tree_t tree;
+    tree.pass = ++(*pass_tag);
+    tree.bounds = &bounds;
+
+    // settle the entries whose owner cannot have changed
+    for (bounds_map_t::iterator it = bounds.begin(); it != bounds.end(); ++it) {
+        entry_t &e = it->second;
+        s.entries++;
+        e.u += shift[e.owner];
+        e.l -= max_shift;
+        e.settled_pass = (settle(it->first, &e, centres, neighbours, &s.bound_evals)) ? tree.pass : 0;
+        s.settled += (e.settled_pass != 0) ? 1 : 0;
+    }
+
+    filter_cpu_stats_t engine_stats;
+    engine.run(tree, root, centres, k, centroids, &engine_stats);
+    s.distance_evals = engine_stats.distance_evals;
+    s.toofar_evals = engine_stats.toofar_evals;
+    s.visited_nodes = engine_stats.visited_nodes;
+
+    // the dead ends of this pass (tagged by run()) keep or get their entries; a
+    // new one starts with u from its box and l unknown
+    bounds_map_t next;
+    std::vector<const kdTree_t*> stack(1, root);
+    while (!stack.empty()) {
+        const kdTree_t *v = stack.back();
+        stack.pop_back();
+        if (v->owner_pass != tree.pass) {
+            stack.push_back(v->right);
+            stack.push_back(v->left);
+            continue;
+        }
+        const bounds_map_t::const_iterator e = bounds.find(v);
+        if ((e != bounds.end()) && (e->second.settled_pass == tree.pass)) {
+            next[v] = e->second;
+        } else {
+            entry_t n;
+            n.owner = v->owner;
+            data_type lo, hi;
+            node_box(v, &lo, &hi);
+            double owner_min;
+            box_distances(lo, hi, centres[n.owner], &owner_min, &n.u);
+            s.bound_evals++;
+            n.l = -HUGE_VAL;
+            n.settled_pass = 0;
+            next[v] = n;
+        }
+    }
+    bounds.swap(next);
+
+    previous.assign(centres, centres + k);
+    s.ms = (aocl_utils::getCurrentTimestamp() - start_time) * 1e3;
+    *stats = s;
+}
+
+
+#endif
@@ -12,6 +12,7 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <math.h>
+#include <algorithm>
 #include "build_kdTree.h"
 
 //#define PAGE_ALIGNED_ALLOC
@@ -44,6 +45,8 @@ kdTree_t* buildkdTree(data_type *data_points, uint *idx, uint n, data_type *bnd_
         leaf_node->wgtCent = data_points[*(idx+0)]; // this is just the point itself
         leaf_node->sum_sq = tmp_sum_sq;
         leaf_node->count = n;                
+        leaf_node->idx = idx;
+        leaf_node->owner_pass = 0;
 
         return leaf_node;        
 
@@ -92,6 +95,8 @@ kdTree_t* buildkdTree(data_type *data_points, uint *idx, uint n, data_type *bnd_
         int_node->bnd_hi = *bnd_hi;   
         int_node->left = left;
         int_node->right = right;  
+        int_node->idx = idx;        // the children's points are consecutive in idx
+        int_node->owner_pass = 0;
         
 
         return int_node;
@@ -102,10 +107,8 @@ kdTree_t* buildkdTree(data_type *data_points, uint *idx, uint n, data_type *bnd_
 }
 
 void deletekdTree(kdTree_t* u) {
-    if ((u->left == NULL) && (u->right == NULL)) {
-
-
-    } else {
+    // iterate down the left children, so that deep left spines (buildkdTree_chain) do not exhaust the call stack
+    while ((u->left != NULL) || (u->right != NULL)) {
         kdTree_t t = *u;
 
         //printf("count=%u\n",t.count);
@@ -115,8 +118,84 @@ void deletekdTree(kdTree_t* u) {
         #else
         free(u);
         #endif
-        deletekdTree(t.left);
         deletekdTree(t.right);
+        u = t.left;
+    }
+}
+
+
+// leaf holding point idx[i] in the box [bnd_lo, bnd_hi]
+static kdTree_t* new_chain_leaf(data_type *data_points, uint *idx, uint i, data_type bnd_lo, data_type bnd_hi)
+{
+    kdTree_t* leaf_node;
+
+    #ifndef PAGE_ALIGNED_ALLOC
+    leaf_node = new kdTree_t;
+    #else
+    if (posix_memalign((void**)&leaf_node, 64, 64) != 0)
+        printf("posix_memalign failure\n");
+    #endif
+
+    distance_type tmp_sum_sq = 0;
+    for(uint d=0; d<D; d++) {
+        coord_type tmp = get_coord(data_points,idx,i,d);
+        tmp_sum_sq += tmp*tmp;
     }
+
+    leaf_node->bnd_hi = bnd_hi;
+    leaf_node->bnd_lo = bnd_lo;
+    leaf_node->left = 0;
+    leaf_node->right = 0;
+    leaf_node->wgtCent = data_points[*(idx+i)];
+    leaf_node->sum_sq = tmp_sum_sq;
+    leaf_node->count = 1;
+    leaf_node->idx = idx+i;
+    leaf_node->owner_pass = 0;
+
+    return leaf_node;
 }
 
+
+kdTree_t* buildkdTree_chain(data_type *data_points, uint *idx, uint n, data_type *bnd_lo, data_type *bnd_hi)
+{
+    std::sort(idx, idx+n, [data_points](uint a, uint b) { return data_points[a].value[0] < data_points[b].value[0]; });
+
+    // node m holds the first m points; its box ends where its parent split off point m
+    data_type hi = *bnd_hi;
+    hi.value[0] = (n > 1) ? get_coord(data_points,idx,1,0) : bnd_hi->value[0];
+    kdTree_t* node = new_chain_leaf(data_points, idx, 0, *bnd_lo, hi);
+
+    for (uint m=2; m<=n; m++) {
+        data_type node_hi = *bnd_hi;
+        if (m < n) {
+            node_hi.value[0] = get_coord(data_points,idx,m,0);
+        }
+        data_type leaf_lo = *bnd_lo;
+        leaf_lo.value[0] = get_coord(data_points,idx,m-1,0);
+        kdTree_t* right = new_chain_leaf(data_points, idx, m-1, leaf_lo, node_hi);
+
+        #ifndef PAGE_ALIGNED_ALLOC
+        kdTree_t* int_node = new kdTree_t;
+        #else
+        kdTree_t *int_node;
+        if (posix_memalign((void**)&int_node, 64, 64) != 0)
+            printf("posix_memalign failure\n");
+        #endif
+
+        for (uint d=0; d<D; d++) {
+            int_node->wgtCent.value[d] = node->wgtCent.value[d] + right->wgtCent.value[d];
+        }
+        int_node->sum_sq = node->sum_sq + right->sum_sq;
+        int_node->count = m;
+        int_node->bnd_lo = *bnd_lo;
+        int_node->bnd_hi = node_hi;
+        int_node->left = node;
+        int_node->right = right;
+        int_node->idx = idx;
+        int_node->owner_pass = 0;
+
+        node = int_node;
+    }
+
+    return node;
+}
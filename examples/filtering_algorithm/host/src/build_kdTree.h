@@ -20,6 +20,12 @@ extern "C" {
 kdTree_t* buildkdTree(data_type *data_points, uint *idx, uint n, data_type *bnd_lo, data_type *bnd_hi);
 void deletekdTree(kdTree_t* u);
 
+// Degenerate (linked-list-shaped) tree for testing deep traversals: the
+// points sorted along the first dimension, every inner node of m points splits
+// off point m-1 as its right child (a leaf) and keeps the others in its left
+// child, so the depth is n-1. Reorders idx.
+kdTree_t* buildkdTree_chain(data_type *data_points, uint *idx, uint n, data_type *bnd_lo, data_type *bnd_hi);
+
 #ifdef	__cplusplus
 }
 #endif
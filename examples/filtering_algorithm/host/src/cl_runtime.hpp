@@ -0,0 +1,371 @@
+/**********************************************************************
+* Felix Winterstein, Imperial College London, 2016
+*
+* File: cl_runtime.hpp
+*
+* Revision 1.01
+* Additional Comments: distributed under an Apache-2.0 license, see LICENSE
+*
+**********************************************************************/
+
+/*
+ * Thin host runtime layer on top of AOCLUtils for repeated runs.
+ *
+ * Device buffers are pooled by flags and size class (next power of two) and
+ * host staging buffers (64-byte aligned, as the runtime wants them for DMA)
+ * by size class. Both are handed out by tag: a buffer released under a tag
+ * goes back to the same user on the next run, so its handle, and hence every
+ * kernel argument bound to it, stays the same. fresh tells the caller whether
+ * the contents are left over from its own previous use.
+ *
+ * Kernel argument bindings are cached per (kernel, index); clSetKernelArg is
+ * only called when the value changes.
+ *
+ * All calls going through the layer are counted and timed, so a run can
+ * report how many host API calls it issued. With reuse disabled every buffer
+ * is created and released and every argument set, as without the layer.
+ */
+
+#ifndef CL_RUNTIME_H
+#define CL_RUNTIME_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include "CL/opencl.h"
+#include "AOCLUtils/aocl_utils.h"
+
+#define CL_RUNTIME_MIN_CLASS    64      // bytes, also the staging alignment
+
+using aocl_utils::_checkError;          // for checkError()
+
+
+// host API calls issued through cl_runtime_t
+struct cl_api_counts_t {
+    uint buffers_created;
+    uint buffers_released;
+    uint buffers_reused;
+    uint staging_allocated;
+    uint staging_reused;
+    uint args_set;
+    uint args_cached;
+    uint writes;
+    uint reads;
+    uint tasks;
+    double api_ms;              // time spent in the counted calls
+};
+
+
+class cl_runtime_t {
+public:
+
+    cl_runtime_t() : context(NULL), reuse(true) {
+        reset_counts();
+    }
+
+    void init(cl_context context, bool reuse) {
+        this->context = context;
+        this->reuse = reuse;
+    }
+
+    bool reusing() const { return reuse; }
+
+    // device buffer of at least size bytes
+    cl_mem buffer(cl_mem_flags flags, size_t size, const char *tag, bool *fresh = NULL);
+
+    // return a buffer from buffer() to the pool
+    void release(cl_mem mem);
+
+    // 64-byte aligned host buffer of at least size bytes
+    void *staging(size_t size, const char *tag, bool *fresh = NULL);
+    void release_staging(void *ptr);
+
+    // clSetKernelArg unless index is already bound to the same value
+    void set_arg(cl_kernel kernel, cl_uint index, size_t size, const void *value);
+
+    cl_int write(cl_command_queue queue, cl_mem mem, cl_bool blocking, size_t offset, size_t size, const void *ptr,
+                 cl_uint num_events, const cl_event *wait_list, cl_event *event) {
+        const double start = aocl_utils::getCurrentTimestamp();
+        cl_int status = clEnqueueWriteBuffer(queue, mem, blocking, offset, size, ptr, num_events, wait_list, event);
+        count.writes++;
+        count.api_ms += (aocl_utils::getCurrentTimestamp() - start) * 1e3;
+        return status;
+    }
+
+    cl_int read(cl_command_queue queue, cl_mem mem, cl_bool blocking, size_t offset, size_t size, void *ptr,
+                cl_uint num_events, const cl_event *wait_list, cl_event *event) {
+        const double start = aocl_utils::getCurrentTimestamp();
+        cl_int status = clEnqueueReadBuffer(queue, mem, blocking, offset, size, ptr, num_events, wait_list, event);
+        count.reads++;
+        count.api_ms += (aocl_utils::getCurrentTimestamp() - start) * 1e3;
+        return status;
+    }
+
+    cl_int task(cl_command_queue queue, cl_kernel kernel, cl_uint num_events, const cl_event *wait_list, cl_event *event) {
+        const double start = aocl_utils::getCurrentTimestamp();
+        cl_int status = clEnqueueTask(queue, kernel, num_events, wait_list, event);
+        count.tasks++;
+        count.api_ms += (aocl_utils::getCurrentTimestamp() - start) * 1e3;
+        return status;
+    }
+
+    const cl_api_counts_t &counts() const { return count; }
+
+    void reset_counts() {
+        memset(&count, 0, sizeof(cl_api_counts_t));
+    }
+
+    void report(const char *label) const {
+        printf("Host API calls (%s): buffers %u created, %u released, %u reused | staging %u allocated, %u reused | kernel args %u set, %u cached | enqueues %u write, %u task, %u read | %0.3f ms in API calls\n",
+                label, count.buffers_created, count.buffers_released, count.buffers_reused,
+                count.staging_allocated, count.staging_reused, count.args_set, count.args_cached,
+                count.writes, count.tasks, count.reads, count.api_ms);
+    }
+
+    // release everything held by the pools
+    void cleanup();
+
+private:
+
+    struct pooled_buffer_t {
+        cl_mem mem;
+        cl_mem_flags flags;
+        size_t size;            // size class
+        std::string tag;
+        bool in_use;
+    };
+
+    struct pooled_staging_t {
+        void *ptr;
+        size_t size;
+        std::string tag;
+        bool in_use;
+    };
+
+    struct arg_binding_t {
+        cl_kernel kernel;
+        cl_uint index;
+        std::vector<unsigned char> value;
+    };
+
+    static size_t size_class(size_t size) {
+        size_t c = CL_RUNTIME_MIN_CLASS;
+        while (c < size) {
+            c <<= 1;
+        }
+        return c;
+    }
+
+    void destroy(cl_mem mem);
+    void forget_bindings(cl_mem mem);
+
+    cl_context context;
+    bool reuse;
+
+    std::vector<pooled_buffer_t> buffers;
+    std::vector<pooled_staging_t> stagings;
+    std::vector<arg_binding_t> bindings;
+
+    cl_api_counts_t count;
+};
+
+
+cl_mem cl_runtime_t::buffer(cl_mem_flags flags, size_t size, const char *tag, bool *fresh)
+{
+    const size_t c = size_class(size);
+
+    if (reuse) {
+        // same tag first, then any free buffer of the class
+        int match = -1;
+        for (uint i=0; i<buffers.size(); i++) {
+            pooled_buffer_t &b = buffers[i];
+            if (!b.in_use && (b.flags == flags) && (b.size == c)) {
+                if (b.tag == tag) {
+                    match = i;
+                    break;
+                }
+                match = (match < 0) ? (int)i : match;
+            }
+        }
+        if (match >= 0) {
+            pooled_buffer_t &b = buffers[match];
+            if (fresh != NULL) {
+                *fresh = (b.tag != tag);
+            }
+            b.tag = tag;
+            b.in_use = true;
+            count.buffers_reused++;
+            return b.mem;
+        }
+    }
+
+    cl_int status;
+    const double start = aocl_utils::getCurrentTimestamp();
+    cl_mem mem = clCreateBuffer(context, flags, reuse ? c : size, NULL, &status);
+    count.api_ms += (aocl_utils::getCurrentTimestamp() - start) * 1e3;
+    checkError(status, "Failed to create buffer (%s)", tag);
+    count.buffers_created++;
+
+    pooled_buffer_t b = {mem, flags, c, tag, true};
+    buffers.push_back(b);
+    if (fresh != NULL) {
+        *fresh = true;
+    }
+    return mem;
+}
+
+
+void cl_runtime_t::release(cl_mem mem)
+{
+    for (uint i=0; i<buffers.size(); i++) {
+        if (buffers[i].mem == mem) {
+            if (reuse) {
+                buffers[i].in_use = false;
+            } else {
+                destroy(mem);
+                buffers.erase(buffers.begin() + i);
+            }
+            return;
+        }
+    }
+}
+
+
+void *cl_runtime_t::staging(size_t size, const char *tag, bool *fresh)
+{
+    const size_t c = size_class(size);
+
+    if (reuse) {
+        int match = -1;
+        for (uint i=0; i<stagings.size(); i++) {
+            pooled_staging_t &s = stagings[i];
+            if (!s.in_use && (s.size == c)) {
+                if (s.tag == tag) {
+                    match = i;
+                    break;
+                }
+                match = (match < 0) ? (int)i : match;
+            }
+        }
+        if (match >= 0) {
+            pooled_staging_t &s = stagings[match];
+            if (fresh != NULL) {
+                *fresh = (s.tag != tag);
+            }
+            s.tag = tag;
+            s.in_use = true;
+            count.staging_reused++;
+            return s.ptr;
+        }
+    }
+
+    void *ptr = NULL;
+    if (posix_memalign(&ptr, CL_RUNTIME_MIN_CLASS, c) != 0) {
+        checkError(CL_OUT_OF_HOST_MEMORY, "Failed to allocate staging buffer (%s)", tag);
+    }
+    count.staging_allocated++;
+
+    pooled_staging_t s = {ptr, c, tag, true};
+    stagings.push_back(s);
+    if (fresh != NULL) {
+        *fresh = true;
+    }
+    return ptr;
+}
+
+
+void cl_runtime_t::release_staging(void *ptr)
+{
+    for (uint i=0; i<stagings.size(); i++) {
+        if (stagings[i].ptr == ptr) {
+            if (reuse) {
+                stagings[i].in_use = false;
+            } else {
+                free(ptr);
+                stagings.erase(stagings.begin() + i);
+            }
+            return;
+        }
+    }
+}
+
+
+void cl_runtime_t::set_arg(cl_kernel kernel, cl_uint index, size_t size, const void *value)
+{
+    const unsigned char *bytes = (const unsigned char*)value;
+
+    arg_binding_t *binding = NULL;
+    for (uint i=0; i<bindings.size(); i++) {
+        if ((bindings[i].kernel == kernel) && (bindings[i].index == index)) {
+            binding = &bindings[i];
+            break;
+        }
+    }
+
+    if (reuse && (binding != NULL) && (binding->value.size() == size) && (memcmp(&binding->value[0], bytes, size) == 0)) {
+        count.args_cached++;
+        return;
+    }
+
+    const double start = aocl_utils::getCurrentTimestamp();
+    cl_int status = clSetKernelArg(kernel, index, size, value);
+    count.api_ms += (aocl_utils::getCurrentTimestamp() - start) * 1e3;
+    checkError(status, "Failed to set argument %d", index);
+    count.args_set++;
+
+    if (binding == NULL) {
+        arg_binding_t b;
+        b.kernel = kernel;
+        b.index = index;
+        bindings.push_back(b);
+        binding = &bindings.back();
+    }
+    binding->value.assign(bytes, bytes + size);
+}
+
+
+void cl_runtime_t::cleanup()
+{
+    for (uint i=0; i<buffers.size(); i++) {
+        destroy(buffers[i].mem);
+    }
+    buffers.clear();
+    for (uint i=0; i<stagings.size(); i++) {
+        free(stagings[i].ptr);
+    }
+    stagings.clear();
+    bindings.clear();
+}
+
+
+void cl_runtime_t::destroy(cl_mem mem)
+{
+    const double start = aocl_utils::getCurrentTimestamp();
+    clReleaseMemObject(mem);
+    count.api_ms += (aocl_utils::getCurrentTimestamp() - start) * 1e3;
+    count.buffers_released++;
+
+    // the runtime may hand out the same handle for a new buffer
+    forget_bindings(mem);
+}
+
+
+void cl_runtime_t::forget_bindings(cl_mem mem)
+{
+    for (uint i=0; i<bindings.size(); ) {
+        if ((bindings[i].value.size() == sizeof(cl_mem)) && (memcmp(&bindings[i].value[0], &mem, sizeof(cl_mem)) == 0)) {
+            bindings.erase(bindings.begin() + i);
+        } else {
+            i++;
+        }
+    }
+}
+
+
+cl_runtime_t cl_runtime;
+
+
+#endif
@@ -0,0 +1,217 @@
+/**********************************************************************
+* Felix Winterstein, Imperial College London, 2016
+*
+* File: engine_model.hpp
+*
+* Revision 1.01
+* Additional Comments: distributed under an Apache-2.0 license, see LICENSE
+*
+**********************************************************************/
+
+/*
+ * Model of replicated traversal engines.
+ *
+ * N copies of filter0, each with its own stack and centre-set pool, share the
+ * traversal and feed A accumulators (filter1). Each engine runs filter0's batch
+ * schedule (batch_model.hpp): a batch of W candidates takes W+overhead cycles
+ * and pushes its children when it ends. An engine whose stack is empty gets new
+ * work in one of two ways, which costs a request to the other engine or to host
+ * memory (steal latency):
+ *
+ *   ENGINE_STEAL   it takes the bottom record (the largest subtree, with its
+ *                  candidates) of the engine with the most records left; one
+ *                  engine starts at the root
+ *   ENGINE_QUEUE   it takes the next subtree root of a shared queue in host
+ *                  memory, with all k centres; the tree is cut at a fixed depth
+ *                  and the nodes above the cut are not visited, as in the
+ *                  multi-instance traversal (multi_device.hpp)
+ *
+ * The engines are simulated event by event in cycles. Dead ends go to
+ * accumulator (engine mod A), which takes one per cycle: the pass takes the
+ * longer of the engines' makespan and the busiest accumulator's dead ends.
+ * filter_cpu schedules its threads like ENGINE_STEAL (a thread takes the
+ * oldest item of another's queue), so the host engine with one thread per
+ * engine checks the balance the model predicts.
+ */
+
+#ifndef ENGINE_MODEL_H
+#define ENGINE_MODEL_H
+
+#include <vector>
+#include <deque>
+
+#include "my_util.hpp"
+#include "batch_model.hpp"
+
+enum engine_policy_t {
+    ENGINE_STEAL,
+    ENGINE_QUEUE
+};
+
+struct engine_model_stats_t {
+    cl_ulong cycles;        // of the pass: makespan, or the accumulators if they take longer
+    cl_ulong makespan;      // last batch of any engine done
+    cl_ulong busy;          // cycles in batches, all engines
+    cl_ulong work;          // candidates, all engines
+    cl_ulong steals;        // records or subtree roots taken
+    cl_ulong deadends;
+    cl_ulong acc_cycles;    // dead ends of the busiest accumulator
+};
+
+
+static engine_model_stats_t engine_replay(const kdTree_t *root, const data_type *centres, uint k, uint engines, engine_policy_t policy,
+                                          uint cut_depth, uint steal_latency, uint accumulators, uint max_records, uint batch_work, uint overhead)
+{
+    engine_model_stats_t s = {0, 0, 0, 0, 0, 0, 0};
+
+    struct record_t {
+        const kdTree_t *u;
+        model_set_ptr cs;
+    };
+    struct engine_t {
+        std::deque<record_t> stack;     // top at the back
+        std::vector<record_t> pending;  // children of the running batch, or a stolen record
+        cl_ulong t;                     // free at
+        bool done;
+    };
+
+    pointer_tree_t<kdTree_t> tree;
+    std::vector<engine_t> e(engines);
+    for (uint i=0; i<engines; i++) {
+        e[i].t = 0;
+        e[i].done = false;
+    }
+
+    const model_set_ptr cs_0 = model_all_centres(k);
+    std::vector<record_t> queue;
+    uint next_root = 0;
+    if (policy == ENGINE_QUEUE) {
+        std::vector< std::pair<const kdTree_t*, uint> > walk(1, std::make_pair(root, cut_depth));
+        while (!walk.empty()) {
+            const kdTree_t *u = walk.back().first;
+            const uint depth = walk.back().second;
+            walk.pop_back();
+            if ((depth == 0) || ((u->left == NULL) && (u->right == NULL))) {
+                record_t r = {u, cs_0};
+                queue.push_back(r);
+            } else {
+                walk.push_back(std::make_pair(u->right, depth-1));
+                walk.push_back(std::make_pair(u->left, depth-1));
+            }
+        }
+    } else {
+        record_t r = {root, cs_0};
+        e[0].stack.push_back(r);
+    }
+
+    const cl_ulong target = (batch_work != 0) ? batch_work : ~(cl_ulong)0;
+    std::vector<cl_ulong> acc(accumulators, 0);
+
+    for (;;) {
+
+        // the engine that gets free first
+        uint i = engines;
+        for (uint j=0; j<engines; j++) {
+            if (!e[j].done && ((i == engines) || (e[j].t < e[i].t))) {
+                i = j;
+            }
+        }
+        if (i == engines) {
+            break;
+        }
+        engine_t &x = e[i];
+        x.stack.insert(x.stack.end(), x.pending.begin(), x.pending.end());
+        x.pending.clear();
+
+        if (!x.stack.empty()) {
+            // one batch, top first; its children become visible when it ends
+            std::vector<record_t> batch;
+            cl_ulong work = 0;
+            while (!x.stack.empty() && (batch.size() < max_records) && (work < target)) {
+                batch.push_back(x.stack.back());
+                x.stack.pop_back();
+                work += batch.back().cs->size();
+            }
+            for (uint b=0; b<batch.size(); b++) {
+                filter_node_t tn;
+                const kdTree_t *left_child, *right_child;
+                tree.fetch(batch[b].u, &tn, &left_child, &right_child);
+                model_set_ptr new_cs = model_visit(tn, *batch[b].cs, centres);
+                if (!new_cs) {
+                    s.deadends++;
+                    acc[i % accumulators]++;
+                    continue;
+                }
+                record_t right = {right_child, new_cs};
+                record_t left = {left_child, new_cs};
+                x.pending.push_back(right);
+                x.pending.push_back(left);
+            }
+            x.t += work + overhead;
+            s.busy += work + overhead;
+            s.work += work;
+            s.makespan = (x.t > s.makespan) ? x.t : s.makespan;
+            continue;
+        }
+
+        // idle: take a subtree root from the queue, or the bottom record of the fullest peer
+        if (policy == ENGINE_QUEUE) {
+            if (next_root < queue.size()) {
+                x.pending.push_back(queue[next_root++]);
+                x.t += steal_latency;
+                s.steals++;
+                continue;
+            }
+        } else {
+            uint victim = engines;
+            for (uint j=0; j<engines; j++) {
+                if ((j != i) && !e[j].stack.empty() && ((victim == engines) || (e[j].stack.size() > e[victim].stack.size()))) {
+                    victim = j;
+                }
+            }
+            if (victim != engines) {
+                x.pending.push_back(e[victim].stack.front());
+                e[victim].stack.pop_front();
+                x.t += steal_latency;
+                s.steals++;
+                continue;
+            }
+        }
+
+        // nothing to take now: wait for the next engine to finish a batch, or stop
+        // if none is running (no more work will appear)
+        cl_ulong next = 0;
+        bool running = false;
+        for (uint j=0; j<engines; j++) {
+            if ((j != i) && !e[j].done && !e[j].pending.empty()) {
+                next = (!running || (e[j].t < next)) ? e[j].t : next;
+                running = true;
+            }
+        }
+        if (running) {
+            x.t = (next > x.t) ? next+1 : x.t+1;
+        } else {
+            x.done = true;
+        }
+    }
+
+    for (uint a=0; a<accumulators; a++) {
+        s.acc_cycles = (acc[a] > s.acc_cycles) ? acc[a] : s.acc_cycles;
+    }
+    s.cycles = (s.acc_cycles > s.makespan) ? s.acc_cycles : s.makespan;
+    return s;
+}
+
+
+static void engine_print(const char *label, uint engines, const engine_model_stats_t &s, cl_ulong single_cycles)
+{
+    printf("engines (%s, %u): %llu cycles (accumulators %llu), speed-up %.2f, engines %.1f%% busy, %.1f candidates per cycle, %llu steal(s)\n",
+            label, engines, (unsigned long long)s.cycles, (unsigned long long)s.acc_cycles,
+            (s.cycles > 0) ? (double)single_cycles / (double)s.cycles : 0.0,
+            (s.makespan > 0) ? (double)s.busy * 100.0 / ((double)s.makespan * (double)engines) : 0.0,
+            (s.cycles > 0) ? (double)s.work / (double)s.cycles : 0.0,
+            (unsigned long long)s.steals);
+}
+
+
+#endif
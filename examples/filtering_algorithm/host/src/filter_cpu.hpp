@@ -0,0 +1,1284 @@
+/**********************************************************************
+* Felix Winterstein, Imperial College London, 2016
+*
+* File: filter_cpu.hpp
+*
+* Revision 1.01
+* Additional Comments: distributed under an Apache-2.0 license, see LICENSE
+*
+**********************************************************************/
+
+/*
+ * Multi-threaded host implementation of the filtering algorithm.
+ *
+ * This is a reference for the two kernels in device/filter_stream_opt1.cl:
+ * it uses the same candidate sets, the same tooFar pruning rule and the same
+ * fixed-point arithmetic (mul_scale), so that the new centres and the per-centre
+ * distortion are bit-identical to what filter0/filter1 compute. The only
+ * intended difference is that the candidate-set heap is unbounded, i.e. the
+ * device's fallback to all K centres (max_heap_usage_reached) never happens.
+ *
+ * The engine traverses either the pointer-based kd-tree built by buildkdTree
+ * (pointer_tree_t) or the packed tree_memory array of the no_svm host
+ * (tree_memory_tree_t). Subtrees are distributed over threads with work
+ * stealing; each thread accumulates into its own centroid buffer and the
+ * buffers are reduced at the end. A tree type can settle nodes whose owner it
+ * already knows (settled(), the distance bounds of bounds.hpp): run() adds
+ * them to that owner like dead ends, without filtering them.
+ *
+ * Candidate sets store the centre positions in SoA form, so that the
+ * closest-centre search and the tooFar checks evaluate FILTER_CPU_LANES
+ * candidates per instruction (AVX-512, AVX2 or NEON, whichever the compiler
+ * targets) and the surviving candidates are compacted with the resulting mask.
+ *
+ * With bitmap sets (filter_cpu(..., bitmap=true), run() only), a candidate
+ * set is one bit per centre instead of a list of indices and positions: the
+ * candidates are evaluated FILTER_CPU_LANES centres at a time from the full SoA
+ * table of the pass, skipping lane groups without candidates, and the survivors
+ * of a pruning step are just the AND of the keep mask with the parent's bits.
+ * Both representations give the same results (candidates in index order).
+ *
+ * run_batch() evaluates several restarts (independent initial centre sets) in
+ * one traversal. A work item then carries one candidate set per restart and a
+ * node is fetched once for all restarts that are still active below it.
+ */
+
+#ifndef FILTER_CPU_H
+#define FILTER_CPU_H
+
+#include <vector>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <atomic>
+
+#if defined(__AVX512F__)
+#include <immintrin.h>
+#define FILTER_CPU_LANES 16
+#elif defined(__AVX2__)
+#include <immintrin.h>
+#define FILTER_CPU_LANES 8
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define FILTER_CPU_LANES 4
+#else
+#define FILTER_CPU_LANES 1
+#endif
+
+#include "my_util.hpp"
+
+#ifndef FRACTIONAL_BITS
+#define FRACTIONAL_BITS  6      // fixed-point format, must match device/snode.h
+#endif
+
+typedef uint center_index_t;
+
+// per-centre accumulator (same as centroid_t in device/snode.h)
+struct centroid_t {
+    data_type wgtCent;
+    distance_type sum_sq;
+    uint count;
+};
+
+// a tree node as seen by the traversal, independent of the memory layout
+struct filter_node_t {
+    uint count;
+    data_type wgtCent;
+    distance_type sum_sq;
+    data_type bnd_lo;
+    data_type bnd_hi;
+    bool leaf;
+};
+
+// engine statistics (summed over all threads)
+struct filter_cpu_stats_t {
+    cl_ulong visited_nodes;      // node fetches
+    cl_ulong deadends;           // nodes whose subtree was assigned to a single centre
+    cl_ulong distance_evals;     // closest-centre distance computations
+    cl_ulong toofar_evals;       // tooFar checks
+    cl_ulong max_thread_evals;   // distance computations of the busiest thread (the balance over the threads)
+    cl_ulong steals;             // work items taken from another thread's queue
+    double time_ms;              // wall-clock time of run()
+};
+
+
+// kd-tree allocated on the host heap (kdTree_t with child pointers)
+template<class node_t>
+struct pointer_tree_t {
+    typedef const node_t* node_ref;
+
+    // != 0: run() tags the dead ends with their owner, as filter0 does with -labels
+    // (node_t::owner, node_t::owner_pass; the incremental pass reads them)
+    cl_uint pass;
+
+    pointer_tree_t() : pass(0) {}
+
+    void fetch(node_ref u, filter_node_t *tn, node_ref *left, node_ref *right) const {
+        tn->count   = u->count;
+        tn->wgtCent = u->wgtCent;
+        tn->sum_sq  = u->sum_sq;
+        tn->bnd_lo  = u->bnd_lo;
+        tn->bnd_hi  = u->bnd_hi;
+        tn->leaf    = (u->left == 0) && (u->right == 0);
+        *left       = u->left;
+        *right      = u->right;
+    }
+
+    void own(node_ref u, center_index_t owner) const {
+        if (pass != 0) {
+            const_cast<node_t*>(u)->owner = owner;
+            const_cast<node_t*>(u)->owner_pass = pass;
+        }
+    }
+
+    // true if the owner of all points below u is known without filtering (the
+    // distance bounds of bounds.hpp): run() makes u a dead end of owner right away
+    bool settled(node_ref u, center_index_t *owner) const { return false; }
+};
+
+// kd-tree packed into a cl_uint16 array (tree_memory, see kdTree_t_2_vector of the no_svm host)
+struct tree_memory_tree_t {
+    typedef uint node_ref;
+
+    const cl_uint16 *tree_memory;
+
+    tree_memory_tree_t(const cl_uint16 *mem) : tree_memory(mem) {}
+
+    void fetch(node_ref u, filter_node_t *tn, node_ref *left, node_ref *right) const {
+        const cl_uint16 v = tree_memory[u];
+        tn->count               = v.s0;
+        tn->wgtCent.value[0]    = v.s1;
+        tn->wgtCent.value[1]    = v.s2;
+        tn->wgtCent.value[2]    = v.s3;
+        tn->sum_sq              = v.s4;
+        tn->bnd_lo.value[0]     = v.s5;
+        tn->bnd_lo.value[1]     = v.s6;
+        tn->bnd_lo.value[2]     = v.s7;
+        tn->bnd_hi.value[0]     = v.s8;
+        tn->bnd_hi.value[1]     = v.s9;
+        tn->bnd_hi.value[2]     = v.sa;
+        tn->leaf                = (v.sb == 0) && (v.sc == 0);
+        *left                   = v.sb;
+        *right                  = v.sc;
+    }
+
+    void own(node_ref u, center_index_t owner) const {}
+
+    bool settled(node_ref u, center_index_t *owner) const { return false; }
+};
+
+
+// candidate set: indices of the centres that may own (part of) a subtree,
+// together with their positions stored dimension by dimension
+struct candidate_set_t {
+    uint k;
+    uint stride;
+    std::vector<center_index_t> idx;
+    std::vector<coord_type> pos;    // pos[d*stride+i] is coordinate d of candidate i
+
+    explicit candidate_set_t(uint capacity) : k(0), stride(capacity), idx(capacity), pos(D*capacity) {}
+
+    const coord_type *coord(uint d) const { return pos.data() + d*stride; }
+    coord_type *coord(uint d) { return pos.data() + d*stride; }
+
+    data_type position(uint i) const {
+        data_type p;
+        for (uint d=0; d<D; d++) {
+            p.value[d] = pos[d*stride+i];
+        }
+        return p;
+    }
+
+    void push_back(center_index_t i, data_type p) {
+        idx[k] = i;
+        for (uint d=0; d<D; d++) {
+            pos[d*stride+k] = p.value[d];
+        }
+        k++;
+    }
+};
+typedef std::shared_ptr<const candidate_set_t> candidate_set_ptr;
+
+// candidate set as a bitmap over the k centres of the pass (bit i of bits[i/64]:
+// centre i is a candidate), k is the number of bits set
+struct candidate_mask_t {
+    uint k;
+    std::vector<cl_ulong> bits;
+
+    explicit candidate_mask_t(uint capacity) : k(0), bits((capacity+63)/64, 0) {}
+
+    void push_back(center_index_t i) {
+        bits[i >> 6] |= (cl_ulong)1 << (i & 63);
+        k++;
+    }
+};
+
+
+class filter_cpu {
+public:
+
+    explicit filter_cpu(uint num_threads = 0, bool simd = true, bool bitmap = false) : use_simd(simd), use_bitmap(bitmap) {
+        n_threads = (num_threads > 0) ? num_threads : std::thread::hardware_concurrency();
+        n_threads = (n_threads > 0) ? n_threads : 1;
+    }
+
+    uint threads() const { return n_threads; }
+
+    // instruction set used for candidate evaluation
+    const char *isa() const {
+        if (!use_simd || (FILTER_CPU_LANES == 1)) {
+            return "scalar";
+        }
+        return (FILTER_CPU_LANES == 16) ? "AVX-512" : ((FILTER_CPU_LANES == 8) ? "AVX2" : "NEON");
+    }
+
+    // candidate-set representation of run()
+    const char *sets() const { return (use_bitmap) ? "bitmap" : "list"; }
+
+    // One filtering pass (filter0 + filter1) over the subtree rooted at root.
+    // centroids must hold k entries; they are overwritten.
+    template<class Tree>
+    void run(const Tree &tree, typename Tree::node_ref root, const data_type *centres, uint k,
+             centroid_t *centroids, filter_cpu_stats_t *stats) const;
+
+    // Same over a list of disjoint subtrees, each starting with all k candidates
+    // (as filter0 does with its list of subtree roots). If visited_per_root is not
+    // NULL, it receives the number of node fetches spent in each subtree.
+    template<class Tree>
+    void run(const Tree &tree, const std::vector<typename Tree::node_ref> &roots, const data_type *centres, uint k,
+             centroid_t *centroids, filter_cpu_stats_t *stats, std::vector<cl_ulong> *visited_per_root = NULL) const;
+
+    // One filtering pass for m independent centre sets (restarts) in a single
+    // traversal: each node is fetched once and evaluated against the candidate
+    // sets of all restarts that have not reached a dead end above it. centres
+    // and centroids hold m*k entries (restart r at offset r*k). If
+    // fetches_per_restart is not NULL, it receives the number of node fetches
+    // each restart would have needed on its own.
+    template<class Tree>
+    void run_batch(const Tree &tree, typename Tree::node_ref root, const data_type *centres, uint k, uint m,
+                   centroid_t *centroids, filter_cpu_stats_t *stats, std::vector<cl_ulong> *fetches_per_restart = NULL) const;
+
+    // multiply and scale two coords
+    static distance_type mul_scale(coord_type op1, coord_type op2) {
+        distance_type result = (distance_type)(op1*op2);
+        return result >> FRACTIONAL_BITS;
+    }
+
+    // inner product of p1 and p2 (unscaled)
+    static distance_type dot_product(data_type p1, data_type p2) {
+        distance_type tmp = 0;
+        for (uint d=0; d<D; d++) {
+            tmp += p1.value[d]*p2.value[d];
+        }
+        return tmp;
+    }
+
+    // Euclidean distance between p1 and p2
+    static distance_type compute_distance(data_type p1, data_type p2) {
+        distance_type tmp_dist = 0;
+        for (uint d=0; d<D; d++) {
+            coord_type tmp = p1.value[d]-p2.value[d];
+            tmp_dist += mul_scale(tmp,tmp);
+        }
+        return tmp_dist;
+    }
+
+    // check whether any point of the bounding box is closer to cand than to closest_cand
+    static bool tooFar(data_type closest_cand, data_type cand, data_type bnd_lo, data_type bnd_hi) {
+        distance_type boxDot = 0;
+        distance_type ccDot = 0;
+        for (uint d=0; d<D; d++) {
+            coord_type ccComp = cand.value[d] - closest_cand.value[d];
+            ccDot += mul_scale(ccComp,ccComp);
+            coord_type bnd = (ccComp > 0) ? bnd_hi.value[d] : bnd_lo.value[d];
+            coord_type tmp_diff2 = bnd - closest_cand.value[d];
+            boxDot += mul_scale(tmp_diff2,ccComp);
+        }
+        return ( ccDot > (boxDot<<1) );
+    }
+
+    // distortion contribution of a whole subtree assigned to centre z
+    static distance_type subtree_distortion(data_type z, const filter_node_t &tn) {
+        data_type wgtCent_scaled;
+        for (uint d=0; d<D; d++) {
+            wgtCent_scaled.value[d] = tn.wgtCent.value[d]>>FRACTIONAL_BITS;
+        }
+        coord_type tmp1 = dot_product(z,wgtCent_scaled);
+        coord_type tmp2 = dot_product(z,z);
+        coord_type tmp3 = (tmp2>>FRACTIONAL_BITS)*tn.count;
+        return tn.sum_sq+tmp3-2*tmp1;
+    }
+
+    // new centres and distortion from the accumulated centroids (as at the end of filter1)
+    static void centroids_2_centres(const centroid_t *centroids, uint k, cl_int4 *new_centers, cl_uint *distortion) {
+        for (uint i=0; i<k; i++) {
+            data_type c;
+            uint count = (centroids[i].count == 0) ? 1 : centroids[i].count;
+            for (uint d=0; d<D; d++) {
+                c.value[d] = centroids[i].wgtCent.value[d] / (coord_type)count;
+            }
+            new_centers[i] = data_type_2_vector(c);
+            distortion[i] = centroids[i].sum_sq;
+        }
+    }
+
+    // position (within cs) of the candidate closest to p; ties go to the first candidate
+    static uint closest_candidate(const candidate_set_t &cs, data_type p, bool simd);
+
+    // copy all candidates of cs that are not too far from z (w.r.t. the box bnd_lo/bnd_hi) into new_cs
+    static void prune_candidates(const candidate_set_t &cs, data_type z, data_type bnd_lo, data_type bnd_hi, candidate_set_t *new_cs, bool simd);
+
+    // Same for bitmap sets over the centres in all (all.idx[i] == i): the index
+    // of the closest candidate, and the candidates that are not too far.
+    static center_index_t closest_candidate(const candidate_set_t &all, const candidate_mask_t &cs, data_type p, bool simd);
+    static void prune_candidates(const candidate_set_t &all, const candidate_mask_t &cs, data_type z, data_type bnd_lo, data_type bnd_hi, candidate_mask_t *new_cs, bool simd);
+
+private:
+
+    // FILTER_CPU_LANES centres of all starting at i: distances to p, and the
+    // lanes that are not too far from z
+    static void lane_distances(const candidate_set_t &all, uint i, data_type p, distance_type *dist);
+    static uint lane_keep(const candidate_set_t &all, uint i, data_type z, data_type bnd_lo, data_type bnd_hi);
+
+    // the two representations as used by job_t::process
+    static void initial_set(const candidate_set_ptr &all, std::shared_ptr<const candidate_set_t> *cs_0);
+    static void initial_set(const candidate_set_ptr &all, std::shared_ptr<const candidate_mask_t> *cs_0);
+    static void select_closest(const candidate_set_t &all, const candidate_set_t &cs, data_type p, bool simd, center_index_t *idx, data_type *z);
+    static void select_closest(const candidate_set_t &all, const candidate_mask_t &cs, data_type p, bool simd, center_index_t *idx, data_type *z);
+    static void prune(const candidate_set_t &all, const candidate_set_t &cs, data_type z, data_type bnd_lo, data_type bnd_hi, candidate_set_t *new_cs, bool simd);
+    static void prune(const candidate_set_t &all, const candidate_mask_t &cs, data_type z, data_type bnd_lo, data_type bnd_hi, candidate_mask_t *new_cs, bool simd);
+    static std::shared_ptr<const candidate_set_t> copy_set(const candidate_set_t &s);
+    static std::shared_ptr<const candidate_mask_t> copy_set(const candidate_mask_t &s);
+
+    template<class Tree, class Set>
+    void run_sets(const Tree &tree, const std::vector<typename Tree::node_ref> &roots, const data_type *centres, uint k,
+                  centroid_t *centroids, filter_cpu_stats_t *stats, std::vector<cl_ulong> *visited_per_root) const;
+
+    template<class item_t> struct pool_t;
+    template<class Tree, class Set> struct job_t;
+    template<class Tree> struct batch_job_t;
+
+    template<class Job>
+    void execute(Job *job) const;
+
+    template<class Job>
+    static void worker(Job *job, uint tid);
+
+    static void reduce(const std::vector< std::vector<centroid_t> > &partial, uint n, centroid_t *centroids);
+    static void reduce(const std::vector<filter_cpu_stats_t> &partial, double start_time, filter_cpu_stats_t *stats);
+
+    uint n_threads;
+    bool use_simd;
+    bool use_bitmap;
+};
+
+
+uint filter_cpu::closest_candidate(const candidate_set_t &cs, data_type p, bool simd)
+{
+    uint i = 0;
+    distance_type min_dist = 0;
+    int min_pos = -1;
+
+    if (simd && (FILTER_CPU_LANES > 1)) {
+
+        // per-lane minimum and its (first) position
+        int lane_dist[FILTER_CPU_LANES];
+        int lane_pos[FILTER_CPU_LANES];
+
+        #if FILTER_CPU_LANES == 16
+        __m512i best_dist = _mm512_set1_epi32(0);
+        __m512i best_pos = _mm512_set1_epi32(-1);
+        const __m512i none = _mm512_set1_epi32(-1);
+        const __m512i lane = _mm512_setr_epi32(0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15);
+        for (; i+16<=cs.k; i+=16) {
+            __m512i dist = _mm512_setzero_si512();
+            for (uint d=0; d<D; d++) {
+                __m512i tmp = _mm512_sub_epi32(_mm512_set1_epi32(p.value[d]), _mm512_loadu_si512((const void*)(cs.coord(d)+i)));
+                dist = _mm512_add_epi32(dist, _mm512_srai_epi32(_mm512_mullo_epi32(tmp,tmp), FRACTIONAL_BITS));
+            }
+            __mmask16 update = _mm512_cmplt_epi32_mask(dist, best_dist) | _mm512_cmpeq_epi32_mask(best_pos, none);
+            best_dist = _mm512_mask_blend_epi32(update, best_dist, dist);
+            best_pos = _mm512_mask_blend_epi32(update, best_pos, _mm512_add_epi32(_mm512_set1_epi32(i), lane));
+        }
+        _mm512_storeu_si512((void*)lane_dist, best_dist);
+        _mm512_storeu_si512((void*)lane_pos, best_pos);
+        #elif FILTER_CPU_LANES == 8
+        __m256i best_dist = _mm256_set1_epi32(0);
+        __m256i best_pos = _mm256_set1_epi32(-1);
+        const __m256i none = _mm256_set1_epi32(-1);
+        const __m256i lane = _mm256_setr_epi32(0,1,2,3,4,5,6,7);
+        for (; i+8<=cs.k; i+=8) {
+            __m256i dist = _mm256_setzero_si256();
+            for (uint d=0; d<D; d++) {
+                __m256i tmp = _mm256_sub_epi32(_mm256_set1_epi32(p.value[d]), _mm256_loadu_si256((const __m256i*)(cs.coord(d)+i)));
+                dist = _mm256_add_epi32(dist, _mm256_srai_epi32(_mm256_mullo_epi32(tmp,tmp), FRACTIONAL_BITS));
+            }
+            __m256i update = _mm256_or_si256(_mm256_cmpgt_epi32(best_dist, dist), _mm256_cmpeq_epi32(best_pos, none));
+            best_dist = _mm256_blendv_epi8(best_dist, dist, update);
+            best_pos = _mm256_blendv_epi8(best_pos, _mm256_add_epi32(_mm256_set1_epi32(i), lane), update);
+        }
+        _mm256_storeu_si256((__m256i*)lane_dist, best_dist);
+        _mm256_storeu_si256((__m256i*)lane_pos, best_pos);
+        #elif FILTER_CPU_LANES == 4
+        int32x4_t best_dist = vdupq_n_s32(0);
+        int32x4_t best_pos = vdupq_n_s32(-1);
+        const int32x4_t none = vdupq_n_s32(-1);
+        const int lane_init[4] = {0,1,2,3};
+        const int32x4_t lane = vld1q_s32(lane_init);
+        for (; i+4<=cs.k; i+=4) {
+            int32x4_t dist = vdupq_n_s32(0);
+            for (uint d=0; d<D; d++) {
+                int32x4_t tmp = vsubq_s32(vdupq_n_s32(p.value[d]), vld1q_s32(cs.coord(d)+i));
+                dist = vaddq_s32(dist, vshrq_n_s32(vmulq_s32(tmp,tmp), FRACTIONAL_BITS));
+            }
+            uint32x4_t update = vorrq_u32(vcltq_s32(dist, best_dist), vceqq_s32(best_pos, none));
+            best_dist = vbslq_s32(update, dist, best_dist);
+            best_pos = vbslq_s32(update, vaddq_s32(vdupq_n_s32(i), lane), best_pos);
+        }
+        vst1q_s32(lane_dist, best_dist);
+        vst1q_s32(lane_pos, best_pos);
+        #endif
+
+        for (uint l=0; l<FILTER_CPU_LANES; l++) {
+            bool update = (lane_pos[l] >= 0) && ((min_pos < 0) || (lane_dist[l] < min_dist) || ((lane_dist[l] == min_dist) && (lane_pos[l] < min_pos)));
+            min_dist = (update) ? lane_dist[l] : min_dist;
+            min_pos = (update) ? lane_pos[l] : min_pos;
+        }
+    }
+
+    // remaining candidates (all of them in the scalar case)
+    for (; i<cs.k; i++) {
+        distance_type tmp_dist = 0;
+        for (uint d=0; d<D; d++) {
+            coord_type tmp = p.value[d]-cs.coord(d)[i];
+            tmp_dist += mul_scale(tmp,tmp);
+        }
+        if ((tmp_dist < min_dist) || (min_pos < 0)) {
+            min_dist = tmp_dist;
+            min_pos = i;
+        }
+    }
+
+    return min_pos;
+}
+
+
+void filter_cpu::prune_candidates(const candidate_set_t &cs, data_type z, data_type bnd_lo, data_type bnd_hi, candidate_set_t *new_cs, bool simd)
+{
+    uint i = 0;
+    uint n = 0;
+
+    if (simd && (FILTER_CPU_LANES > 1)) {
+
+        #if FILTER_CPU_LANES == 16
+        const __m512i zero = _mm512_setzero_si512();
+        for (; i+16<=cs.k; i+=16) {
+            __m512i boxDot = zero;
+            __m512i ccDot = zero;
+            for (uint d=0; d<D; d++) {
+                const __m512i z_d = _mm512_set1_epi32(z.value[d]);
+                __m512i ccComp = _mm512_sub_epi32(_mm512_loadu_si512((const void*)(cs.coord(d)+i)), z_d);
+                ccDot = _mm512_add_epi32(ccDot, _mm512_srai_epi32(_mm512_mullo_epi32(ccComp,ccComp), FRACTIONAL_BITS));
+                __m512i bnd = _mm512_mask_blend_epi32(_mm512_cmpgt_epi32_mask(ccComp, zero), _mm512_set1_epi32(bnd_lo.value[d]), _mm512_set1_epi32(bnd_hi.value[d]));
+                __m512i tmp_diff2 = _mm512_sub_epi32(bnd, z_d);
+                boxDot = _mm512_add_epi32(boxDot, _mm512_srai_epi32(_mm512_mullo_epi32(tmp_diff2,ccComp), FRACTIONAL_BITS));
+            }
+            __mmask16 keep = ~_mm512_cmpgt_epi32_mask(ccDot, _mm512_slli_epi32(boxDot,1));
+
+            // compact the survivors
+            _mm512_mask_compressstoreu_epi32((void*)(new_cs->idx.data()+n), keep, _mm512_loadu_si512((const void*)(cs.idx.data()+i)));
+            for (uint d=0; d<D; d++) {
+                _mm512_mask_compressstoreu_epi32((void*)(new_cs->coord(d)+n), keep, _mm512_loadu_si512((const void*)(cs.coord(d)+i)));
+            }
+            n += __builtin_popcount((uint)keep);
+        }
+        #elif FILTER_CPU_LANES == 8 || FILTER_CPU_LANES == 4
+        for (; i+FILTER_CPU_LANES<=cs.k; i+=FILTER_CPU_LANES) {
+            uint keep;
+            #if FILTER_CPU_LANES == 8
+            const __m256i zero = _mm256_setzero_si256();
+            __m256i boxDot = zero;
+            __m256i ccDot = zero;
+            for (uint d=0; d<D; d++) {
+                const __m256i z_d = _mm256_set1_epi32(z.value[d]);
+                __m256i ccComp = _mm256_sub_epi32(_mm256_loadu_si256((const __m256i*)(cs.coord(d)+i)), z_d);
+                ccDot = _mm256_add_epi32(ccDot, _mm256_srai_epi32(_mm256_mullo_epi32(ccComp,ccComp), FRACTIONAL_BITS));
+                __m256i bnd = _mm256_blendv_epi8(_mm256_set1_epi32(bnd_lo.value[d]), _mm256_set1_epi32(bnd_hi.value[d]), _mm256_cmpgt_epi32(ccComp, zero));
+                __m256i tmp_diff2 = _mm256_sub_epi32(bnd, z_d);
+                boxDot = _mm256_add_epi32(boxDot, _mm256_srai_epi32(_mm256_mullo_epi32(tmp_diff2,ccComp), FRACTIONAL_BITS));
+            }
+            __m256i too_far = _mm256_cmpgt_epi32(ccDot, _mm256_slli_epi32(boxDot,1));
+            keep = ~_mm256_movemask_ps(_mm256_castsi256_ps(too_far)) & 0xFF;
+            #else
+            const int32x4_t zero = vdupq_n_s32(0);
+            int32x4_t boxDot = zero;
+            int32x4_t ccDot = zero;
+            for (uint d=0; d<D; d++) {
+                const int32x4_t z_d = vdupq_n_s32(z.value[d]);
+                int32x4_t ccComp = vsubq_s32(vld1q_s32(cs.coord(d)+i), z_d);
+                ccDot = vaddq_s32(ccDot, vshrq_n_s32(vmulq_s32(ccComp,ccComp), FRACTIONAL_BITS));
+                int32x4_t bnd = vbslq_s32(vcgtq_s32(ccComp, zero), vdupq_n_s32(bnd_hi.value[d]), vdupq_n_s32(bnd_lo.value[d]));
+                int32x4_t tmp_diff2 = vsubq_s32(bnd, z_d);
+                boxDot = vaddq_s32(boxDot, vshrq_n_s32(vmulq_s32(tmp_diff2,ccComp), FRACTIONAL_BITS));
+            }
+            uint lane_too_far[4];
+            vst1q_u32(lane_too_far, vcgtq_s32(ccDot, vshlq_n_s32(boxDot,1)));
+            keep = 0;
+            for (uint l=0; l<4; l++) {
+                keep |= (lane_too_far[l] == 0) ? (1 << l) : 0;
+            }
+            #endif
+
+            // compact the survivors
+            while (keep != 0) {
+                uint l = __builtin_ctz(keep);
+                keep &= keep-1;
+                new_cs->idx[n] = cs.idx[i+l];
+                for (uint d=0; d<D; d++) {
+                    new_cs->coord(d)[n] = cs.coord(d)[i+l];
+                }
+                n++;
+            }
+        }
+        #endif
+    }
+
+    // remaining candidates (all of them in the scalar case)
+    for (; i<cs.k; i++) {
+        if (!tooFar(z, cs.position(i), bnd_lo, bnd_hi)) {
+            new_cs->idx[n] = cs.idx[i];
+            for (uint d=0; d<D; d++) {
+                new_cs->coord(d)[n] = cs.coord(d)[i];
+            }
+            n++;
+        }
+    }
+
+    new_cs->k = n;
+}
+
+
+void filter_cpu::lane_distances(const candidate_set_t &all, uint i, data_type p, distance_type *dist)
+{
+    #if FILTER_CPU_LANES == 16
+    __m512i v = _mm512_setzero_si512();
+    for (uint d=0; d<D; d++) {
+        __m512i tmp = _mm512_sub_epi32(_mm512_set1_epi32(p.value[d]), _mm512_loadu_si512((const void*)(all.coord(d)+i)));
+        v = _mm512_add_epi32(v, _mm512_srai_epi32(_mm512_mullo_epi32(tmp,tmp), FRACTIONAL_BITS));
+    }
+    _mm512_storeu_si512((void*)dist, v);
+    #elif FILTER_CPU_LANES == 8
+    __m256i v = _mm256_setzero_si256();
+    for (uint d=0; d<D; d++) {
+        __m256i tmp = _mm256_sub_epi32(_mm256_set1_epi32(p.value[d]), _mm256_loadu_si256((const __m256i*)(all.coord(d)+i)));
+        v = _mm256_add_epi32(v, _mm256_srai_epi32(_mm256_mullo_epi32(tmp,tmp), FRACTIONAL_BITS));
+    }
+    _mm256_storeu_si256((__m256i*)dist, v);
+    #elif FILTER_CPU_LANES == 4
+    int32x4_t v = vdupq_n_s32(0);
+    for (uint d=0; d<D; d++) {
+        int32x4_t tmp = vsubq_s32(vdupq_n_s32(p.value[d]), vld1q_s32(all.coord(d)+i));
+        v = vaddq_s32(v, vshrq_n_s32(vmulq_s32(tmp,tmp), FRACTIONAL_BITS));
+    }
+    vst1q_s32(dist, v);
+    #else
+    dist[0] = compute_distance(p, all.position(i));
+    #endif
+}
+
+
+uint filter_cpu::lane_keep(const candidate_set_t &all, uint i, data_type z, data_type bnd_lo, data_type bnd_hi)
+{
+    #if FILTER_CPU_LANES == 16
+    const __m512i zero = _mm512_setzero_si512();
+    __m512i boxDot = zero;
+    __m512i ccDot = zero;
+    for (uint d=0; d<D; d++) {
+        const __m512i z_d = _mm512_set1_epi32(z.value[d]);
+        __m512i ccComp = _mm512_sub_epi32(_mm512_loadu_si512((const void*)(all.coord(d)+i)), z_d);
+        ccDot = _mm512_add_epi32(ccDot, _mm512_srai_epi32(_mm512_mullo_epi32(ccComp,ccComp), FRACTIONAL_BITS));
+        __m512i bnd = _mm512_mask_blend_epi32(_mm512_cmpgt_epi32_mask(ccComp, zero), _mm512_set1_epi32(bnd_lo.value[d]), _mm512_set1_epi32(bnd_hi.value[d]));
+        __m512i tmp_diff2 = _mm512_sub_epi32(bnd, z_d);
+        boxDot = _mm512_add_epi32(boxDot, _mm512_srai_epi32(_mm512_mullo_epi32(tmp_diff2,ccComp), FRACTIONAL_BITS));
+    }
+    return (uint)(__mmask16)~_mm512_cmpgt_epi32_mask(ccDot, _mm512_slli_epi32(boxDot,1));
+    #elif FILTER_CPU_LANES == 8
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i boxDot = zero;
+    __m256i ccDot = zero;
+    for (uint d=0; d<D; d++) {
+        const __m256i z_d = _mm256_set1_epi32(z.value[d]);
+        __m256i ccComp = _mm256_sub_epi32(_mm256_loadu_si256((const __m256i*)(all.coord(d)+i)), z_d);
+        ccDot = _mm256_add_epi32(ccDot, _mm256_srai_epi32(_mm256_mullo_epi32(ccComp,ccComp), FRACTIONAL_BITS));
+        __m256i bnd = _mm256_blendv_epi8(_mm256_set1_epi32(bnd_lo.value[d]), _mm256_set1_epi32(bnd_hi.value[d]), _mm256_cmpgt_epi32(ccComp, zero));
+        __m256i tmp_diff2 = _mm256_sub_epi32(bnd, z_d);
+        boxDot = _mm256_add_epi32(boxDot, _mm256_srai_epi32(_mm256_mullo_epi32(tmp_diff2,ccComp), FRACTIONAL_BITS));
+    }
+    __m256i too_far = _mm256_cmpgt_epi32(ccDot, _mm256_slli_epi32(boxDot,1));
+    return ~_mm256_movemask_ps(_mm256_castsi256_ps(too_far)) & 0xFF;
+    #elif FILTER_CPU_LANES == 4
+    const int32x4_t zero = vdupq_n_s32(0);
+    int32x4_t boxDot = zero;
+    int32x4_t ccDot = zero;
+    for (uint d=0; d<D; d++) {
+        const int32x4_t z_d = vdupq_n_s32(z.value[d]);
+        int32x4_t ccComp = vsubq_s32(vld1q_s32(all.coord(d)+i), z_d);
+        ccDot = vaddq_s32(ccDot, vshrq_n_s32(vmulq_s32(ccComp,ccComp), FRACTIONAL_BITS));
+        int32x4_t bnd = vbslq_s32(vcgtq_s32(ccComp, zero), vdupq_n_s32(bnd_hi.value[d]), vdupq_n_s32(bnd_lo.value[d]));
+        int32x4_t tmp_diff2 = vsubq_s32(bnd, z_d);
+        boxDot = vaddq_s32(boxDot, vshrq_n_s32(vmulq_s32(tmp_diff2,ccComp), FRACTIONAL_BITS));
+    }
+    uint lane_too_far[4];
+    vst1q_u32(lane_too_far, vcgtq_s32(ccDot, vshlq_n_s32(boxDot,1)));
+    uint keep = 0;
+    for (uint l=0; l<4; l++) {
+        keep |= (lane_too_far[l] == 0) ? (1 << l) : 0;
+    }
+    return keep;
+    #else
+    return (tooFar(z, all.position(i), bnd_lo, bnd_hi)) ? 0 : 1;
+    #endif
+}
+
+
+center_index_t filter_cpu::closest_candidate(const candidate_set_t &all, const candidate_mask_t &cs, data_type p, bool simd)
+{
+    const cl_ulong lane_mask = ((cl_ulong)1 << FILTER_CPU_LANES) - 1;
+    distance_type min_dist = 0;
+    int min_idx = -1;
+
+    // nonzero words only, and in them the lane groups with at least one candidate
+    // (candidates in index order)
+    for (uint w=0; w<cs.bits.size(); w++) {
+        cl_ulong x = cs.bits[w];
+        while (x != 0) {
+            uint g = __builtin_ctzll(x) & ~(FILTER_CPU_LANES-1);
+            uint i = (w << 6) + g;
+            uint lanes = (uint)((x >> g) & lane_mask);
+            x &= ~(lane_mask << g);
+
+            distance_type dist[FILTER_CPU_LANES];
+            if (simd && (FILTER_CPU_LANES > 1) && (i+FILTER_CPU_LANES <= all.k)) {
+                lane_distances(all, i, p, dist);
+            } else {
+                for (uint l=0; l<FILTER_CPU_LANES; l++) {
+                    dist[l] = ((lanes >> l) & 1) ? compute_distance(p, all.position(i+l)) : 0;
+                }
+            }
+            while (lanes != 0) {
+                uint l = __builtin_ctz(lanes);
+                lanes &= lanes-1;
+                if ((dist[l] < min_dist) || (min_idx < 0)) {
+                    min_dist = dist[l];
+                    min_idx = i+l;
+                }
+            }
+        }
+    }
+
+    return min_idx;
+}
+
+
+void filter_cpu::prune_candidates(const candidate_set_t &all, const candidate_mask_t &cs, data_type z, data_type bnd_lo, data_type bnd_hi, candidate_mask_t *new_cs, bool simd)
+{
+    const cl_ulong lane_mask = ((cl_ulong)1 << FILTER_CPU_LANES) - 1;
+    uint n = 0;
+
+    // the survivors are the keep mask ANDed with the parent's bits, no compaction
+    for (uint w=0; w<cs.bits.size(); w++) {
+        cl_ulong x = cs.bits[w];
+        cl_ulong kept = 0;
+        while (x != 0) {
+            uint g = __builtin_ctzll(x) & ~(FILTER_CPU_LANES-1);
+            uint i = (w << 6) + g;
+            uint lanes = (uint)((x >> g) & lane_mask);
+            x &= ~(lane_mask << g);
+
+            uint keep = 0;
+            if (simd && (FILTER_CPU_LANES > 1) && (i+FILTER_CPU_LANES <= all.k)) {
+                keep = lane_keep(all, i, z, bnd_lo, bnd_hi) & lanes;
+            } else {
+                for (uint l=0; l<FILTER_CPU_LANES; l++) {
+                    keep |= (((lanes >> l) & 1) && !tooFar(z, all.position(i+l), bnd_lo, bnd_hi)) ? (1 << l) : 0;
+                }
+            }
+            kept |= (cl_ulong)keep << g;
+        }
+        new_cs->bits[w] = kept;
+        n += __builtin_popcountll(kept);
+    }
+
+    new_cs->k = n;
+}
+
+
+void filter_cpu::initial_set(const candidate_set_ptr &all, std::shared_ptr<const candidate_set_t> *cs_0)
+{
+    *cs_0 = all;
+}
+
+void filter_cpu::initial_set(const candidate_set_ptr &all, std::shared_ptr<const candidate_mask_t> *cs_0)
+{
+    std::shared_ptr<candidate_mask_t> tmp_cs(new candidate_mask_t(all->k));
+    for (center_index_t i=0; i<all->k; i++) {
+        tmp_cs->push_back(i);
+    }
+    *cs_0 = tmp_cs;
+}
+
+void filter_cpu::select_closest(const candidate_set_t &all, const candidate_set_t &cs, data_type p, bool simd, center_index_t *idx, data_type *z)
+{
+    uint min_pos = closest_candidate(cs, p, simd);
+    *idx = cs.idx[min_pos];
+    *z = cs.position(min_pos);
+}
+
+void filter_cpu::select_closest(const candidate_set_t &all, const candidate_mask_t &cs, data_type p, bool simd, center_index_t *idx, data_type *z)
+{
+    *idx = closest_candidate(all, cs, p, simd);
+    *z = all.position(*idx);
+}
+
+void filter_cpu::prune(const candidate_set_t &all, const candidate_set_t &cs, data_type z, data_type bnd_lo, data_type bnd_hi, candidate_set_t *new_cs, bool simd)
+{
+    prune_candidates(cs, z, bnd_lo, bnd_hi, new_cs, simd);
+}
+
+void filter_cpu::prune(const candidate_set_t &all, const candidate_mask_t &cs, data_type z, data_type bnd_lo, data_type bnd_hi, candidate_mask_t *new_cs, bool simd)
+{
+    prune_candidates(all, cs, z, bnd_lo, bnd_hi, new_cs, simd);
+}
+
+std::shared_ptr<const candidate_set_t> filter_cpu::copy_set(const candidate_set_t &s)
+{
+    std::shared_ptr<candidate_set_t> tmp_cs = std::make_shared<candidate_set_t>(s.k);
+    for (uint i=0; i<s.k; i++) {
+        tmp_cs->push_back(s.idx[i], s.position(i));
+    }
+    return tmp_cs;
+}
+
+std::shared_ptr<const candidate_mask_t> filter_cpu::copy_set(const candidate_mask_t &s)
+{
+    return std::make_shared<candidate_mask_t>(s);
+}
+
+
+// work-stealing queues shared by both traversals (item_t is the work item)
+template<class item_t>
+struct filter_cpu::pool_t {
+
+    // per-thread queue of subtrees that other threads may steal
+    struct queue_t {
+        std::mutex lock;
+        std::deque<item_t> items;
+    };
+
+    uint n_threads;
+    std::vector<queue_t> queues;
+
+    std::atomic<uint> pending;  // work items not yet processed
+    std::atomic<uint> idle;     // threads currently looking for work
+
+    pool_t(uint threads) : n_threads(threads), queues(threads), pending(0), idle(0) {}
+};
+
+
+// empty accumulator
+static centroid_t filter_cpu_zero_centroid()
+{
+    centroid_t zero;
+    for (uint d=0; d<D; d++) {
+        zero.wgtCent.value[d] = 0;
+    }
+    zero.sum_sq = 0;
+    zero.count = 0;
+    return zero;
+}
+
+
+// add a whole subtree (or leaf) to the centroid of its owner z
+static void filter_cpu_accumulate(centroid_t *c, data_type z, const filter_node_t &tn)
+{
+    for (uint d=0; d<D; d++) {
+        c->wgtCent.value[d] += tn.wgtCent.value[d];
+    }
+    c->sum_sq += filter_cpu::subtree_distortion(z, tn);
+    c->count += tn.count;
+}
+
+
+// state of one run(): one candidate set per work item (list or bitmap)
+template<class Tree, class Set>
+struct filter_cpu::job_t {
+    typedef typename Tree::node_ref node_ref;
+
+    struct work_t {
+        node_ref u;
+        std::shared_ptr<const Set> cs;
+        uint root;      // index of the subtree root this item belongs to
+    };
+    typedef work_t item_t;
+
+    pool_t<work_t> pool;
+
+    const Tree *tree;
+    uint k;
+    bool use_simd;
+    candidate_set_ptr all;      // all k centres, in index order
+
+    std::vector<Set> scratch;
+    std::vector< std::vector<centroid_t> > centroids;
+    std::vector<filter_cpu_stats_t> stats;
+    std::vector< std::vector<cl_ulong> > root_visits;  // per thread, per subtree root (empty if not requested)
+
+    job_t(uint threads, uint k) : pool(threads), k(k), scratch(threads, Set(k)), centroids(threads), stats(threads), root_visits(threads) {}
+
+    void process(const work_t &w, std::deque<work_t> *local, uint tid);
+};
+
+
+// state of one run_batch(): one candidate set per restart and work item (NULL
+// once the restart has reached a dead end)
+template<class Tree>
+struct filter_cpu::batch_job_t {
+    typedef typename Tree::node_ref node_ref;
+    typedef std::vector<candidate_set_ptr> set_list_t;
+
+    struct work_t {
+        node_ref u;
+        std::shared_ptr<const set_list_t> cs;
+    };
+    typedef work_t item_t;
+
+    pool_t<work_t> pool;
+
+    const Tree *tree;
+    uint k;
+    uint m;
+    bool use_simd;
+
+    std::vector<candidate_set_t> scratch;
+    std::vector< std::vector<centroid_t> > centroids;      // m*k per thread
+    std::vector<filter_cpu_stats_t> stats;
+    std::vector< std::vector<cl_ulong> > restart_fetches;  // m per thread
+
+    batch_job_t(uint threads, uint k, uint m) : pool(threads), k(k), m(m), scratch(threads, candidate_set_t(k)), centroids(threads), stats(threads), restart_fetches(threads) {}
+
+    void process(const work_t &w, std::deque<work_t> *local, uint tid);
+};
+
+
+template<class Tree>
+void filter_cpu::run(const Tree &tree, typename Tree::node_ref root, const data_type *centres, uint k,
+                     centroid_t *centroids, filter_cpu_stats_t *stats) const
+{
+    std::vector<typename Tree::node_ref> roots(1, root);
+    run(tree, roots, centres, k, centroids, stats);
+}
+
+
+template<class Tree>
+void filter_cpu::run(const Tree &tree, const std::vector<typename Tree::node_ref> &roots, const data_type *centres, uint k,
+                     centroid_t *centroids, filter_cpu_stats_t *stats, std::vector<cl_ulong> *visited_per_root) const
+{
+    if (use_bitmap) {
+        run_sets<Tree, candidate_mask_t>(tree, roots, centres, k, centroids, stats, visited_per_root);
+    } else {
+        run_sets<Tree, candidate_set_t>(tree, roots, centres, k, centroids, stats, visited_per_root);
+    }
+}
+
+
+template<class Tree, class Set>
+void filter_cpu::run_sets(const Tree &tree, const std::vector<typename Tree::node_ref> &roots, const data_type *centres, uint k,
+                          centroid_t *centroids, filter_cpu_stats_t *stats, std::vector<cl_ulong> *visited_per_root) const
+{
+    const double start_time = aocl_utils::getCurrentTimestamp();
+
+    job_t<Tree, Set> job(n_threads, k);
+    job.tree = &tree;
+    job.use_simd = use_simd;
+
+    for (uint t=0; t<n_threads; t++) {
+        job.centroids[t].assign(k, filter_cpu_zero_centroid());
+        filter_cpu_stats_t zero_stats = {0, 0, 0, 0, 0, 0, 0.0};
+        job.stats[t] = zero_stats;
+        if (visited_per_root != NULL) {
+            job.root_visits[t].assign(roots.size(), 0);
+        }
+    }
+
+    // initial candidate set: all centres
+    std::shared_ptr<candidate_set_t> all(new candidate_set_t(k));
+    for (center_index_t i=0; i<k; i++) {
+        all->push_back(i, centres[i]);
+    }
+    job.all = all;
+    std::shared_ptr<const Set> cs_0;
+    initial_set(job.all, &cs_0);
+
+    // deal the subtree roots out to the threads' queues (in order, so that each thread starts with the first of its share)
+    for (uint r=0; r<roots.size(); r++) {
+        typename job_t<Tree, Set>::work_t w0;
+        w0.u = roots[r];
+        w0.cs = cs_0;
+        w0.root = r;
+        job.pool.queues[r % n_threads].items.push_front(w0);
+    }
+    job.pool.pending = roots.size();
+
+    execute(&job);
+
+    // reduce per-thread centroid buffers and statistics
+    reduce(job.centroids, k, centroids);
+    if (stats != NULL) {
+        reduce(job.stats, start_time, stats);
+    }
+
+    if (visited_per_root != NULL) {
+        visited_per_root->assign(roots.size(), 0);
+        for (uint t=0; t<n_threads; t++) {
+            for (uint r=0; r<roots.size(); r++) {
+                (*visited_per_root)[r] += job.root_visits[t][r];
+            }
+        }
+    }
+}
+
+
+template<class Tree>
+void filter_cpu::run_batch(const Tree &tree, typename Tree::node_ref root, const data_type *centres, uint k, uint m,
+                           centroid_t *centroids, filter_cpu_stats_t *stats, std::vector<cl_ulong> *fetches_per_restart) const
+{
+    const double start_time = aocl_utils::getCurrentTimestamp();
+
+    batch_job_t<Tree> job(n_threads, k, m);
+    job.tree = &tree;
+    job.use_simd = use_simd;
+
+    for (uint t=0; t<n_threads; t++) {
+        job.centroids[t].assign(m*k, filter_cpu_zero_centroid());
+        filter_cpu_stats_t zero_stats = {0, 0, 0, 0, 0, 0, 0.0};
+        job.stats[t] = zero_stats;
+        job.restart_fetches[t].assign(m, 0);
+    }
+
+    // initial candidate sets: all centres of each restart
+    std::shared_ptr<typename batch_job_t<Tree>::set_list_t> cs_0(new typename batch_job_t<Tree>::set_list_t(m));
+    for (uint r=0; r<m; r++) {
+        std::shared_ptr<candidate_set_t> tmp_cs(new candidate_set_t(k));
+        for (center_index_t i=0; i<k; i++) {
+            tmp_cs->push_back(i, centres[r*k+i]);
+        }
+        (*cs_0)[r] = tmp_cs;
+    }
+
+    typename batch_job_t<Tree>::work_t w0;
+    w0.u = root;
+    w0.cs = cs_0;
+    job.pool.queues[0].items.push_back(w0);
+    job.pool.pending = 1;
+
+    execute(&job);
+
+    reduce(job.centroids, m*k, centroids);
+    if (stats != NULL) {
+        reduce(job.stats, start_time, stats);
+    }
+
+    if (fetches_per_restart != NULL) {
+        fetches_per_restart->assign(m, 0);
+        for (uint t=0; t<n_threads; t++) {
+            for (uint r=0; r<m; r++) {
+                (*fetches_per_restart)[r] += job.restart_fetches[t][r];
+            }
+        }
+    }
+}
+
+
+// run the workers of a job until all work items are processed
+template<class Job>
+void filter_cpu::execute(Job *job) const
+{
+    if (n_threads == 1) {
+        worker(job, 0);
+    } else {
+        std::vector<std::thread> threads;
+        for (uint t=0; t<n_threads; t++) {
+            threads.push_back(std::thread(&filter_cpu::worker<Job>, job, t));
+        }
+        for (uint t=0; t<n_threads; t++) {
+            threads[t].join();
+        }
+    }
+}
+
+
+void filter_cpu::reduce(const std::vector< std::vector<centroid_t> > &partial, uint n, centroid_t *centroids)
+{
+    for (uint i=0; i<n; i++) {
+        centroids[i] = partial[0][i];
+        for (uint t=1; t<partial.size(); t++) {
+            for (uint d=0; d<D; d++) {
+                centroids[i].wgtCent.value[d] += partial[t][i].wgtCent.value[d];
+            }
+            centroids[i].sum_sq += partial[t][i].sum_sq;
+            centroids[i].count += partial[t][i].count;
+        }
+    }
+}
+
+
+void filter_cpu::reduce(const std::vector<filter_cpu_stats_t> &partial, double start_time, filter_cpu_stats_t *stats)
+{
+    filter_cpu_stats_t total = {0, 0, 0, 0, 0, 0, 0.0};
+    for (uint t=0; t<partial.size(); t++) {
+        total.visited_nodes     += partial[t].visited_nodes;
+        total.deadends          += partial[t].deadends;
+        total.distance_evals    += partial[t].distance_evals;
+        total.toofar_evals      += partial[t].toofar_evals;
+        total.steals            += partial[t].steals;
+        total.max_thread_evals  = (partial[t].distance_evals > total.max_thread_evals) ? partial[t].distance_evals : total.max_thread_evals;
+    }
+    total.time_ms = (aocl_utils::getCurrentTimestamp() - start_time) * 1e3;
+    *stats = total;
+}
+
+
+template<class Job>
+void filter_cpu::worker(Job *job, uint tid)
+{
+    typedef typename Job::item_t work_t;
+    typedef pool_t<work_t> pool_type;
+
+    pool_type *pool = &job->pool;
+    std::deque<work_t> local;
+    bool is_idle = false;
+
+    for (;;) {
+
+        // get work: own stack first, then own shared queue, then steal the oldest (largest) subtree from others
+        work_t w;
+        bool found = false;
+        if (!local.empty()) {
+            w = local.back();
+            local.pop_back();
+            found = true;
+        }
+        for (uint i=0; (i<pool->n_threads) && !found; i++) {
+            typename pool_type::queue_t &q = pool->queues[(tid+i) % pool->n_threads];
+            std::lock_guard<std::mutex> guard(q.lock);
+            if (!q.items.empty()) {
+                if (i == 0) {
+                    w = q.items.back();
+                    q.items.pop_back();
+                } else {
+                    w = q.items.front();
+                    q.items.pop_front();
+                    job->stats[tid].steals++;
+                }
+                found = true;
+            }
+        }
+
+        if (!found) {
+            if (!is_idle) {
+                pool->idle++;
+                is_idle = true;
+            }
+            if (pool->pending == 0) {
+                break;
+            }
+            std::this_thread::yield();
+            continue;
+        }
+        if (is_idle) {
+            pool->idle--;
+            is_idle = false;
+        }
+
+        // the children (if any) go to local and are added to pending
+        job->process(w, &local, tid);
+        pool->pending--;
+
+        // hand the largest local subtree to the shared queue if someone is waiting for work
+        if ((pool->idle > 0) && (local.size() > 1)) {
+            std::lock_guard<std::mutex> guard(pool->queues[tid].lock);
+            pool->queues[tid].items.push_back(local.front());
+            local.pop_front();
+        }
+    }
+}
+
+
+template<class Tree, class Set>
+void filter_cpu::job_t<Tree, Set>::process(const work_t &w, std::deque<work_t> *local, uint tid)
+{
+    Set &scratch = this->scratch[tid];
+    filter_cpu_stats_t *stats = &this->stats[tid];
+
+    // fetch tree node
+    filter_node_t tn;
+    node_ref left, right;
+    tree->fetch(w.u, &tn, &left, &right);
+    stats->visited_nodes++;
+    if (!root_visits[tid].empty()) {
+        root_visits[tid][w.root]++;
+    }
+
+    // no closest-centre search or tooFar checks below a settled node
+    center_index_t owner;
+    if (tree->settled(w.u, &owner)) {
+        filter_cpu_accumulate(&centroids[tid][owner], all->position(owner), tn);
+        tree->own(w.u, owner);
+        stats->deadends++;
+        return;
+    }
+
+    // determine comparison point for closest-distance-search depending on whether we are at a leaf node or not
+    data_type comp_point;
+    for (uint d=0; d<D; d++) {
+        comp_point.value[d] = (tn.leaf) ? tn.wgtCent.value[d] : (tn.bnd_lo.value[d] + tn.bnd_hi.value[d]) >> 1;
+    }
+
+    // find closest center (and its index) to comp_point
+    const Set &cs = *w.cs;
+    const uint current_k = cs.k;
+    center_index_t min_idx;
+    data_type z;
+    select_closest(*all, cs, comp_point, use_simd, &min_idx, &z);
+    stats->distance_evals += current_k;
+
+    // candidate pruning and calculation of new value for k (the children
+    // share the parent's set if no candidate was pruned)
+    std::shared_ptr<const Set> new_cs = w.cs;
+    uint new_k = current_k;
+    if (!tn.leaf) {
+        prune(*all, cs, z, tn.bnd_lo, tn.bnd_hi, &scratch, use_simd);
+        stats->toofar_evals += current_k;
+        new_k = scratch.k;
+        if ((new_k < current_k) && (new_k > 1)) {
+            new_cs = copy_set(scratch);
+        }
+    }
+
+    bool deadend = tn.leaf || (new_k == 1);
+
+    if (deadend) {
+        // update centroid and distortion of the owner
+        filter_cpu_accumulate(&centroids[tid][min_idx], z, tn);
+        tree->own(w.u, min_idx);
+        stats->deadends++;
+    } else {
+        // push right, then left (the left child is processed first, as in filter0)
+        work_t st0;
+        st0.u = right;
+        st0.cs = new_cs;
+        st0.root = w.root;
+        local->push_back(st0);
+
+        work_t st1;
+        st1.u = left;
+        st1.cs = new_cs;
+        st1.root = w.root;
+        local->push_back(st1);
+
+        pool.pending += 2;
+    }
+}
+
+
+template<class Tree>
+void filter_cpu::batch_job_t<Tree>::process(const work_t &w, std::deque<work_t> *local, uint tid)
+{
+    candidate_set_t &scratch = this->scratch[tid];
+    filter_cpu_stats_t *stats = &this->stats[tid];
+
+    // fetch tree node (once for all restarts)
+    filter_node_t tn;
+    node_ref left, right;
+    tree->fetch(w.u, &tn, &left, &right);
+    stats->visited_nodes++;
+
+    data_type comp_point;
+    for (uint d=0; d<D; d++) {
+        comp_point.value[d] = (tn.leaf) ? tn.wgtCent.value[d] : (tn.bnd_lo.value[d] + tn.bnd_hi.value[d]) >> 1;
+    }
+
+    // same steps as job_t::process, for each restart still active in this subtree
+    std::shared_ptr<set_list_t> new_cs_list;
+    bool any_active = false;
+    for (uint r=0; r<m; r++) {
+        const candidate_set_ptr &cs_ptr = (*w.cs)[r];
+        if (!cs_ptr) {
+            continue;
+        }
+        restart_fetches[tid][r]++;
+
+        const candidate_set_t &cs = *cs_ptr;
+        const uint current_k = cs.k;
+        uint min_pos = closest_candidate(cs, comp_point, use_simd);
+        center_index_t min_idx = cs.idx[min_pos];
+        const data_type z = cs.position(min_pos);
+        stats->distance_evals += current_k;
+
+        candidate_set_ptr new_cs = cs_ptr;
+        uint new_k = current_k;
+        if (!tn.leaf) {
+            prune_candidates(cs, z, tn.bnd_lo, tn.bnd_hi, &scratch, use_simd);
+            stats->toofar_evals += current_k;
+            new_k = scratch.k;
+            if ((new_k < current_k) && (new_k > 1)) {
+                std::shared_ptr<candidate_set_t> tmp_cs = std::make_shared<candidate_set_t>(new_k);
+                for (uint i=0; i<new_k; i++) {
+                    tmp_cs->push_back(scratch.idx[i], scratch.position(i));
+                }
+                new_cs = tmp_cs;
+            }
+        }
+
+        bool deadend = tn.leaf || (new_k == 1);
+
+        if (deadend) {
+            filter_cpu_accumulate(&centroids[tid][r*k+min_idx], z, tn);
+            stats->deadends++;
+            new_cs.reset();
+        } else {
+            any_active = true;
+        }
+
+        // the children share the parent's list until one of its sets changes
+        if ((new_cs != cs_ptr) && !new_cs_list) {
+            new_cs_list = std::make_shared<set_list_t>(*w.cs);
+        }
+        if (new_cs_list) {
+            (*new_cs_list)[r] = new_cs;
+        }
+    }
+
+    if (any_active) {
+        std::shared_ptr<const set_list_t> child_cs = w.cs;
+        if (new_cs_list) {
+            child_cs = new_cs_list;
+        }
+
+        work_t st0;
+        st0.u = right;
+        st0.cs = child_cs;
+        local->push_back(st0);
+
+        work_t st1;
+        st1.u = left;
+        st1.cs = child_cs;
+        local->push_back(st1);
+
+        pool.pending += 2;
+    }
+}
+
+
+#endif
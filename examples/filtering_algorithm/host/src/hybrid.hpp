@@ -0,0 +1,311 @@
+/**********************************************************************
+* Felix Winterstein, Imperial College London, 2016
+*
+* File: hybrid.hpp
+*
+* Revision 1.01
+* Additional Comments: distributed under an Apache-2.0 license, see LICENSE
+*
+**********************************************************************/
+
+/*
+ * Hybrid CPU+FPGA traversal.
+ *
+ * The kd-tree is cut at a fixed depth and every subtree below the cut is
+ * processed either by the device (filter0 takes a list of subtree roots) or by
+ * the host engine of filter_cpu.hpp. Both sides start each subtree with all K
+ * candidates and return per-centre partial sums (wgtCent, sum_sq, count),
+ * which are added up before the new centres are computed.
+ *
+ * The split is re-balanced after every iteration. The cost of a subtree is
+ * its number of node fetches in the previous iteration: measured per subtree
+ * on the host, and for the device's share obtained by scaling the previous
+ * estimates to the total the device reports. Each side's throughput is the
+ * number of node fetches per ms it achieved. Subtrees are then assigned
+ * largest first to the side that would finish them earliest.
+ *
+ * The device side is an interface, so that a software stand-in (the host
+ * engine running on its own threads) can take the place of the FPGA.
+ */
+
+#ifndef HYBRID_H
+#define HYBRID_H
+
+#include <vector>
+#include <thread>
+#include <algorithm>
+
+#include "my_util.hpp"
+#include "filter_cpu.hpp"
+#include "lsu_profile.hpp"
+
+#define HYBRID_MAX_ROOTS    256     // must match MAX_ROOTS in device/filter_stream_opt1.cl
+
+
+// device side of the hybrid traversal
+class hybrid_device {
+public:
+    virtual ~hybrid_device() {}
+
+    virtual const char *name() const = 0;
+
+    // Start a filtering pass over the given subtrees and return immediately.
+    virtual void launch(const std::vector<const kdTree_t*> &roots, const data_type *centres, uint k) = 0;
+
+    // Wait for the pass started by launch(). centroids receives k partial sums.
+    virtual void finish(centroid_t *centroids, cl_ulong *visited_nodes, double *time_ms) = 0;
+
+    // bridge LSU counters of the last pass (lsu_profile.hpp)
+    virtual lsu_profile_t lsu_profile() = 0;
+};
+
+
+// software stand-in for the FPGA: the host engine on a separate thread pool
+class software_hybrid_device : public hybrid_device {
+public:
+
+    software_hybrid_device(uint num_threads, bool simd, bool bitmap) : engine(num_threads, simd, bitmap), k(0) {}
+
+    const char *name() const { return "software"; }
+
+    void launch(const std::vector<const kdTree_t*> &roots, const data_type *centres, uint k) {
+        this->roots = roots;
+        this->centres.assign(centres, centres + k);
+        this->k = k;
+        centroids.resize(k);
+        pass_thread = std::thread(&software_hybrid_device::pass, this);
+    }
+
+    void finish(centroid_t *centroids, cl_ulong *visited_nodes, double *time_ms) {
+        pass_thread.join();
+        for (uint i=0; i<k; i++) {
+            centroids[i] = this->centroids[i];
+        }
+        *visited_nodes = stats.visited_nodes;
+        *time_ms = stats.time_ms;
+    }
+
+    lsu_profile_t lsu_profile() {
+        return lsu_model(stats.visited_nodes, 0);
+    }
+
+private:
+
+    void pass() {
+        pointer_tree_t<kdTree_t> tree;
+        engine.run(tree, roots, centres.data(), k, centroids.data(), &stats);
+    }
+
+    filter_cpu engine;
+    std::thread pass_thread;
+    std::vector<const kdTree_t*> roots;
+    std::vector<data_type> centres;
+    std::vector<centroid_t> centroids;
+    uint k;
+    filter_cpu_stats_t stats;
+};
+
+
+// statistics of one hybrid iteration
+struct hybrid_stats_t {
+    uint host_subtrees;
+    uint device_subtrees;
+    cl_ulong host_nodes;        // node fetches on the host
+    cl_ulong device_nodes;      // node fetches on the device
+    double host_ms;
+    double device_ms;
+    double wall_ms;             // launch to merged result
+    lsu_profile_t device_lsu;   // bridge LSU counters of the device's share
+};
+
+
+class hybrid_scheduler {
+public:
+
+    // Cut the tree rooted at root at the given depth (leaves above the cut
+    // become subtrees of their own). host_share is the fraction of the points
+    // given to the host in the first iteration, before any timing is known.
+    hybrid_scheduler(const kdTree_t *root, uint depth, hybrid_device *device, const filter_cpu &engine, double host_share)
+        : device(device), engine(engine), host_measured(false), device_measured(false)
+    {
+        this->host_share = (host_share < 0.0) ? 0.0 : ((host_share > 1.0) ? 1.0 : host_share);
+        host_rate = this->host_share;
+        device_rate = 1.0 - this->host_share;
+        collect(root, depth);
+        assign();
+    }
+
+    uint subtrees() const { return subtree_list.size(); }
+
+    // all subtree roots, in tree order
+    std::vector<const kdTree_t*> roots() const {
+        std::vector<const kdTree_t*> result;
+        for (uint i=0; i<subtree_list.size(); i++) {
+            result.push_back(subtree_list[i].root);
+        }
+        return result;
+    }
+
+    // One filtering pass with the current split. centroids receives the merged
+    // partial sums of both sides; the split is updated for the next call.
+    void iterate(const data_type *centres, uint k, centroid_t *centroids, hybrid_stats_t *stats);
+
+private:
+
+    struct subtree_t {
+        const kdTree_t *root;
+        double cost;        // estimated node fetches
+        bool on_host;
+    };
+
+    void collect(const kdTree_t *u, uint depth) {
+        bool leaf = (u->left == 0) && (u->right == 0);
+        if ((depth == 0) || leaf) {
+            subtree_t s;
+            s.root = u;
+            s.cost = (double)u->count;
+            s.on_host = false;
+            subtree_list.push_back(s);
+        } else {
+            collect(u->left, depth-1);
+            collect(u->right, depth-1);
+        }
+    }
+
+    void update(const std::vector<cl_ulong> &host_visits, const hybrid_stats_t &stats);
+    void assign();
+
+    hybrid_device *device;
+    const filter_cpu &engine;
+    std::vector<subtree_t> subtree_list;
+
+    double host_share;
+    double host_rate;       // node fetches per ms (relative guess until measured)
+    double device_rate;
+    bool host_measured;
+    bool device_measured;
+};
+
+
+void hybrid_scheduler::iterate(const data_type *centres, uint k, centroid_t *centroids, hybrid_stats_t *stats)
+{
+    std::vector<const kdTree_t*> host_roots, device_roots;
+    for (uint i=0; i<subtree_list.size(); i++) {
+        if (subtree_list[i].on_host) {
+            host_roots.push_back(subtree_list[i].root);
+        } else {
+            device_roots.push_back(subtree_list[i].root);
+        }
+    }
+
+    const double start_time = aocl_utils::getCurrentTimestamp();
+
+    // the device works in the background while the host threads take their share
+    device->launch(device_roots, centres, k);
+
+    std::vector<centroid_t> host_centroids(k);
+    std::vector<cl_ulong> host_visits;
+    filter_cpu_stats_t host_stats;
+    pointer_tree_t<kdTree_t> tree;
+    engine.run(tree, host_roots, centres, k, host_centroids.data(), &host_stats, &host_visits);
+
+    std::vector<centroid_t> device_centroids(k);
+    cl_ulong device_nodes;
+    double device_ms;
+    device->finish(device_centroids.data(), &device_nodes, &device_ms);
+    stats->device_lsu = device->lsu_profile();
+
+    // merge partial sums
+    for (uint i=0; i<k; i++) {
+        centroids[i] = host_centroids[i];
+        for (uint d=0; d<D; d++) {
+            centroids[i].wgtCent.value[d] += device_centroids[i].wgtCent.value[d];
+        }
+        centroids[i].sum_sq += device_centroids[i].sum_sq;
+        centroids[i].count += device_centroids[i].count;
+    }
+
+    stats->host_subtrees    = host_roots.size();
+    stats->device_subtrees  = device_roots.size();
+    stats->host_nodes       = host_stats.visited_nodes;
+    stats->device_nodes     = device_nodes;
+    stats->host_ms          = host_stats.time_ms;
+    stats->device_ms        = device_ms;
+    stats->wall_ms          = (aocl_utils::getCurrentTimestamp() - start_time) * 1e3;
+
+    update(host_visits, *stats);
+    assign();
+}
+
+
+// refresh subtree costs and throughput of both sides from the last iteration
+void hybrid_scheduler::update(const std::vector<cl_ulong> &host_visits, const hybrid_stats_t &stats)
+{
+    double device_estimate = 0.0;
+    for (uint i=0; i<subtree_list.size(); i++) {
+        if (!subtree_list[i].on_host) {
+            device_estimate += subtree_list[i].cost;
+        }
+    }
+    const double device_scale = (device_estimate > 0.0) ? (double)stats.device_nodes / device_estimate : 1.0;
+
+    uint h = 0;
+    for (uint i=0; i<subtree_list.size(); i++) {
+        double cost;
+        if (subtree_list[i].on_host) {
+            cost = (double)host_visits[h++];
+        } else {
+            cost = subtree_list[i].cost * device_scale;
+        }
+        subtree_list[i].cost = (cost < 1.0) ? 1.0 : cost;
+    }
+
+    if ((stats.host_nodes > 0) && (stats.host_ms > 0.0)) {
+        host_rate = (double)stats.host_nodes / stats.host_ms;
+        host_measured = true;
+    }
+    if ((stats.device_nodes > 0) && (stats.device_ms > 0.0)) {
+        device_rate = (double)stats.device_nodes / stats.device_ms;
+        device_measured = true;
+    }
+
+    // a side that has not run yet keeps its initial ratio to the other one
+    if (host_measured && !device_measured) {
+        device_rate = (host_share > 0.0) ? host_rate * (1.0 - host_share) / host_share : 0.0;
+    } else if (device_measured && !host_measured) {
+        host_rate = (host_share < 1.0) ? device_rate * host_share / (1.0 - host_share) : 0.0;
+    }
+}
+
+
+// greedy split: largest subtree first, to the side with the earlier predicted finish time
+void hybrid_scheduler::assign()
+{
+    std::vector<uint> order(subtree_list.size());
+    for (uint i=0; i<order.size(); i++) {
+        order[i] = i;
+    }
+    const std::vector<subtree_t> &s = subtree_list;
+    std::sort(order.begin(), order.end(), [&s](uint a, uint b) { return s[a].cost > s[b].cost; });
+
+    double host_finish = 0.0;
+    double device_finish = 0.0;
+    uint device_subtrees = 0;
+    for (uint i=0; i<order.size(); i++) {
+        subtree_t &t = subtree_list[order[i]];
+        double h = (host_rate > 0.0) ? host_finish + t.cost / host_rate : -1.0;
+        double d = (device_rate > 0.0) ? device_finish + t.cost / device_rate : -1.0;
+        bool to_host = (h >= 0.0) && ((d < 0.0) || (h < d) || (device_subtrees == HYBRID_MAX_ROOTS));
+        if (to_host) {
+            t.on_host = true;
+            host_finish = h;
+        } else {
+            t.on_host = false;
+            device_finish = d;
+            device_subtrees++;
+        }
+    }
+}
+
+
+#endif
@@ -0,0 +1,358 @@
+/**********************************************************************
+* Felix Winterstein, Imperial College London, 2016
+*
+* File: incremental.hpp
+*
+* Revision 1.01
+* Additional Comments: distributed under an Apache-2.0 license, see LICENSE
+*
+**********************************************************************/
+
+/*
+ * Incremental Lloyd iterations on the host engine.
+ *
+ * The dead ends of a pass partition the points, and all points below a dead
+ * end are closest to its owner. The first pass traverses the whole tree and
+ * tags its dead ends (pointer_tree_t::pass). Each dead end is then cached with
+ * its owner and a margin: a lower bound, over the points x of its box and over
+ * all other centres c, of |x-c| - |x-owner|. A leaf's box is its point. The
+ * cheap margin needs only the distance h from the owner to its nearest other
+ * centre (|x-c| >= |c-owner| - |x-owner|):
+ *
+ *   h - 2 dmax(box, owner)
+ *
+ * and the full one takes, for each c, the better of
+ *
+ *   dmin(box, c) - dmax(box, owner)
+ *   2 s |c-owner| / (dmax(box, owner) + dmax(box, c))
+ *
+ * where s is the smallest distance of the box to the bisector of owner and c
+ * (|x-c|^2 - |x-owner|^2 = 2 s(x) |c-owner|, and |x-c| + |x-owner| is at most the
+ * denominator).
+ *
+ * If every centre moves by at most delta_max and the owner by delta, the margin
+ * shrinks by at most delta + delta_max. While it stays above the resolution of
+ * the fixed-point tests (prune_resolution), the next pass adds the subtree's
+ * aggregates (wgtCent, sum_sq, count) to its owner without fetching anything
+ * below it. Otherwise the pass tries the cheap and then the full margin for the
+ * new centres, and the dead ends that fail both become subtree roots of a host
+ * engine pass with all k centres, whose dead ends replace them in the cache. Two
+ * reusable siblings with the same owner are then cached as their parent, so that
+ * the cache shrinks below the engine's dead ends (tooFar tests the parent's box,
+ * which can reach into another cell where none of its points does).
+ *
+ * If fewer than min_reuse of the cached dead ends can be reused, the pass drops
+ * them and traverses the whole tree as a plain pass, whose dead ends refill the
+ * cache.
+ *
+ * A pass reads the cached aggregates in a list and fetches only the nodes of
+ * the subtrees it traverses. A reused subtree gives its points the owner a full
+ * pass gives them: the margin exceeds what the rounding of compute_distance or
+ * of tooFar can make up. A traversed subtree starts from all k centres, not from
+ * the candidates its ancestors left in a full pass. Where a full pass's tooFar
+ * pruned a centre that is closer to some point of the box by less than the
+ * rounding (2D products of 2^FRACTIONAL_BITS each in the squared distance), the
+ * traversal can give that point to the closer centre. The sums of such a centre
+ * then differ from a full pass by those points. The distortion words of the
+ * centroids differ as well, as subtree_distortion rounds per dead end and
+ * merged entries are larger dead ends.
+ */
+
+#ifndef INCREMENTAL_H
+#define INCREMENTAL_H
+
+#include <vector>
+#include <unordered_map>
+#include <math.h>
+
+#include "my_util.hpp"
+#include "filter_cpu.hpp"
+#include "bounds.hpp"
+
+
+// tooFar rounds 2D products by up to 2^-FRACTIONAL_BITS each: a full pass may
+// prune a centre that is closer to a point than the survivor by less than that
+// in the squared distance, and compute_distance rounds by half of it
+static double prune_resolution()
+{
+    return sqrt((double)((2*D) << FRACTIONAL_BITS));
+}
+
+
+// one incremental pass
+struct incremental_stats_t {
+    uint cached;                // dead ends in the cache before the pass
+    uint reused;                // of those, added from their aggregates (0 if the pass fell back)
+    bool full_pass;             // too few reusable: the whole tree traversed
+    uint full_margins;          // margins taken over all k centres
+    uint roots;                 // subtrees traversed (the rest, or the whole tree)
+    cl_ulong visited_nodes;     // node fetches of the traversal
+    uint dead_ends;             // in the cache after the pass (merged siblings count once)
+    double max_shift;           // largest centre movement since the previous pass
+    double ms;
+};
+
+
+class incremental_filter {
+public:
+
+    // pass_tag: counter of the dead-end tags (shared with the other passes that tag the tree);
+    // min_reuse: fraction of the cached dead ends below which a pass traverses the whole tree
+    incremental_filter(const filter_cpu &engine, const kdTree_t *root, cl_uint *pass_tag, double min_reuse)
+        : engine(engine), root(root), pass_tag(pass_tag), min_reuse(min_reuse) {}
+
+    // One filtering pass from centres; centroids receives the per-centre sums.
+    void iterate(const data_type *centres, uint k, centroid_t *centroids, incremental_stats_t *stats);
+
+private:
+
+    struct entry_t {
+        const kdTree_t *u;
+        center_index_t owner;
+        double margin;
+    };
+
+    double cheap_margin(const kdTree_t *u, center_index_t owner, const data_type *centres) const;
+
+    static double full_margin(const kdTree_t *u, center_index_t owner, const data_type *centres, uint k);
+
+    void collect(const kdTree_t *u, cl_uint pass, const data_type *centres);
+
+    void merge(double resolution);
+
+    const filter_cpu &engine;
+    const kdTree_t *root;
+    cl_uint *pass_tag;
+    double min_reuse;
+    std::vector<entry_t> cache;
+    std::vector<data_type> previous;    // centres the margins refer to
+    std::vector<double> nearest;        // per centre, the distance to the nearest other one
+    std::unordered_map<const kdTree_t*, const kdTree_t*> parent;
+};
+
+
+double incremental_filter::cheap_margin(const kdTree_t *u, center_index_t owner, const data_type *centres) const
+{
+    data_type lo, hi;
+    node_box(u, &lo, &hi);
+    double owner_min, owner_max;
+    box_distances(lo, hi, centres[owner], &owner_min, &owner_max);
+    return nearest[owner] - 2.0*owner_max;
+}
+
+
+double incremental_filter::full_margin(const kdTree_t *u, center_index_t owner, const data_type *centres, uint k)
+{
+    data_type lo, hi;
+    node_box(u, &lo, &hi);
+    double owner_min, owner_max;
+    box_distances(lo, hi, centres[owner], &owner_min, &owner_max);
+
+    double result = HUGE_VAL;
+    for (uint i=0; (i<k) && (result > 0.0); i++) {
+        if (i == owner) {
+            continue;
+        }
+        // neither bound of a centre at least result + owner_max from the box is below result
+        double sum_min = 0.0;
+        for (uint d=0; d<D; d++) {
+            const double l = (double)lo.value[d] - (double)centres[i].value[d];
+            const double h = (double)hi.value[d] - (double)centres[i].value[d];
+            const double near = (l > 0.0) ? l : ((h < 0.0) ? -h : 0.0);
+            sum_min += near*near;
+        }
+        if (sum_min >= (result + owner_max)*(result + owner_max)) {
+            continue;
+        }
+        double c_min, c_max;
+        box_distances(lo, hi, centres[i], &c_min, &c_max);
+        double bound = c_min - owner_max;
+
+        // smallest distance of the box to the bisector, on the owner's side
+        const double sep = exact_distance(centres[i], centres[owner]);
+        if ((sep > 0.0) && (owner_max + c_max > 0.0)) {
+            double s = 0.0;
+            for (uint d=0; d<D; d++) {
+                const double dir = ((double)centres[i].value[d] - (double)centres[owner].value[d]) / sep;
+                const double mid = 0.5 * ((double)centres[i].value[d] + (double)centres[owner].value[d]);
+                const double x = (dir > 0.0) ? (double)hi.value[d] : (double)lo.value[d];
+                s += (mid - x) * dir;
+            }
+            if (s > 0.0) {
+                const double bisector_bound = 2.0 * s * sep / (owner_max + c_max);
+                bound = (bisector_bound > bound) ? bisector_bound : bound;
+            }
+        }
+        result = (bound < result) ? bound : result;
+    }
+    return result;
+}
+
+
+// the dead ends of the pass below u (it tagged them), with their cheap margins
+void incremental_filter::collect(const kdTree_t *u, cl_uint pass, const data_type *centres)
+{
+    std::vector<const kdTree_t*> stack(1, u);
+    while (!stack.empty()) {
+        const kdTree_t *v = stack.back();
+        stack.pop_back();
+        if ((v->owner_pass == pass) || ((v->left == NULL) && (v->right == NULL))) {
+            entry_t e;
+            e.u = v;
+            e.owner = v->owner;
+            e.margin = cheap_margin(v, v->owner, centres);
+            cache.push_back(e);
+        } else {
+            stack.push_back(v->right);
+            stack.push_back(v->left);
+        }
+    }
+}
+
+
+// reusable siblings with the same owner become one entry, their parent (with
+// the smaller margin); the engine would split the parent again if its box, which
+// is larger than theirs, reaches into another centre's cell
+void incremental_filter::merge(double resolution)
+{
+    if (parent.empty()) {
+        tree_parents(root, &parent);
+    }
+
+    std::unordered_map<const kdTree_t*, uint> position;
+    for (uint j=0; j<cache.size(); j++) {
+        position[cache[j].u] = j;
+    }
+    std::vector<bool> merged(cache.size(), false);
+    // the parents go to the end of the cache and are merged in turn
+    for (uint j=0; j<cache.size(); j++) {
+        const entry_t e = cache[j];
+        const std::unordered_map<const kdTree_t*, const kdTree_t*>::const_iterator p = parent.find(e.u);
+        if (merged[j] || (e.margin <= resolution) || (p == parent.end())) {
+            continue;
+        }
+        const kdTree_t *sibling = (p->second->left == e.u) ? p->second->right : p->second->left;
+        const std::unordered_map<const kdTree_t*, uint>::const_iterator s = position.find(sibling);
+        if ((s == position.end()) || merged[s->second] || (cache[s->second].owner != e.owner) || (cache[s->second].margin <= resolution)) {
+            continue;
+        }
+        entry_t m;
+        m.u = p->second;
+        m.owner = e.owner;
+        m.margin = (cache[s->second].margin < e.margin) ? cache[s->second].margin : e.margin;
+        merged[j] = true;
+        merged[s->second] = true;
+        position[m.u] = cache.size();
+        cache.push_back(m);
+        merged.push_back(false);
+    }
+
+    uint n = 0;
+    for (uint j=0; j<cache.size(); j++) {
+        if (!merged[j]) {
+            cache[n++] = cache[j];
+        }
+    }
+    cache.resize(n);
+}
+
+
+void incremental_filter::iterate(const data_type *centres, uint k, centroid_t *centroids, incremental_stats_t *stats)
+{
+    const double start_time = aocl_utils::getCurrentTimestamp();
+
+    for (uint i=0; i<k; i++) {
+        centroids[i] = filter_cpu_zero_centroid();
+    }
+
+    // centre movements since the margins were taken
+    std::vector<double> shift(k, 0.0);
+    double max_shift = 0.0;
+    if (previous.size() == k) {
+        for (uint i=0; i<k; i++) {
+            shift[i] = exact_distance(centres[i], previous[i]);
+            max_shift = (shift[i] > max_shift) ? shift[i] : max_shift;
+        }
+    } else {
+        cache.clear();
+    }
+    nearest.assign(k, HUGE_VAL);
+    for (uint i=0; i<k; i++) {
+        for (uint j=i+1; j<k; j++) {
+            const double dist = exact_distance(centres[i], centres[j]);
+            nearest[i] = (dist < nearest[i]) ? dist : nearest[i];
+            nearest[j] = (dist < nearest[j]) ? dist : nearest[j];
+        }
+    }
+
+    const double resolution = prune_resolution();
+
+    // reuse the dead ends whose owner cannot have changed, traverse the others;
+    // once more than (1-min_reuse) of them fail, the pass falls back to the root
+    std::vector<const kdTree_t*> roots;
+    std::vector<entry_t> kept;
+    const double max_failed = (1.0 - min_reuse) * (double)cache.size();
+    bool full_pass = cache.empty();
+    uint full_margins = 0;
+    for (uint j=0; (j<cache.size()) && !full_pass; j++) {
+        entry_t e = cache[j];
+        e.margin -= shift[e.owner] + max_shift;
+        if (e.margin <= resolution) {
+            const double m = cheap_margin(e.u, e.owner, centres);
+            e.margin = (m > e.margin) ? m : e.margin;
+        }
+        if (e.margin <= resolution) {
+            e.margin = full_margin(e.u, e.owner, centres, k);
+            full_margins++;
+        }
+        if (e.margin > resolution) {
+            filter_cpu_accumulate(&centroids[e.owner], centres[e.owner], bounds_node(e.u));
+            kept.push_back(e);
+        } else {
+            roots.push_back(e.u);
+            full_pass = ((double)roots.size() > max_failed);
+        }
+    }
+    if (full_pass) {
+        for (uint i=0; i<k; i++) {
+            centroids[i] = filter_cpu_zero_centroid();
+        }
+        kept.clear();
+        roots.assign(1, root);
+    }
+    stats->cached = cache.size();
+    stats->reused = kept.size();
+    stats->full_pass = full_pass;
+    stats->full_margins = full_margins;
+    stats->roots = roots.size();
+    stats->max_shift = max_shift;
+    cache.swap(kept);
+
+    // the rest from all k centres, tagged as a new pass
+    std::vector<centroid_t> traversed(k);
+    filter_cpu_stats_t engine_stats;
+    pointer_tree_t<kdTree_t> tree;
+    tree.pass = ++(*pass_tag);
+    engine.run(tree, roots, centres, k, traversed.data(), &engine_stats);
+    for (uint i=0; i<k; i++) {
+        for (uint d=0; d<D; d++) {
+            centroids[i].wgtCent.value[d] += traversed[i].wgtCent.value[d];
+        }
+        centroids[i].sum_sq += traversed[i].sum_sq;
+        centroids[i].count += traversed[i].count;
+    }
+    for (uint r=0; r<roots.size(); r++) {
+        collect(roots[r], tree.pass, centres);
+    }
+    merge(resolution);
+
+    // the margins of the reused entries now refer to these centres as well
+    previous.assign(centres, centres + k);
+
+    stats->visited_nodes = engine_stats.visited_nodes;
+    stats->dead_ends = cache.size();
+    stats->ms = (aocl_utils::getCurrentTimestamp() - start_time) * 1e3;
+}
+
+
+#endif
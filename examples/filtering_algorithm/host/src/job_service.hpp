@@ -0,0 +1,389 @@
+/**********************************************************************
+* Felix Winterstein, Imperial College London, 2016
+*
+* File: job_service.hpp
+*
+* Revision 1.01
+* Additional Comments: distributed under an Apache-2.0 license, see LICENSE
+*
+**********************************************************************/
+
+/*
+ * Spool directory job service.
+ *
+ * A job is a text file <name>.job in the spool directory with one key=value
+ * per line:
+ *
+ *   n=1048576          number of data points
+ *   k=128              number of centres (at most the host's K)
+ *   std_dev=0.08       selects the data set files, as in the one-shot mode
+ *   centres=1          initial centre set (initial_centers_..._<centres>.mat)
+ *   iterations=30      optional iteration cap
+ *
+ * The data files are looked up in the executable's directory under the usual
+ * names. A job is claimed by renaming it to <name>.job.taken, so several
+ * writers can drop jobs in at any time; the result goes to <name>.result and
+ * the job file is removed. A file named STOP ends the service once all
+ * queued jobs are done.
+ *
+ * Loading and tree building (load_job) run on a builder thread that stays one
+ * job ahead of the device: job_queue_t holds at most one prepared job.
+ */
+
+#ifndef JOB_SERVICE_H
+#define JOB_SERVICE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <algorithm>
+#include <mutex>
+#include <condition_variable>
+
+#include "CL/opencl.h"
+#include "AOCLUtils/aocl_utils.h"
+#include "my_util.hpp"
+#include "build_kdTree.h"
+
+#define JOB_POLL_MS         50      // spool directory scan interval when idle
+#define JOB_STOP_FILE       "STOP"
+
+
+struct job_t {
+    std::string name;
+    uint n;
+    uint k;
+    double std_dev;
+    uint centre_set;
+    uint iterations;            // 0: host default
+
+    bool ok;
+    std::string error;
+
+    data_type *data_points;
+    uint *index_arr;
+    uint *cntr_idx;
+    kdTree_t *root;
+
+    // timestamps (getCurrentTimestamp)
+    double claim_time;
+    double ready_time;          // tree built
+    double start_time;          // device run started
+    double done_time;
+    double load_ms;
+    double build_ms;            // bounding box and tree
+};
+
+struct job_result_t {
+    bool converged;
+    uint iterations;
+    cl_ulong total_distortion;
+    double kernel_ms;
+    std::vector<cl_int4> centres;
+    std::vector<cl_uint> distortion;
+};
+
+
+// Bounded FIFO between the builder thread and the device loop.
+template<typename T>
+class job_queue_t {
+public:
+
+    job_queue_t(uint capacity) : capacity(capacity) {}
+
+    void push(const T &item) {
+        std::unique_lock<std::mutex> guard(lock);
+        not_full.wait(guard, [this] { return items.size() < capacity; });
+        items.push_back(item);
+        not_empty.notify_one();
+    }
+
+    T pop() {
+        std::unique_lock<std::mutex> guard(lock);
+        not_empty.wait(guard, [this] { return !items.empty(); });
+        T item = items.front();
+        items.pop_front();
+        not_full.notify_one();
+        return item;
+    }
+
+private:
+    uint capacity;
+    std::deque<T> items;
+    std::mutex lock;
+    std::condition_variable not_empty;
+    std::condition_variable not_full;
+};
+
+
+class job_spool_t {
+public:
+
+    job_spool_t(const std::string &dir) : dir(dir) {}
+
+    // Claim the oldest pending job (by name). Returns false if there is none.
+    bool next(job_t *job);
+
+    bool stop_requested() const {
+        return access(path(JOB_STOP_FILE).c_str(), F_OK) == 0;
+    }
+
+    void write_result(const job_t &job, const job_result_t &result) const;
+
+private:
+
+    std::string path(const std::string &file) const {
+        return dir + "/" + file;
+    }
+
+    bool parse(const std::string &file, job_t *job) const;
+
+    std::string dir;
+};
+
+
+bool job_spool_t::next(job_t *job)
+{
+    DIR *d = opendir(dir.c_str());
+    if (d == NULL) {
+        return false;
+    }
+
+    std::vector<std::string> pending;
+    struct dirent *e;
+    while ((e = readdir(d)) != NULL) {
+        std::string name(e->d_name);
+        if ((name.size() > 4) && (name.compare(name.size()-4, 4, ".job") == 0)) {
+            pending.push_back(name);
+        }
+    }
+    closedir(d);
+    std::sort(pending.begin(), pending.end());
+
+    for (uint i=0; i<pending.size(); i++) {
+        std::string taken = pending[i] + ".taken";
+        if (rename(path(pending[i]).c_str(), path(taken).c_str()) != 0) {
+            continue;   // claimed by someone else in the meantime
+        }
+
+        job->name       = pending[i].substr(0, pending[i].size()-4);
+        job->claim_time = aocl_utils::getCurrentTimestamp();
+        job->ok         = parse(taken, job);
+        return true;
+    }
+    return false;
+}
+
+
+bool job_spool_t::parse(const std::string &file, job_t *job) const
+{
+    job->n = 0;
+    job->k = 0;
+    job->std_dev = 0.0;
+    job->centre_set = 1;
+    job->iterations = 0;
+    job->data_points = NULL;
+    job->index_arr = NULL;
+    job->cntr_idx = NULL;
+    job->root = NULL;
+    job->ready_time = job->start_time = job->done_time = job->claim_time;
+    job->load_ms = job->build_ms = 0.0;
+
+    FILE *fp = fopen(path(file).c_str(), "r");
+    if (fp == NULL) {
+        job->error = "cannot open job file";
+        return false;
+    }
+    char line[256];
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        char key[64];
+        char value[128];
+        if ((line[0] == '#') || (sscanf(line, " %63[^= ] = %127s", key, value) != 2)) {
+            continue;
+        }
+        if (strcmp(key, "n") == 0) {
+            job->n = atoi(value);
+        } else if (strcmp(key, "k") == 0) {
+            job->k = atoi(value);
+        } else if (strcmp(key, "std_dev") == 0) {
+            job->std_dev = atof(value);
+        } else if (strcmp(key, "centres") == 0) {
+            job->centre_set = atoi(value);
+        } else if (strcmp(key, "iterations") == 0) {
+            job->iterations = atoi(value);
+        }
+    }
+    fclose(fp);
+    remove(path(file).c_str());
+
+    if ((job->n == 0) || (job->k == 0)) {
+        job->error = "n and k are required";
+        return false;
+    }
+    return true;
+}
+
+
+void job_spool_t::write_result(const job_t &job, const job_result_t &result) const
+{
+    std::string tmp = path(job.name + ".result.tmp");
+    FILE *fp = fopen(tmp.c_str(), "w");
+    if (fp == NULL) {
+        printf("Service: cannot write result of job %s\n", job.name.c_str());
+        return;
+    }
+
+    fprintf(fp, "status=%s\n", job.ok ? "ok" : "failed");
+    if (!job.ok) {
+        fprintf(fp, "error=%s\n", job.error.c_str());
+    }
+    fprintf(fp, "n=%u\nk=%u\n", job.n, job.k);
+    fprintf(fp, "latency_ms=%.3f\n", (job.done_time - job.claim_time) * 1e3);
+    fprintf(fp, "load_ms=%.3f\nbuild_ms=%.3f\n", job.load_ms, job.build_ms);
+    fprintf(fp, "wait_ms=%.3f\n", (job.start_time - job.ready_time) * 1e3);
+    fprintf(fp, "run_ms=%.3f\n", (job.done_time - job.start_time) * 1e3);
+    if (job.ok) {
+        fprintf(fp, "kernel_ms=%.3f\n", result.kernel_ms);
+        fprintf(fp, "iterations=%u\nconverged=%u\n", result.iterations, result.converged ? 1 : 0);
+        fprintf(fp, "distortion=%llu\n", (unsigned long long)result.total_distortion);
+        for (uint i=0; i<result.centres.size(); i++) {
+            data_type c = vector_2_data_type(result.centres[i]);
+            fprintf(fp, "centre%u=", i);
+            for (uint d=0; d<D; d++) {
+                fprintf(fp, "%d%s", c.value[d], (d == D-1) ? "" : ",");
+            }
+            fprintf(fp, " %u\n", result.distortion[i]);
+        }
+    }
+    fclose(fp);
+
+    // the result appears complete or not at all
+    rename(tmp.c_str(), path(job.name + ".result").c_str());
+}
+
+
+// Read the job's data set and initial centres and build its kd-tree.
+bool load_job(job_t *job, uint max_k)
+{
+    if (!job->ok) {
+        return false;
+    }
+    if (job->k > max_k) {
+        job->ok = false;
+        job->error = "k exceeds the maximum number of centres";
+        return false;
+    }
+
+    const double start_time = aocl_utils::getCurrentTimestamp();
+
+    job->data_points = new data_type[job->n];
+    job->index_arr = new uint[job->n];
+    job->cntr_idx = new uint[job->k];
+
+    if (!read_data_points(job->n, job->k, job->std_dev, job->data_points, job->index_arr)) {
+        job->ok = false;
+        job->error = "reading data points failed";
+    } else if (!read_initial_centres(job->n, job->k, job->std_dev, job->cntr_idx, job->centre_set)) {
+        job->ok = false;
+        job->error = "reading initial centres failed";
+    }
+
+    const double load_time = aocl_utils::getCurrentTimestamp();
+    job->load_ms = (load_time - start_time) * 1e3;
+
+    if (job->ok) {
+        for (uint i=0; i<job->k; i++) {
+            if (job->cntr_idx[i] >= job->n) {
+                job->ok = false;
+                job->error = "initial centre index out of range";
+            }
+        }
+    }
+
+    if (job->ok) {
+        data_type bnd_lo, bnd_hi;
+        compute_bounding_box(job->data_points, job->index_arr, job->n, &bnd_lo, &bnd_hi);
+        job->root = buildkdTree(job->data_points, job->index_arr, job->n, &bnd_lo, &bnd_hi);
+    }
+
+    job->ready_time = aocl_utils::getCurrentTimestamp();
+    job->build_ms = (job->ready_time - load_time) * 1e3;
+    return job->ok;
+}
+
+
+void release_job(job_t *job)
+{
+    if (job->root != NULL) {
+        deletekdTree(job->root);
+    }
+    delete[] job->data_points;
+    delete[] job->index_arr;
+    delete[] job->cntr_idx;
+    job->root = NULL;
+    job->data_points = NULL;
+    job->index_arr = NULL;
+    job->cntr_idx = NULL;
+}
+
+
+// latency and throughput over all jobs of a service session
+class job_stats_t {
+public:
+
+    job_stats_t() : failed(0), first_claim(0.0), last_done(0.0), build_ms(0.0), overlapped_ms(0.0), prev_start(0.0), prev_done(0.0) {}
+
+    void add(const job_t &job) {
+        if (latencies.empty() || (job.claim_time < first_claim)) {
+            first_claim = job.claim_time;
+        }
+        last_done = (job.done_time > last_done) ? job.done_time : last_done;
+        latencies.push_back((job.done_time - job.claim_time) * 1e3);
+        failed += job.ok ? 0 : 1;
+        build_ms += job.load_ms + job.build_ms;
+
+        // part of this job's preparation that ran while the device was busy with the previous one
+        if (job.ok && (prev_done > 0.0)) {
+            double prep_start = job.ready_time - (job.load_ms + job.build_ms) * 1e-3;
+            double overlap = std::min(job.ready_time, prev_done) - std::max(prep_start, prev_start);
+            overlapped_ms += (overlap > 0.0) ? overlap * 1e3 : 0.0;
+        }
+        prev_start = job.start_time;
+        prev_done = job.done_time;
+    }
+
+    void print() const {
+        if (latencies.empty()) {
+            printf("Service: no jobs\n");
+            return;
+        }
+        std::vector<double> l(latencies);
+        std::sort(l.begin(), l.end());
+        double sum = 0.0;
+        for (uint i=0; i<l.size(); i++) {
+            sum += l[i];
+        }
+        const double span_s = last_done - first_claim;
+        printf("Service: %u job(s), %u failed, throughput %.3f jobs/s, latency mean %.3f ms, median %.3f ms, max %.3f ms, load+build %.3f ms of which %.3f ms overlapped with device runs\n",
+                (uint)l.size(), failed, (span_s > 0.0) ? (double)l.size() / span_s : 0.0,
+                sum / (double)l.size(), l[l.size()/2], l.back(), build_ms, overlapped_ms);
+    }
+
+private:
+    std::vector<double> latencies;
+    uint failed;
+    double first_claim;
+    double last_done;
+    double build_ms;
+    double overlapped_ms;
+    double prev_start;          // device run of the previous job
+    double prev_done;
+};
+
+
+#endif
@@ -0,0 +1,309 @@
+/**********************************************************************
+* Felix Winterstein, Imperial College London, 2016
+*
+* File: lsu_profile.hpp
+*
+* Revision 1.01
+* Additional Comments: distributed under an Apache-2.0 license, see LICENSE
+*
+**********************************************************************/
+
+/*
+ * LSU profiling counters of the host memory bridge.
+ *
+ * With PROFILE=1, host_memory_bridge_512bit_rw.vhd returns five 32-bit
+ * counters per LSU in the upper 512 bits of every 512-bit load, which
+ * vector_2_kdTree_t (snode.cl) copies into a uint16 and filter0 writes to
+ * profile_data[0]. The counters run from reset and wrap at 2^32:
+ *
+ *   lane  0- 4   rw                data LSU (node fetches)
+ *   lane  5- 9   read_pt_level1    second-level page table LSU
+ *   lane 10-14   read_pt_level0    first-level page table LSU (one read per walk)
+ *   lane 15      unused by the bridge, number of batches in a delta record
+ *
+ * and per LSU: bytes, words (32-bit requests), sum of burst counts, number of
+ * bursts, cache hits. If filter0 is compiled with LSU_PROFILE_DELTAS,
+ * profile_data[1] holds the deltas of the last run, accumulated per batch.
+ * Otherwise the deltas are taken between the snapshots of consecutive runs.
+ *
+ * The software model (lsu_model) fills in the same record for a traversal
+ * done on the host, assuming one translation per node fetch and no LSU cache.
+ */
+
+#ifndef LSU_PROFILE_H
+#define LSU_PROFILE_H
+
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include "CL/opencl.h"
+
+enum lsu_port_t {
+    LSU_RW = 0,
+    LSU_PT_LEVEL1,
+    LSU_PT_LEVEL0,
+    LSU_PORTS
+};
+
+enum lsu_field_t {
+    LSU_BYTES = 0,
+    LSU_WORDS,
+    LSU_BURST_TOTAL,
+    LSU_BURSTS,
+    LSU_CACHE_HITS,
+    LSU_FIELDS
+};
+
+#define LSU_LANE(port, field)   ((port)*LSU_FIELDS + (field))
+#define LSU_LANE_BATCHES        15
+#define LSU_PROFILE_RECORDS     2       // entries of profile_data: snapshot, deltas
+
+#define LSU_NODE_BYTES          64      // one kdTree_t bundle (512 bits)
+
+static const char *lsu_port_name[LSU_PORTS] = {"rw", "read_pt_level1", "read_pt_level0"};
+
+
+// counters of one LSU
+struct lsu_port_counters_t {
+    cl_ulong bytes;
+    cl_ulong words;
+    cl_ulong burst_total;
+    cl_ulong bursts;
+    cl_ulong cache_hits;
+};
+
+// all bridge counters (a snapshot or the deltas of a run)
+struct lsu_profile_t {
+    lsu_port_counters_t port[LSU_PORTS];
+    cl_ulong batches;
+
+    void clear() {
+        memset(this, 0, sizeof(lsu_profile_t));
+    }
+
+    void add(const lsu_profile_t &p) {
+        for (uint i=0; i<LSU_PORTS; i++) {
+            port[i].bytes       += p.port[i].bytes;
+            port[i].words       += p.port[i].words;
+            port[i].burst_total += p.port[i].burst_total;
+            port[i].bursts      += p.port[i].bursts;
+            port[i].cache_hits  += p.port[i].cache_hits;
+        }
+        batches += p.batches;
+    }
+};
+
+
+// named metrics derived from the counters
+struct lsu_port_metrics_t {
+    double mb;
+    cl_ulong words;
+    double average_burst;
+    double hit_rate;        // %
+};
+
+struct lsu_metrics_t {
+    lsu_port_metrics_t port[LSU_PORTS];
+    cl_ulong node_fetches;
+    cl_ulong batches;
+    double walks_per_fetch;     // first-level page table reads per node fetch
+    double bytes_per_fetch;     // all three LSUs
+};
+
+
+static lsu_profile_t lsu_decode(const cl_uint16 &v)
+{
+    lsu_profile_t p;
+    for (uint i=0; i<LSU_PORTS; i++) {
+        p.port[i].bytes         = v.s[LSU_LANE(i, LSU_BYTES)];
+        p.port[i].words         = v.s[LSU_LANE(i, LSU_WORDS)];
+        p.port[i].burst_total   = v.s[LSU_LANE(i, LSU_BURST_TOTAL)];
+        p.port[i].bursts        = v.s[LSU_LANE(i, LSU_BURSTS)];
+        p.port[i].cache_hits    = v.s[LSU_LANE(i, LSU_CACHE_HITS)];
+    }
+    p.batches = v.s[LSU_LANE_BATCHES];
+    return p;
+}
+
+
+// counter increase from snapshot before to snapshot after (modulo 2^32)
+static lsu_profile_t lsu_delta(const cl_uint16 &after, const cl_uint16 &before)
+{
+    cl_uint16 d;
+    for (uint i=0; i<16; i++) {
+        d.s[i] = after.s[i] - before.s[i];
+    }
+    d.s[LSU_LANE_BATCHES] = 0;
+    return lsu_decode(d);
+}
+
+
+// Counters of the last filter0 run from its profiling_data records: the deltas
+// accumulated per batch if there are any, otherwise the difference to the
+// snapshot of the previous run, which is then updated.
+static lsu_profile_t lsu_run_profile(const cl_uint16 *records, cl_uint16 *snapshot)
+{
+    lsu_profile_t p;
+    if (records[1].s[LSU_LANE_BATCHES] > 0) {
+        p = lsu_decode(records[1]);
+    } else {
+        p = lsu_delta(records[0], *snapshot);
+    }
+    *snapshot = records[0];
+    return p;
+}
+
+
+// Counters the bridge would report for a traversal with the given number of
+// node fetches: every fetch is translated by one first- and one second-level
+// page table read and transferred as 32-bit words, nothing hits a cache.
+static lsu_profile_t lsu_model(cl_ulong node_fetches, cl_ulong batches)
+{
+    lsu_profile_t p;
+    p.clear();
+
+    const cl_ulong words = LSU_NODE_BYTES / sizeof(cl_uint);
+    p.port[LSU_RW].bytes        = node_fetches * LSU_NODE_BYTES;
+    p.port[LSU_RW].words        = node_fetches * words;
+    p.port[LSU_RW].burst_total  = node_fetches * words;
+    p.port[LSU_RW].bursts       = node_fetches * words;
+
+    const uint pt[2] = {LSU_PT_LEVEL1, LSU_PT_LEVEL0};
+    for (uint i=0; i<2; i++) {
+        p.port[pt[i]].bytes         = node_fetches * sizeof(cl_uint);
+        p.port[pt[i]].words         = node_fetches;
+        p.port[pt[i]].burst_total   = node_fetches;
+        p.port[pt[i]].bursts        = node_fetches;
+    }
+    p.batches = batches;
+    return p;
+}
+
+
+static lsu_metrics_t lsu_metrics(const lsu_profile_t &p, cl_ulong node_fetches)
+{
+    lsu_metrics_t m;
+    cl_ulong bytes = 0;
+    for (uint i=0; i<LSU_PORTS; i++) {
+        const lsu_port_counters_t &c = p.port[i];
+        m.port[i].mb            = (double)c.bytes / (1024.0 * 1024.0);
+        m.port[i].words         = c.words;
+        m.port[i].average_burst = (c.bursts > 0) ? (double)c.burst_total / (double)c.bursts : 0.0;
+        m.port[i].hit_rate      = (c.words > 0) ? (double)c.cache_hits * 100.0 / (double)c.words : 0.0;
+        bytes += c.bytes;
+    }
+    m.node_fetches      = node_fetches;
+    m.batches           = p.batches;
+    m.walks_per_fetch   = (node_fetches > 0) ? (double)p.port[LSU_PT_LEVEL0].words / (double)node_fetches : 0.0;
+    m.bytes_per_fetch   = (node_fetches > 0) ? (double)bytes / (double)node_fetches : 0.0;
+    return m;
+}
+
+
+static void lsu_print(const lsu_metrics_t &m)
+{
+    for (uint i=0; i<LSU_PORTS; i++) {
+        printf("%s: transferred data = %.2f MB\n", lsu_port_name[i], m.port[i].mb);
+        printf("%s: number of transferred 32bit words = %llu\n", lsu_port_name[i], (unsigned long long)m.port[i].words);
+        printf("%s: average burst size = %.2f\n", lsu_port_name[i], m.port[i].average_burst);
+        printf("%s: cache hit rate = %.5f\n", lsu_port_name[i], m.port[i].hit_rate);
+    }
+    printf("node fetches: %llu, page table walks per node fetch: %.3f, bytes per node fetch: %.1f\n",
+            (unsigned long long)m.node_fetches, m.walks_per_fetch, m.bytes_per_fetch);
+}
+
+
+// Per-iteration records of timing phases and LSU metrics, written as JSON
+// (default) or CSV (file name ending in .csv).
+class lsu_log_t {
+public:
+
+    typedef std::vector< std::pair<std::string, double> > phases_t;
+
+    void add(uint iteration, const phases_t &phases, const lsu_metrics_t &metrics) {
+        record_t r = {iteration, phases, metrics};
+        records.push_back(r);
+    }
+
+    bool empty() const { return records.empty(); }
+
+    bool write(const char *file_name) const {
+        FILE *fp = fopen(file_name, "w");
+        if (fp == NULL) {
+            printf("Cannot write profile %s\n", file_name);
+            return false;
+        }
+        std::string name(file_name);
+        bool csv = (name.size() >= 4) && (name.compare(name.size()-4, 4, ".csv") == 0);
+        if (csv) {
+            write_csv(fp);
+        } else {
+            write_json(fp);
+        }
+        fclose(fp);
+        printf("Profile: %u iteration(s) written to %s\n", (uint)records.size(), file_name);
+        return true;
+    }
+
+private:
+
+    struct record_t {
+        uint iteration;
+        phases_t phases;
+        lsu_metrics_t metrics;
+    };
+
+    void write_csv(FILE *fp) const {
+        if (records.empty()) {
+            return;
+        }
+        fprintf(fp, "iteration");
+        for (uint j=0; j<records[0].phases.size(); j++) {
+            fprintf(fp, ",%s", records[0].phases[j].first.c_str());
+        }
+        fprintf(fp, ",node_fetches,batches,walks_per_fetch,bytes_per_fetch");
+        for (uint i=0; i<LSU_PORTS; i++) {
+            fprintf(fp, ",%s_mb,%s_words,%s_average_burst,%s_hit_rate", lsu_port_name[i], lsu_port_name[i], lsu_port_name[i], lsu_port_name[i]);
+        }
+        fprintf(fp, "\n");
+
+        for (uint r=0; r<records.size(); r++) {
+            const lsu_metrics_t &m = records[r].metrics;
+            fprintf(fp, "%u", records[r].iteration);
+            for (uint j=0; j<records[r].phases.size(); j++) {
+                fprintf(fp, ",%.6f", records[r].phases[j].second);
+            }
+            fprintf(fp, ",%llu,%llu,%.6f,%.3f", (unsigned long long)m.node_fetches, (unsigned long long)m.batches, m.walks_per_fetch, m.bytes_per_fetch);
+            for (uint i=0; i<LSU_PORTS; i++) {
+                fprintf(fp, ",%.6f,%llu,%.4f,%.5f", m.port[i].mb, (unsigned long long)m.port[i].words, m.port[i].average_burst, m.port[i].hit_rate);
+            }
+            fprintf(fp, "\n");
+        }
+    }
+
+    void write_json(FILE *fp) const {
+        fprintf(fp, "{\"iterations\":[");
+        for (uint r=0; r<records.size(); r++) {
+            const lsu_metrics_t &m = records[r].metrics;
+            fprintf(fp, "%s\n{\"iteration\":%u,\"phases\":{", (r == 0) ? "" : ",", records[r].iteration);
+            for (uint j=0; j<records[r].phases.size(); j++) {
+                fprintf(fp, "%s\"%s\":%.6f", (j == 0) ? "" : ",", records[r].phases[j].first.c_str(), records[r].phases[j].second);
+            }
+            fprintf(fp, "},\"node_fetches\":%llu,\"batches\":%llu,\"walks_per_fetch\":%.6f,\"bytes_per_fetch\":%.3f,\"lsu\":{",
+                    (unsigned long long)m.node_fetches, (unsigned long long)m.batches, m.walks_per_fetch, m.bytes_per_fetch);
+            for (uint i=0; i<LSU_PORTS; i++) {
+                fprintf(fp, "%s\"%s\":{\"mb\":%.6f,\"words\":%llu,\"average_burst\":%.4f,\"hit_rate\":%.5f}", (i == 0) ? "" : ",",
+                        lsu_port_name[i], m.port[i].mb, (unsigned long long)m.port[i].words, m.port[i].average_burst, m.port[i].hit_rate);
+            }
+            fprintf(fp, "}}");
+        }
+        fprintf(fp, "\n]}\n");
+    }
+
+    std::vector<record_t> records;
+};
+
+
+#endif
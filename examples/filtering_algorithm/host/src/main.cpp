@@ -17,51 +17,167 @@
 #include <mutex>          // std::mutex, std::lock
 #include <atomic>
 #include <pthread.h>
+#include <thread>
 
 
 #include "../../../../svm_common/svm_utils/svm_utils.hpp"
 
 #include "my_util.hpp"
 #include "build_kdTree.h"
+#include "filter_cpu.hpp"
+#include "hybrid.hpp"
+#include "multi_device.hpp"
+#include "lsu_profile.hpp"
+#include "cl_runtime.hpp"
+#include "trace.hpp"
+#include "job_service.hpp"
+#include "batch_model.hpp"
+#include "engine_model.hpp"
+#include "incremental.hpp"
+#include "bounds.hpp"
 
 #define N 1024*1024 // number of data points
-#define K 128       // number of centres
+#ifndef K
+#define K 128       // number of centres (-DK=<k>, at most the KMAX of the kernel: 256, or 4096 with CENTER_SET_BITMAP)
+#endif
 #define S 0.08      // standard deviation (determines the clusteredness of the data set)
 
+#define MAX_ITERATIONS          30      // default cap on the number of Lloyd iterations (-iterations=<n>)
+#define CENTRE_TOLERANCE        0       // converged once no centre coordinate moves by more than this (-centre-tolerance=<n>)
+#define DISTORTION_TOLERANCE    1e-4    // converged once the relative change in total distortion (pass_distortion) drops below this (-distortion-tolerance=<x>)
+
+#define MAX_HYBRID_DEPTH        8       // 2^8 subtree roots at most (HYBRID_MAX_ROOTS)
+#define HOST_SHARE              0.25    // fraction of the points processed on the host in the first hybrid iteration (-host-share=<x>)
+#define SUBTREES_PER_INSTANCE   8       // default cut of the multi-instance traversal (-instances=<n>)
+#define SCALING_PASSES          3       // passes per instance count in the scaling report, best one counts
+#define SPILL_RECORDS           (1<<20) // capacity of filter0's stack spill region in records of 8 bytes (-spill-records=<n>)
+#define SET_SPILL_SLOTS         4096    // slots of filter0's second-tier centre-set heap (-set-spill=<slots>, at most CENTER_SET_SPILL_SLOTS of the kernel)
+#define CENTER_SET_SLOT_BYTES   512     // one slot: KMAX=256 one-byte centre indices, or a bitmap of up to 4096 centres (device/dyn_mem_alloc.cl)
+#define STACK_INFO_WORDS        12      // filter0 statistics, see report_stack_info
+#define FILTER0_BATCH_SIZE      128     // BATCH_SIZE of the kernel, for the models
+#define FILTER1_ACC_BANKS       4       // ACC_BANKS of the kernel, for the -verify check of its banked sums
+#define FILTER0_BATCH_WORK      1024    // candidates per filter0 batch to aim for, batch_work of the kernel (-batch-work=<n>, 0: BATCH_SIZE records)
+#define INCREMENTAL_MIN_REUSE   0.5     // reusable fraction of the cached dead ends below which an incremental pass traverses the whole tree (-incremental-min-reuse=<x>)
+#define FILTER0_BATCH_OVERHEAD  200     // cycles a batch adds to its candidates in loops 0 and 1, an estimate for the occupancy figures (-batch-overhead=<n>)
+#define STEAL_LATENCY           300     // cycles for an engine to get a record from a peer or the shared queue, engine model (-steal-latency=<n>)
+
 using namespace aocl_utils;
 
 // OpenCL runtime configuration
 cl_platform_id platform = NULL;
-cl_device_id device; 
+cl_device_id device;            // device 0
+scoped_array<cl_device_id> devices;
+unsigned num_devices = 0;
 cl_context context = NULL;
 cl_program program = NULL;
 cl_command_queue queue0;
 cl_command_queue queue1;
+cl_command_queue queue2;        // result readback, off the path between the kernels
 cl_kernel kernel0 = NULL; 
 cl_kernel kernel1 = NULL; 
 
 cl_mem initial_centers_buf;
+cl_mem roots_buf;
 
 cl_mem z0_buf; 
 
 cl_mem visited_nodes_buf; 
 cl_mem new_centers_buf; 
 cl_mem distortion_buf; 
+cl_mem distortion_b_buf;        // second distortion buffer of the double-buffered iterations
+cl_mem partial_sums_buf;
+cl_mem partial_sums_b_buf;      // second partial sums buffer of the double-buffered iterations
+cl_mem stack_info_buf;          // filter0 stack statistics (report_stack_info)
 
 cl_mem profiling_data_buf; 
 
 
+// per-iteration timing breakdown
+struct iteration_stats_t {
+    double enqueue_ms;      // host: centre write + kernel launches + readback enqueue
+    double kernel_ms;       // device: first kernel start to last kernel end
+    double readback_ms;     // device: span of the result transfers
+    double check_ms;        // host: convergence check and centre update
+    double iteration_ms;    // host: wall-clock time of the whole iteration
+    cl_ulong device_nodes;  // node fetches through the bridge
+    lsu_profile_t lsu;      // bridge LSU counters of this iteration
+    double gap_ms;          // device: previous filter1 end to this filter0 start (< 0: no previous pass)
+};
+
+// One of the two buffer sets of the double-buffered iterations. The pass
+// enqueued with set s reads its centres from slots[s].centres_buf and filter1
+// writes the new centres to slots[s^1].centres_buf, where the next pass finds
+// them without a round trip through the host.
+struct iteration_slot_t {
+    cl_mem centres_buf;
+    cl_mem distortion_buf;
+    cl_mem partial_sums_buf;
+    cl_uint *visited_nodes;     // host copies of the results of the pass
+    cl_uint16 *profiling_data;
+    cl_int4 *new_centers;
+    cl_uint *distortion;
+    cl_int4 *partial_sums;
+    cl_event write_event;       // NULL if the centres came from the previous pass
+    cl_event kernel_event[2];
+    cl_event read_event[5];
+    double start_time;
+    double enqueue_ms;
+    bool pending;
+};
+
+// startup pipeline: data load -> bounding box -> tree build, run on a worker
+// thread while the main thread brings up OpenCL and SVM
+struct startup_t {
+    bool ok;
+    double load_ms;         // data points and initial centres
+    double bbox_ms;
+    double build_ms;        // kd-tree construction
+    double done_time;       // timestamp when the tree was ready
+};
+
 // Function prototypes
+void prepare_data(startup_t *startup);
 bool init_opencl();
-void run();
+void run(job_result_t *result = NULL);
+void enqueue_iteration(uint s, bool upload);
+void finish_iteration(uint s, iteration_stats_t *stats);
+void discard_iteration(uint s);
+void run_hybrid_iteration(hybrid_scheduler *scheduler, iteration_stats_t *stats);
+void run_multi_iteration(multi_scheduler *scheduler, iteration_stats_t *stats);
+void run_incremental_iteration(incremental_filter *incremental, iteration_stats_t *stats);
+void run_scaling(uint max_instances);
+std::vector<hybrid_device*> create_instances(uint n);
+void release_instances(std::vector<hybrid_device*> &list);
+uint multi_depth(uint n);
+void run_multistart(uint m);
+void run_bounds_bench();
+void run_service(const std::string &spool_dir);
+lsu_profile_t device_lsu_profile();
+void trace_lsu_counters(double ts, const lsu_metrics_t &m);
+bool check_convergence(const cl_int4 *old_centers, const cl_int4 *next_centers, cl_ulong total_distortion, cl_ulong prev_total_distortion, bool have_prev, coord_type *max_shift);
+cl_ulong points_sum_sq(const kdTree_t *u);
+cl_ulong pass_distortion(const cl_int4 *centres, const cl_int4 *sums, uint k, cl_ulong sum_sq);
+void centroids_2_partial_sums(const centroid_t *centroids, uint k, cl_int4 *sums);
+uint verify_iteration(const filter_cpu &engine, const std::vector<const kdTree_t*> &roots);
+uint verify_banks(const std::vector<std::pair<const kdTree_t*, center_index_t> > &dead_ends, const data_type *centres, uint k, const centroid_t *centroids);
+cl_uint *alloc_spill_region(size_t bytes, const char *what);
+uint resolve_labels(const kdTree_t *root, cl_uint pass, std::vector<uint> &labels, uint *dead_ends);
+uint verify_labels(const std::vector<uint> &labels, const cl_int4 *centres, uint k);
+bool report_stack_info(const char *label, const cl_uint *info);
 void cleanup();
 
 cl_int4 *initial_centers;
 cl_uint *visited_nodes;
 cl_int4 *new_centers;
 cl_uint *distortion;
+cl_uint *roots_list;
+cl_int4 *partial_sums;
+cl_uint *stack_info;
 
 cl_uint16 *profiling_data;
+cl_uint16 lsu_snapshot;         // profiling_data[0] of the previous filter0 run
+lsu_log_t lsu_log;
+std::string profile_file;       // -profile=<file>: per-iteration phases and LSU metrics (.json or .csv)
 
 address_t ttbr0_value;
 
@@ -69,52 +185,406 @@ data_type *data_points  = NULL;
 uint *index_arr         = NULL;
 uint *cntr_idx          = NULL;
 kdTree_t* root          = NULL;
+uint k_centres          = K;    // centres of the current run (K or a service job's k)
+
+// iteration control
+uint max_iterations         = MAX_ITERATIONS;
+coord_type centre_tolerance = CENTRE_TOLERANCE;
+double distortion_tolerance = DISTORTION_TOLERANCE;
+
+// host reference (filter_cpu.hpp)
+bool verify_cpu             = false;
+uint cpu_threads            = 0;    // 0: one thread per core
+bool cpu_simd               = true; // SIMD candidate evaluation (-scalar to disable)
+bool cpu_bitmap             = false;// bitmap candidate sets instead of index lists (-bitmap-sets)
+
+// hybrid traversal (hybrid.hpp)
+uint hybrid_depth           = 0;    // 0: the device processes the whole tree
+double host_share           = HOST_SHARE;
+bool software_device        = false;// software stand-in instead of the FPGA (no OpenCL/SVM setup)
+
+// multi-instance traversal (multi_device.hpp): the subtrees are partitioned over
+// several FPGAs (one per OpenCL device) or host engine instances
+uint instances              = 1;
+bool balance_cost           = true; // balance by the node fetches of the previous iteration (-balance=count: point counts)
+bool scaling_report         = false;// -scaling: one pass on 1..instances instances instead of the Lloyd iterations
+
+// filter0 spills the bottom of its traversal stack to a host memory region and
+// fills it back from there (filter_stream_opt1.cl), one region per FPGA instance
+uint spill_records          = SPILL_RECORDS;
+cl_uint *spill_stack        = NULL; // region of the single-device paths, allocated on first use
+uint set_spill_slots        = SET_SPILL_SLOTS;
+cl_uint *set_spill          = NULL; // second tier of the centre-set heap, likewise
+uint degenerate_points      = 0;    // -degenerate=<points>: linked-list-shaped tree over the first points (buildkdTree_chain)
+
+// node ownership (-labels): filter0 writes each dead end back with its closest
+// centre and a tag of the pass, the host resolves per-point labels from the tree
+bool write_labels           = false;
+cl_uint label_pass          = 0;    // tag of the latest single-device pass, counts up over the runs
+
+// filter0 closes a batch once its records carry batch_work candidates (or at
+// BATCH_SIZE records); -batch-model sweeps the target on a model of the schedule
+// (batch_model.hpp)
+cl_uint batch_work          = FILTER0_BATCH_WORK;
+uint batch_overhead         = FILTER0_BATCH_OVERHEAD;
+bool batch_model            = false;
+
+// replicated traversal engines (engine_model.hpp, -engine-model=<n>): the
+// predicted speed-up of 1..n copies of filter0, next to the host engine with one
+// thread per engine
+uint model_engines          = 0;
+uint steal_latency          = STEAL_LATENCY;
+uint model_accumulators     = 1;    // -accumulators=<n>
+
+// incremental passes on the host engine (incremental.hpp, -incremental): the dead
+// ends whose owner cannot change are added from their aggregates, not traversed
+bool incremental_passes     = false;
+double incremental_min_reuse = INCREMENTAL_MIN_REUSE;
+
+// -bounds-bench: distance computations per iteration of the host engine, of
+// Hamerly's bounds alone and of both combined (bounds.hpp), instead of the device passes
+bool bounds_bench           = false;
+
+// the run only drives the host engine (-bounds-bench, -incremental on the whole
+// tree): no OpenCL or SVM setup, no device buffers
+bool host_only              = false;
+
+// multi-start mode: best of several initial centre sets, batched on the host engine
+uint restarts               = 1;
+
+// repeated runs over the same tree (-runs=<n>), buffers and kernel arguments are reused unless -no-reuse
+uint runs                   = 1;
+bool reuse_resources        = true;
+cl_uint roots_buf_root      = 0;    // single root held by roots_buf
+
+// double-buffered iterations: the next pass is enqueued behind the current one
+// and the host checks convergence while it runs (-no-overlap: one at a time)
+bool overlap_iterations     = true;
+iteration_slot_t slots[2];
+cl_ulong last_filter1_end   = 0;    // device clock, 0: no pass yet in this run
+double iteration_mark       = 0.0;  // host time the previous iteration was done with
+
+// job service (-service=<spool dir>, job_service.hpp): device kept up, one run per job
+std::string service_dir;
+
+bool device_initialized     = false;
+
+double program_start_time   = 0.0;
+double first_kernel_time    = 0.0;  // first enqueue (time-to-first-kernel)
+
+
+// An FPGA as the device side of the hybrid and multi-instance traversals.
+// Instance i runs on OpenCL device i with its own queues, kernels, buffers and
+// LSU counter snapshot. Instances are created on first use (create_instances)
+// and kept until cleanup(), so their kernel argument bindings stay valid.
+class opencl_hybrid_device : public hybrid_device {
+public:
+
+    opencl_hybrid_device(cl_uint index);
+    ~opencl_hybrid_device();
+
+    const char *name() const { return "fpga"; }
+
+    void launch(const std::vector<const kdTree_t*> &roots, const data_type *centres, uint k);
+    void finish(centroid_t *centroids, cl_ulong *visited_nodes, double *time_ms);
+    lsu_profile_t lsu_profile();
+
+private:
+
+    // pool tag of a buffer of this instance
+    std::string tag(const char *name) const {
+        char t[64];
+        snprintf(t, sizeof(t), "instance%u_%s", index, name);
+        return std::string(t);
+    }
 
+    cl_uint index;
+    cl_command_queue queue[2];
+    cl_kernel kernel[2];
+
+    cl_mem centres_buf;
+    cl_mem roots_buf;
+    cl_mem z0_buf;
+    cl_mem visited_nodes_buf;
+    cl_mem profiling_data_buf;
+    cl_mem new_centers_buf;
+    cl_mem distortion_buf;
+    cl_mem partial_sums_buf;
+    cl_mem stack_info_buf;
+
+    // host copies
+    cl_int4 *centres;
+    cl_uint *roots_list;
+    cl_uint *visited_nodes;
+    cl_uint16 *profiling_data;
+    cl_int4 *partial_sums;
+    cl_uint *distortion;
+    cl_uint *stack_info;
+    cl_uint16 lsu_snapshot;
+    cl_uint *spill_stack;           // this instance's spill region of the filter0 stack
+    cl_uint *set_spill;             // and of its centre-set heap
+
+    cl_uint n_roots;
+    uint k;
+    bool stack_overflow;            // reported
+    cl_event write_event[2];
+    cl_event kernel_event[2];
+    cl_event read_event[5];
+};
+
+std::vector<opencl_hybrid_device*> fpga_instances;
 
 
 // Entry point.
 int main(int argc, char **argv) {
+    program_start_time = getCurrentTimestamp();
+
     Options options(argc, argv);  
 
+    if (options.has("iterations")) {
+        max_iterations = options.get<uint>("iterations");
+    }
+    if (options.has("centre-tolerance")) {
+        centre_tolerance = options.get<coord_type>("centre-tolerance");
+    }
+    if (options.has("distortion-tolerance")) {
+        distortion_tolerance = options.get<double>("distortion-tolerance");
+    }
+    if (options.has("verify")) {
+        verify_cpu = true;
+    }
+    if (options.has("threads")) {
+        cpu_threads = options.get<uint>("threads");
+    }
+    if (options.has("scalar")) {
+        cpu_simd = false;
+    }
+    if (options.has("bitmap-sets")) {
+        cpu_bitmap = true;
+    }
+    if (options.has("hybrid-depth")) {
+        hybrid_depth = options.get<uint>("hybrid-depth");
+        hybrid_depth = (hybrid_depth > MAX_HYBRID_DEPTH) ? MAX_HYBRID_DEPTH : hybrid_depth;
+    }
+    if (options.has("host-share")) {
+        host_share = options.get<double>("host-share");
+    }
+    if (options.has("software-device")) {
+        software_device = true;
+    }
+    if (options.has("backend")) {
+        // the device side of the traversal; cpu is the same as -software-device
+        std::string backend = options.get<std::string>("backend");
+        if (backend == "cpu") {
+            software_device = true;
+        } else if (backend == "emulator") {
+            printf("No emulator backend: the C model of the host memory bridge (svm_common/rtl_src/c_model.cl) does not reach host memory, use filtering_algorithm_no_svm\n");
+            return -1;
+        } else if (backend != "fpga") {
+            printf("Unknown backend '%s' (fpga or cpu)\n", backend.c_str());
+            return -1;
+        }
+    }
+    if (options.has("instances")) {
+        instances = options.get<uint>("instances");
+        instances = (instances > 0) ? instances : 1;
+    }
+    if (options.has("balance")) {
+        std::string balance = options.get<std::string>("balance");
+        if ((balance != "count") && (balance != "cost")) {
+            printf("Unknown balancing '%s' (count or cost)\n", balance.c_str());
+            return -1;
+        }
+        balance_cost = (balance == "cost");
+    }
+    if (options.has("scaling")) {
+        scaling_report = true;
+    }
+    if (options.has("spill-records")) {
+        spill_records = options.get<uint>("spill-records");
+    }
+    if (options.has("set-spill")) {
+        set_spill_slots = options.get<uint>("set-spill");
+    }
+    if (options.has("degenerate")) {
+        degenerate_points = options.get<uint>("degenerate");
+    }
+    if (options.has("labels")) {
+        write_labels = true;
+    }
+    if (options.has("batch-work")) {
+        batch_work = options.get<uint>("batch-work");
+    }
+    if (options.has("batch-overhead")) {
+        batch_overhead = options.get<uint>("batch-overhead");
+    }
+    if (options.has("batch-model")) {
+        batch_model = true;
+    }
+    if (options.has("engine-model")) {
+        model_engines = options.get<uint>("engine-model");
+    }
+    if (options.has("steal-latency")) {
+        steal_latency = options.get<uint>("steal-latency");
+    }
+    if (options.has("accumulators")) {
+        model_accumulators = options.get<uint>("accumulators");
+        model_accumulators = (model_accumulators > 0) ? model_accumulators : 1;
+    }
+    if (options.has("incremental")) {
+        incremental_passes = true;
+    }
+    if (options.has("incremental-min-reuse")) {
+        incremental_min_reuse = options.get<double>("incremental-min-reuse");
+    }
+    if (options.has("bounds-bench")) {
+        bounds_bench = true;
+    }
+    if (options.has("restarts")) {
+        restarts = options.get<uint>("restarts");
+        restarts = (restarts > 0) ? restarts : 1;
+    }
+    if (options.has("trace")) {
+        trace.open(options.get<std::string>("trace").c_str());
+    }
+    if (options.has("profile")) {
+        profile_file = options.get<std::string>("profile");
+    }
+    if (options.has("runs")) {
+        runs = options.get<uint>("runs");
+        runs = (runs > 0) ? runs : 1;
+    }
+    if (options.has("no-reuse")) {
+        reuse_resources = false;
+    }
+    if (options.has("no-overlap")) {
+        overlap_iterations = false;
+    }
+    if (options.has("service")) {
+        service_dir = options.get<std::string>("service");
+        restarts = 1;
+    }
 
-    const uint n = N;
-    const uint k = K;
-    const double std_dev = S;
+    host_only = service_dir.empty() && (bounds_bench || (!scaling_report && incremental_passes && (hybrid_depth == 0) && (instances <= 1)));
 
-    // input data points
-    data_points = new data_type[N];
+    if (service_dir.empty()) {
+        // input data points
+        data_points = new data_type[N];
 
-    // array of indices used by build_kdTree
-    index_arr = new uint[N];
+        // array of indices used by build_kdTree
+        index_arr = new uint[N];
 
-    // indices of initial centers
-    cntr_idx = new uint[K]; 
-    
-    if (!read_data_points(n, k, std_dev, data_points,index_arr)) {
-        printf("Reading data points failed\n");
-        return -1;  
+        // indices of initial centers (one set per restart)
+        cntr_idx = new uint[K*restarts]; 
     }
     
-    if (!read_initial_centres(n, k, std_dev, cntr_idx)) {
-        printf("Reading initial centers failed\n");
+    // init_opencl() changes to the executable's directory; do it before the data
+    // pipeline starts reading files relative to it
+    if (!setCwdToExeDir()) {
         return -1;
     }
 
-    // Initialize OpenCL.
-    if(!init_opencl()) {
+    // data pipeline on a worker thread, device bring-up on this one (the job
+    // service loads the data per job instead)
+    startup_t startup;
+    std::thread data_pipeline;
+    if (service_dir.empty()) {
+        data_pipeline = std::thread(prepare_data, &startup);
+    }
+
+    const double start_device_time = getCurrentTimestamp();
+    double program_ms = 0.0;
+    bool device_ok = true;
+
+    if (!software_device && !host_only && (restarts == 1)) {
+        // Initialize OpenCL.
+        device_ok = init_opencl();
+        program_ms = (getCurrentTimestamp() - start_device_time) * 1e3;
+        trace.span("init_opencl", TRACE_HOST, start_device_time, getCurrentTimestamp());
+
+        if (device_ok) {
+            // Enable Cyclone V ACP
+            enable_f2h_acp(true);
+
+            // Read value of ARM TTBR0 system register to get the entry point of the Linux page table
+            ttbr0_value = get_ttbr0();
+            init_svm();
+            device_initialized = true;
+
+            // one FPGA instance per device
+            if (instances > num_devices) {
+                printf("%u instances requested, %u device(s) available: using %u\n", instances, num_devices, num_devices);
+                instances = num_devices;
+            }
+        }
+    }
+
+    const double device_done_time = getCurrentTimestamp();
+    trace.span("SVM setup", TRACE_HOST, start_device_time + program_ms * 1e-3, device_done_time);
+
+    if (!service_dir.empty()) {
+        if (!device_ok) {
+            printf("OpenCL initialization failed\n");
+            cleanup();
+            return -1;
+        }
+        printf("Startup: device bring-up %0.3f ms (program %0.3f ms)\n", (device_done_time - start_device_time) * 1e3, program_ms);
+        cl_runtime.init(context, reuse_resources);
+        run_service(service_dir);
+        cleanup();
+        return 0;
+    }
+
+    // ready barrier: tree built and device up
+    data_pipeline.join();
+
+    const double ready_time = getCurrentTimestamp();
+    trace.span("ready barrier", TRACE_HOST, device_done_time, ready_time);
+
+    if (!device_ok) {
         printf("OpenCL initialization failed\n");
+        cleanup();
+        return -1;
+    }
+    if (!startup.ok) {
+        cleanup();
         return -1;
     }
 
-    // Enable Cyclone V ACP
-    enable_f2h_acp(true);
+    printf("Startup: data load %0.3f ms, bounding box %0.3f ms, tree build %0.3f ms | device bring-up %0.3f ms (program %0.3f ms, SVM %0.3f ms) | ready after %0.3f ms (%s waited %0.3f ms)\n",
+            startup.load_ms, startup.bbox_ms, startup.build_ms,
+            (device_done_time - start_device_time) * 1e3, program_ms, (device_done_time - start_device_time) * 1e3 - program_ms,
+            (ready_time - program_start_time) * 1e3,
+            (startup.done_time > device_done_time) ? "device" : "data pipeline",
+            fabs(startup.done_time - device_done_time) * 1e3);
+
+    if (restarts > 1) {
+        run_multistart(restarts);
+        cleanup();
+        return 0;
+    }
 
-    // Read value of ARM TTBR0 system register to get the entry point of the Linux page table
-    ttbr0_value = get_ttbr0();
-    init_svm();
+    if (bounds_bench) {
+        run_bounds_bench();
+        cleanup();
+        return 0;
+    }
 
-    // Run the kernel.
-    run();
+    cl_runtime.init(context, reuse_resources);
+
+    if (scaling_report) {
+        run_scaling(instances);
+        cleanup();
+        return 0;
+    }
+
+    // Run the kernel (repeated runs reuse the pooled buffers and argument bindings).
+    for (uint r=0; r<runs; r++) {
+        if (runs > 1) {
+            printf("\nRun %u of %u\n", r+1, runs);
+        }
+        run();
+    }
 
     // Free the resources allocated
     cleanup();
@@ -125,6 +595,65 @@ int main(int argc, char **argv) {
 /////// HELPER FUNCTIONS ///////
 
 
+// Read the dataset and the initial centres, compute the bounding box and build
+// the kd-tree (once, it is reused by all iterations). Runs concurrently with
+// init_opencl() and the SVM setup; touches no OpenCL state.
+void prepare_data(startup_t *startup) {
+
+    const uint n = N;
+    const uint k = K;
+    const double std_dev = S;
+
+    const double start_time = getCurrentTimestamp();
+    startup->ok = false;
+    startup->load_ms = 0.0;
+    startup->bbox_ms = 0.0;
+    startup->build_ms = 0.0;
+
+    if (!read_data_points(n, k, std_dev, data_points,index_arr)) {
+        printf("Reading data points failed\n");
+        startup->done_time = getCurrentTimestamp();
+        return;
+    }
+
+    for (uint r=0; r<restarts; r++) {
+        if (!read_initial_centres(n, k, std_dev, cntr_idx + r*k, r+1)) {
+            printf("Reading initial centers (set %u) failed\n", r+1);
+            startup->done_time = getCurrentTimestamp();
+            return;
+        }
+    }
+
+    const double load_time = getCurrentTimestamp();
+
+    // -degenerate: a chain over the first points instead of the balanced tree
+    const uint n_tree = ((degenerate_points > 0) && (degenerate_points < N)) ? degenerate_points : N;
+
+    data_type bnd_lo, bnd_hi;   
+    //compute axis-aligned hyper rectangle enclosing all data points
+    compute_bounding_box(data_points, index_arr, n_tree, &bnd_lo, &bnd_hi);
+
+    const double bbox_time = getCurrentTimestamp();
+
+    // build up data structure
+    if (degenerate_points > 0) {
+        root = buildkdTree_chain(data_points,index_arr,n_tree, &bnd_lo, &bnd_hi);
+        printf("Degenerate kd-tree: %u points, depth %u\n", n_tree, n_tree-1);
+    } else {
+        root = buildkdTree(data_points,index_arr,N, &bnd_lo, &bnd_hi);
+    }
+
+    startup->done_time = getCurrentTimestamp();
+    trace.span("data load", TRACE_DATA, start_time, load_time);
+    trace.span("bounding box", TRACE_DATA, load_time, bbox_time);
+    trace.span("tree build", TRACE_DATA, bbox_time, startup->done_time);
+    startup->load_ms = (load_time - start_time) * 1e3;
+    startup->bbox_ms = (bbox_time - load_time) * 1e3;
+    startup->build_ms = (startup->done_time - bbox_time) * 1e3;
+    startup->ok = true;
+}
+
+
 
 // Initializes the OpenCL objects.
 bool init_opencl() {
@@ -143,26 +672,23 @@ bool init_opencl() {
         return false;
     }
 
-    unsigned num_devices = 0;
-    scoped_array<cl_device_id> devices;
-
     devices.reset(getDevices(platform, CL_DEVICE_TYPE_ALL, &num_devices));
 
-    // We'll just use the first device.
+    // Device 0 runs the single-device paths, all devices the multi-instance traversal.
     printf("Platform: %s, %d device(s) available\n", getPlatformName(platform).c_str(),num_devices);
     printf("Using device 0: %s\n", getDeviceName(devices[0]).c_str());
     device = devices[0];
 
 
     // Create the context.
-    context = clCreateContext(NULL, 1, &device, &oclContextCallback, NULL, &status);
+    context = clCreateContext(NULL, num_devices, devices, &oclContextCallback, NULL, &status);
     checkError(status, "Failed to create context");
 
     // Create the program for all device. Use the first device as the
     // representative device (assuming all device are of the same type).
     std::string binary_file = getBoardBinaryFile("filter_stream_opt1", device);
     printf("Using AOCX: %s\n", binary_file.c_str());
-    program = createProgramFromBinary(context, binary_file.c_str(), &device, 1);
+    program = createProgramFromBinary(context, binary_file.c_str(), devices, num_devices);
 
     // Build the program that was just created.
     status = clBuildProgram(program, 0, NULL, "", NULL, NULL);
@@ -176,6 +702,9 @@ bool init_opencl() {
     queue1 = clCreateCommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE, &status);
     checkError(status, "Failed to create command queue");
 
+    queue2 = clCreateCommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE, &status);
+    checkError(status, "Failed to create command queue");
+
     // Kernels
     const char *kernel0_name = "filter0";
     kernel0 = clCreateKernel(program, kernel0_name, &status);
@@ -191,198 +720,1706 @@ bool init_opencl() {
 }
 
 
-void run() {
+void run(job_result_t *result) {
 
-    const uint k = K;
+    const uint k = k_centres;
 
     cl_int status;
 
     printf("Launching device\n");
 
-    const double start_datasetup_time = getCurrentTimestamp();
-
-    data_type bnd_lo, bnd_hi;   
-    //compute axis-aligned hyper rectangle enclosing all data points
-    compute_bounding_box(data_points, index_arr, N, &bnd_lo, &bnd_hi);
-    
-    // build up data structure
-    root = buildkdTree(data_points,index_arr,N, &bnd_lo, &bnd_hi);
-
-    cl_event kernel0_event;
-    cl_event kernel1_event;
-    cl_event finish_event;    
+    cl_runtime.reset_counts();
+
+    // host buffers (pinned staging, reused across runs)
+    bool profiling_fresh;
+    initial_centers = (cl_int4*) cl_runtime.staging(K*sizeof(cl_int4), "initial_centers");
+    visited_nodes   = (cl_uint*) cl_runtime.staging(1*sizeof(cl_uint), "visited_nodes");
+    profiling_data  = (cl_uint16*) cl_runtime.staging(LSU_PROFILE_RECORDS*sizeof(cl_uint16), "profiling_data", &profiling_fresh);
+    new_centers     = (cl_int4*) cl_runtime.staging(K*sizeof(cl_int4), "new_centers");
+    distortion      = (cl_uint*) cl_runtime.staging(K*sizeof(cl_uint), "distortion");
+    roots_list      = (cl_uint*) cl_runtime.staging(HYBRID_MAX_ROOTS*sizeof(cl_uint), "roots_list");
+    partial_sums    = (cl_int4*) cl_runtime.staging(K*sizeof(cl_int4), "partial_sums");
+    stack_info      = (cl_uint*) cl_runtime.staging(STACK_INFO_WORDS*sizeof(cl_uint), "stack_info");
+
+    // second set of result copies for the double-buffered iterations
+    slots[0].visited_nodes  = visited_nodes;
+    slots[0].profiling_data = profiling_data;
+    slots[0].new_centers    = new_centers;
+    slots[0].distortion     = distortion;
+    slots[0].partial_sums   = partial_sums;
+    slots[1].visited_nodes  = (cl_uint*) cl_runtime.staging(1*sizeof(cl_uint), "visited_nodes_b");
+    slots[1].profiling_data = (cl_uint16*) cl_runtime.staging(LSU_PROFILE_RECORDS*sizeof(cl_uint16), "profiling_data_b");
+    slots[1].new_centers    = (cl_int4*) cl_runtime.staging(K*sizeof(cl_int4), "new_centers_b");
+    slots[1].distortion     = (cl_uint*) cl_runtime.staging(K*sizeof(cl_uint), "distortion_b");
+    slots[1].partial_sums   = (cl_int4*) cl_runtime.staging(K*sizeof(cl_int4), "partial_sums_b");
+    for (uint s=0; s<2; s++) {
+        slots[s].pending = false;
+    }
 
     // sample initial centers from data points 
-    posix_memalign ((void**)(&initial_centers), 64, K*sizeof(cl_int4));
     for (uint i=0; i<k; i++) {
         initial_centers[i] = data_type_2_vector(data_points[cntr_idx[i]]);
     }    
 
-    posix_memalign ((void**)(&visited_nodes), 64, 1*sizeof(cl_uint));
-    posix_memalign ((void**)(&profiling_data), 64, 1*sizeof(cl_uint16));
+    const double start_buffer_time = getCurrentTimestamp();
+
+    if (!software_device && !host_only) {
+        bool roots_fresh;
+
+        // Input buffers. The two centre buffers swap roles between iterations
+        // (filter1 writes the input of the next filter0 pass), hence read-write.
+        initial_centers_buf = cl_runtime.buffer(CL_MEM_READ_WRITE, K*sizeof(cl_int4), "initial_centers");
+        roots_buf           = cl_runtime.buffer(CL_MEM_READ_ONLY, HYBRID_MAX_ROOTS*sizeof(cl_uint), "roots", &roots_fresh);
+
+        // Output buffers (dummy).
+        z0_buf              = cl_runtime.buffer(CL_MEM_WRITE_ONLY, 1*sizeof(int), "z0");
+
+        // Output buffers (real). filter0 reads profiling_data_buf back as the
+        // baseline of its counter deltas (LSU_PROFILE_DELTAS).
+        visited_nodes_buf   = cl_runtime.buffer(CL_MEM_WRITE_ONLY, 1*sizeof(cl_uint), "visited_nodes");
+        profiling_data_buf  = cl_runtime.buffer(CL_MEM_READ_WRITE, LSU_PROFILE_RECORDS*sizeof(cl_uint16), "profiling_data", &profiling_fresh);
+        new_centers_buf     = cl_runtime.buffer(CL_MEM_READ_WRITE, K*sizeof(cl_int4), "new_centers");
+        distortion_buf      = cl_runtime.buffer(CL_MEM_WRITE_ONLY, K*sizeof(cl_uint), "distortion");
+        distortion_b_buf    = cl_runtime.buffer(CL_MEM_WRITE_ONLY, K*sizeof(cl_uint), "distortion_b");
+        partial_sums_buf    = cl_runtime.buffer(CL_MEM_WRITE_ONLY, K*sizeof(cl_int4), "partial_sums");
+        partial_sums_b_buf  = cl_runtime.buffer(CL_MEM_WRITE_ONLY, K*sizeof(cl_int4), "partial_sums_b");
+
+        // filter0 accumulates its stack statistics over all passes of the run
+        stack_info_buf      = cl_runtime.buffer(CL_MEM_READ_WRITE, STACK_INFO_WORDS*sizeof(cl_uint), "stack_info");
+        memset(stack_info, 0, STACK_INFO_WORDS*sizeof(cl_uint));
+        status = cl_runtime.write(queue0, stack_info_buf, CL_TRUE, 0, STACK_INFO_WORDS*sizeof(cl_uint), stack_info, 0, NULL, NULL);
+        checkError(status, "Failed to transfer input");
+
+        if (spill_stack == NULL) {
+            spill_stack = alloc_spill_region((size_t)spill_records * 2*sizeof(cl_uint), "stack spill region");
+            set_spill = alloc_spill_region((size_t)set_spill_slots * CENTER_SET_SLOT_BYTES, "centre-set spill region");
+        }
+        const cl_uint spill_address = (cl_uint)spill_stack;
+        const cl_uint set_spill_address = (cl_uint)set_spill;
+
+        // the counters carry over from the previous run unless the buffer is new
+        if (profiling_fresh) {
+            memset(profiling_data, 0, LSU_PROFILE_RECORDS*sizeof(cl_uint16));
+            memset(&lsu_snapshot, 0, sizeof(cl_uint16));
+            status = cl_runtime.write(queue0, profiling_data_buf, CL_TRUE, 0, LSU_PROFILE_RECORDS*sizeof(cl_uint16), profiling_data, 0, NULL, NULL);
+            checkError(status, "Failed to transfer input");
+        }
 
-    posix_memalign ((void**)(&new_centers), 64, K*sizeof(cl_int4));
-    posix_memalign ((void**)(&distortion), 64, K*sizeof(cl_uint));
+        // Without the hybrid split, the device processes the whole tree (a single
+        // subtree root), which is written once.
+        const cl_uint n_roots = 1;
+        if (roots_fresh || (roots_buf_root != (cl_uint)root)) {
+            roots_list[0] = (cl_uint)root;
+            status = cl_runtime.write(queue0, roots_buf, CL_TRUE, 0, sizeof(cl_uint), roots_list, 0, NULL, NULL);
+            checkError(status, "Failed to transfer input");
+            roots_buf_root = (cl_uint)root;
+        }
 
-    
+        // Set kernel arguments. None of them change between iterations, only the
+        // contents of initial_centers_buf do (and n_roots in hybrid mode). Bindings
+        // that are unchanged since the previous run are not set again.
+        unsigned argi;
+
+
+        // kernel 0
+        argi = 0;
+        cl_runtime.set_arg(kernel0, argi++, sizeof(cl_mem), &z0_buf);
+        cl_runtime.set_arg(kernel0, argi++, sizeof(cl_mem), &roots_buf);
+        cl_runtime.set_arg(kernel0, argi++, sizeof(cl_uint), &n_roots);
+        cl_runtime.set_arg(kernel0, argi++, sizeof(cl_uint), &ttbr0_value);
+        cl_runtime.set_arg(kernel0, argi++, sizeof(cl_uint), &k);
+        cl_runtime.set_arg(kernel0, argi++, sizeof(cl_mem), &initial_centers_buf);
+        cl_runtime.set_arg(kernel0, argi++, sizeof(cl_mem), &visited_nodes_buf);
+        cl_runtime.set_arg(kernel0, argi++, sizeof(cl_mem), &profiling_data_buf);
+        cl_runtime.set_arg(kernel0, argi++, sizeof(cl_uint), &spill_address);
+        cl_runtime.set_arg(kernel0, argi++, sizeof(cl_uint), &spill_records);
+        cl_runtime.set_arg(kernel0, argi++, sizeof(cl_mem), &stack_info_buf);
+        cl_runtime.set_arg(kernel0, argi++, sizeof(cl_uint), &set_spill_address);
+        cl_runtime.set_arg(kernel0, argi++, sizeof(cl_uint), &set_spill_slots);
+        cl_runtime.set_arg(kernel0, argi++, sizeof(cl_uint), &label_pass);  // set per pass by enqueue_iteration
+        cl_runtime.set_arg(kernel0, argi++, sizeof(cl_uint), &batch_work);
+
+        // kernel 1
+        argi = 0;
+        cl_runtime.set_arg(kernel1, argi++, sizeof(cl_uint), &k);
+        cl_runtime.set_arg(kernel1, argi++, sizeof(cl_mem), &new_centers_buf);
+        cl_runtime.set_arg(kernel1, argi++, sizeof(cl_mem), &distortion_buf);
+        cl_runtime.set_arg(kernel1, argi++, sizeof(cl_mem), &partial_sums_buf);
+
+        slots[0].centres_buf    = initial_centers_buf;
+        slots[0].distortion_buf = distortion_buf;
+        slots[0].partial_sums_buf = partial_sums_buf;
+        slots[1].centres_buf    = new_centers_buf;
+        slots[1].distortion_buf = distortion_b_buf;
+        slots[1].partial_sums_buf = partial_sums_b_buf;
+    }
 
-    // Input buffers.
-    initial_centers_buf= clCreateBuffer(context, CL_MEM_READ_ONLY /*| CL_MEM_USE_HOST_PTR*/, K*sizeof(cl_int4), NULL, &status);
-    checkError(status, "Failed to create buffer for input");
+    trace.span("buffer setup", TRACE_HOST, start_buffer_time, getCurrentTimestamp());
 
-    // Output buffers (dummy).
-    z0_buf = clCreateBuffer(context, CL_MEM_WRITE_ONLY /*| CL_MEM_USE_HOST_PTR*/, 1 * sizeof(int), NULL, &status);
-    checkError(status, "Failed to create buffer for output");
+    const double start_kernel_time = getCurrentTimestamp();
 
-    // Output buffers (real).
-    visited_nodes_buf = clCreateBuffer(context, CL_MEM_WRITE_ONLY /*| CL_MEM_USE_HOST_PTR*/, 1 * sizeof(cl_uint), NULL, &status);
-    checkError(status, "Failed to create buffer for output");
+    // host engine: reference for -verify and host side of the hybrid traversal
+    filter_cpu cpu_engine(cpu_threads, cpu_simd, cpu_bitmap);
+
+    // multi-instance traversal: the subtrees partitioned over several devices (or host engine instances)
+    std::vector<hybrid_device*> device_instances;
+    multi_scheduler *multi = NULL;
+
+    // hybrid traversal: split the tree between host threads and the device (or its software stand-in)
+    hybrid_device *hybrid_dev = NULL;
+    hybrid_scheduler *scheduler = NULL;
+    std::vector<const kdTree_t*> verify_roots(1, root);
+    if (instances > 1) {
+        device_instances = create_instances(instances);
+        multi = new multi_scheduler(root, multi_depth(instances), device_instances, balance_cost);
+        verify_roots = multi->roots();
+        printf("Multi-instance traversal: %u subtrees (depth %u) over %u %s instances, balanced by %s\n",
+                multi->subtrees(), multi_depth(instances), instances, device_instances[0]->name(),
+                balance_cost ? "measured cost" : "point count");
+    } else if ((hybrid_depth > 0) || software_device) {
+        device_instances = create_instances(1);
+        hybrid_dev = device_instances[0];
+        scheduler = new hybrid_scheduler(root, hybrid_depth, hybrid_dev, cpu_engine, host_share);
+        verify_roots = scheduler->roots();
+        printf("Hybrid traversal: %u subtrees (depth %u), device: %s, initial host share: %.2f\n",
+                scheduler->subtrees(), hybrid_depth, hybrid_dev->name(), host_share);
+    }
 
-    profiling_data_buf = clCreateBuffer(context, CL_MEM_WRITE_ONLY /*| CL_MEM_USE_HOST_PTR*/, 1 * sizeof(cl_uint16), NULL, &status);
-    checkError(status, "Failed to create buffer for output");
+    // incremental passes: the host engine alone, its dead ends tagged with label_pass
+    incremental_filter *incremental = NULL;
+    if (incremental_passes && (scheduler == NULL) && (multi == NULL)) {
+        incremental = new incremental_filter(cpu_engine, root, &label_pass, incremental_min_reuse);
+        printf("Incremental host passes (%u threads, %s, %s sets)\n", cpu_engine.threads(), cpu_engine.isa(), cpu_engine.sets());
+    }
 
-    new_centers_buf = clCreateBuffer(context, CL_MEM_WRITE_ONLY /*| CL_MEM_USE_HOST_PTR*/, K * sizeof(cl_int4), NULL, &status);
-    checkError(status, "Failed to create buffer for output");
+    // Lloyd iterations; the distortion of each pass is taken from its per-centre
+    // sums and the squared norms of all points (pass_distortion)
+    const cl_ulong sum_sq = points_sum_sq(root);
+    iteration_stats_t total = {0.0, 0.0, 0.0, 0.0, 0.0, 0};
+    total.lsu.clear();
+    uint gaps = 0;
+    cl_ulong prev_total_distortion = 0;
+    bool converged = false;
+    uint iteration;
+
+    // input centres of the last pass that ran, which the node owners refer to (-labels)
+    std::vector<cl_int4> label_centres(initial_centers, initial_centers + k);
+
+    // the hybrid and multi-instance passes merge partial results before the next one can start,
+    // an incremental pass needs the centres of the previous one
+    const bool overlap = overlap_iterations && (scheduler == NULL) && (multi == NULL) && (incremental == NULL);
+    last_filter1_end = 0;
+    iteration_mark = getCurrentTimestamp();
+
+    if (first_kernel_time == 0.0) {
+        first_kernel_time = getCurrentTimestamp();
+    }
+    if (overlap && (max_iterations > 0)) {
+        enqueue_iteration(0, true);
+    }
 
-    distortion_buf = clCreateBuffer(context, CL_MEM_WRITE_ONLY /*| CL_MEM_USE_HOST_PTR*/, K * sizeof(cl_uint), NULL, &status);
-    checkError(status, "Failed to create buffer for output");   
+    for (iteration=0; (iteration<max_iterations) && !converged; iteration++) {
+
+        iteration_stats_t stats;
+        if (scheduler != NULL) {
+            run_hybrid_iteration(scheduler, &stats);
+        } else if (multi != NULL) {
+            run_multi_iteration(multi, &stats);
+        } else if (incremental != NULL) {
+            run_incremental_iteration(incremental, &stats);
+        } else if (overlap) {
+            // the next pass starts on the device as soon as filter1 of this one
+            // is done; its results are checked below while it runs
+            const uint s = iteration % 2;
+            if (iteration+1 < max_iterations) {
+                enqueue_iteration(s^1, false);
+            }
+            finish_iteration(s, &stats);
+        } else {
+            enqueue_iteration(0, true);
+            finish_iteration(0, &stats);
+        }
 
+        // compare against the host reference (not part of the timed iteration)
+        if (verify_cpu) {
+            const double start_verify_time = getCurrentTimestamp();
+            verify_iteration(cpu_engine, verify_roots);
+            trace.span("verify", TRACE_HOST_ENGINE, start_verify_time, getCurrentTimestamp());
+        }
 
-    const double start_buffer_time = getCurrentTimestamp();    
+        // convergence check (host overhead, included in the per-iteration time)
+        const double start_check_time = getCurrentTimestamp();
 
-    cl_event write_event[1];
+        const cl_ulong total_distortion = pass_distortion(initial_centers, partial_sums, k, sum_sq);
 
-    status = clEnqueueWriteBuffer(queue0, initial_centers_buf, CL_FALSE, 0, K*sizeof(cl_int4), initial_centers, 0, NULL, &write_event[0]);
-    checkError(status, "Failed to transfer input A");
+        coord_type max_shift;
+        converged = check_convergence(initial_centers, new_centers, total_distortion, prev_total_distortion, (iteration > 0), &max_shift);
+        prev_total_distortion = total_distortion;
 
-    // Set kernel arguments.
-    unsigned argi;
+        // the new centres are the input of the next iteration
+        for (uint i=0; i<k; i++) {
+            label_centres[i] = initial_centers[i];
+            initial_centers[i] = new_centers[i];
+        }
 
+        const double end_check_time = getCurrentTimestamp();
+        trace.span("convergence check", TRACE_HOST, start_check_time, end_check_time);
+        stats.check_ms = (end_check_time - start_check_time) * 1e3;
+        stats.iteration_ms += stats.check_ms;
+        iteration_mark = end_check_time;
 
-    // kernel 0
-    argi = 0;
- 
-    status = clSetKernelArg(kernel0, argi++, sizeof(cl_mem), &z0_buf);
-    checkError(status, "Failed to set argument %d", argi - 1);
+        char gap[32] = "";
+        if (stats.gap_ms >= 0.0) {
+            snprintf(gap, sizeof(gap), ", gap: %7.3f ms", stats.gap_ms);
+        }
+        printf("iteration %3u: visited nodes: %8u, distortion: %12llu, max centre shift: %8d, kernel: %8.3f ms, host overhead: %7.3f ms (enqueue %.3f, readback %.3f, check %.3f)%s\n",
+                iteration, visited_nodes[0], (unsigned long long)total_distortion, max_shift,
+                stats.kernel_ms, stats.iteration_ms - stats.kernel_ms, stats.enqueue_ms, stats.readback_ms, stats.check_ms, gap);
+
+        const lsu_metrics_t lsu_m = lsu_metrics(stats.lsu, stats.device_nodes);
+        trace_lsu_counters(end_check_time, lsu_m);
+        if (!profile_file.empty()) {
+            lsu_log_t::phases_t phases;
+            phases.push_back(std::make_pair(std::string("enqueue_ms"), stats.enqueue_ms));
+            phases.push_back(std::make_pair(std::string("kernel_ms"), stats.kernel_ms));
+            phases.push_back(std::make_pair(std::string("readback_ms"), stats.readback_ms));
+            phases.push_back(std::make_pair(std::string("check_ms"), stats.check_ms));
+            phases.push_back(std::make_pair(std::string("iteration_ms"), stats.iteration_ms));
+            phases.push_back(std::make_pair(std::string("gap_ms"), stats.gap_ms));
+            lsu_log.add(iteration, phases, lsu_m);
+        }
 
-    status = clSetKernelArg(kernel0, argi++, sizeof(cl_uint), (void*)&root);
-    checkError(status, "Failed to set argument %d", argi - 1);
+        total.enqueue_ms    += stats.enqueue_ms;
+        total.kernel_ms     += stats.kernel_ms;
+        total.readback_ms   += stats.readback_ms;
+        total.check_ms      += stats.check_ms;
+        total.iteration_ms  += stats.iteration_ms;
+        total.device_nodes  += stats.device_nodes;
+        total.lsu.add(stats.lsu);
+        if (stats.gap_ms >= 0.0) {
+            total.gap_ms += stats.gap_ms;
+            gaps++;
+        }
+    }
 
-    status = clSetKernelArg(kernel0, argi++, sizeof(cl_uint), (void*)&ttbr0_value);
-    checkError(status, "Failed to set argument %d", argi - 1);
+    // a pass enqueued behind the one that converged (or hit the cap) is not needed
+    uint discarded = 0;
+    for (uint s=0; s<2; s++) {
+        if (slots[s].pending) {
+            discard_iteration(s);
+            discarded++;
+        }
+    }
+    if (discarded > 0) {
+        // it still ran to the end, from the final centres
+        label_centres.assign(initial_centers, initial_centers + k);
+    }
 
-    status = clSetKernelArg(kernel0, argi++, sizeof(cl_uint), (void*)&k);
-    checkError(status, "Failed to set argument %d", argi - 1);
+    const double end_time = getCurrentTimestamp();
 
-    status = clSetKernelArg(kernel0, argi++, sizeof(cl_mem), &initial_centers_buf);
-    checkError(status, "Failed to set argument %d", argi - 1);
+    // spill statistics of the single-device passes (the instances report an overflow themselves)
+    bool stack_ok = true;
+    if (!software_device && !host_only) {
+        status = cl_runtime.read(queue0, stack_info_buf, CL_TRUE, 0, STACK_INFO_WORDS*sizeof(cl_uint), stack_info, 0, NULL, NULL);
+        checkError(status, "Failed to transfer output");
+        if ((scheduler == NULL) && (multi == NULL) && (incremental == NULL)) {
+            stack_ok = report_stack_info("all passes", stack_info);
+        }
+    }
 
-    status = clSetKernelArg(kernel0, argi++, sizeof(cl_mem), &visited_nodes_buf);
-    checkError(status, "Failed to set argument %d", argi - 1);
-    
-    status = clSetKernelArg(kernel0, argi++, sizeof(cl_mem), &profiling_data_buf);
-    checkError(status, "Failed to set argument %d", argi - 1);
-    
+    // per-point labels, resolved from the dead ends of the last pass (the
+    // hybrid, multi-instance and incremental passes do not write them)
+    if (write_labels) {
+        if (software_device || (scheduler != NULL) || (multi != NULL) || (incremental != NULL) || (label_pass == 0)) {
+            printf("labels: not available (-labels needs single-device passes)\n");
+        } else {
+            const double start_label_time = getCurrentTimestamp();
+            std::vector<uint> labels;
+            uint dead_ends;
+            const uint labelled = resolve_labels(root, label_pass, labels, &dead_ends);
+            const double label_ms = (getCurrentTimestamp() - start_label_time) * 1e3;
+            printf("labels (pass %u): %u of %u point(s) from %u dead end(s), resolved in %0.3f ms\n",
+                    label_pass, labelled, root->count, dead_ends, label_ms);
+            if (verify_cpu) {
+                printf("labels: %u point(s) not assigned to their closest centre\n", verify_labels(labels, label_centres.data(), k));
+            }
+        }
+    }
 
+    // filter0's batch schedule from the same centres, per work target and record
+    // limit (the kernel's BATCH_SIZE and larger builds)
+    if (batch_model) {
+        data_type centres[K];
+        for (uint i=0; i<k; i++) {
+            centres[i] = vector_2_data_type(label_centres[i]);
+        }
+        const uint targets[] = {0, 256, 512, 1024, 2048, 4096};
+        for (uint r=FILTER0_BATCH_SIZE; r<=4*FILTER0_BATCH_SIZE; r*=2) {
+            for (uint t=0; t<sizeof(targets)/sizeof(targets[0]); t++) {
+                char label[64];
+                sprintf(label, "cpu model, %u records, work %u", r, targets[t]);
+                batch_print(label, batch_replay(pointer_tree_t<kdTree_t>(), (const kdTree_t*)root, centres, k, r, targets[t]), batch_overhead);
+            }
+        }
+    }
 
-    // kernel 1
-    argi = 0;
+    // replicated engines from the same centres: peer stealing and a shared queue of
+    // subtree roots (cut as for the multi-instance traversal), against one filter0.
+    // The host engine schedules its threads like the stealing engines.
+    if (model_engines > 0) {
+        data_type centres[K];
+        for (uint i=0; i<k; i++) {
+            centres[i] = vector_2_data_type(label_centres[i]);
+        }
+        const engine_model_stats_t single = engine_replay(root, centres, k, 1, ENGINE_STEAL, 0, steal_latency, 1,
+                                                          FILTER0_BATCH_SIZE, batch_work, batch_overhead);
+        double single_ms = 0.0;
+        for (uint n=1; n<=model_engines; n*=2) {
+            char label[64];
+            engine_print("steal", n, engine_replay(root, centres, k, n, ENGINE_STEAL, 0, steal_latency, model_accumulators,
+                                                   FILTER0_BATCH_SIZE, batch_work, batch_overhead), single.cycles);
+            sprintf(label, "queue, depth %u", multi_depth(n));
+            engine_print(label, n, engine_replay(root, centres, k, n, ENGINE_QUEUE, multi_depth(n), steal_latency, model_accumulators,
+                                                 FILTER0_BATCH_SIZE, batch_work, batch_overhead), single.cycles);
+
+            filter_cpu engine(n, cpu_simd, cpu_bitmap);
+            centroid_t centroids[K];
+            filter_cpu_stats_t engine_stats;
+            pointer_tree_t<kdTree_t> tree;
+            engine.run(tree, (const kdTree_t*)root, centres, k, centroids, &engine_stats);
+            single_ms = (n == 1) ? engine_stats.time_ms : single_ms;
+            printf("host engine (%u thread(s)): %0.3f ms, speed-up %.2f, balance %.1f%% (speed-up %.2f by work), %llu steal(s)\n",
+                    n, engine_stats.time_ms, (engine_stats.time_ms > 0.0) ? single_ms / engine_stats.time_ms : 0.0,
+                    (double)engine_stats.distance_evals * 100.0 / ((double)engine_stats.max_thread_evals * (double)n),
+                    (double)engine_stats.distance_evals / (double)engine_stats.max_thread_evals,
+                    (unsigned long long)engine_stats.steals);
+        }
+    }
 
-    status = clSetKernelArg(kernel1, argi++, sizeof(cl_uint), (void*)&k);
-    checkError(status, "Failed to set argument %d", argi - 1);
+    if (scheduler != NULL) {
+        delete scheduler;
+    }
+    if (multi != NULL) {
+        delete multi;
+    }
+    if (incremental != NULL) {
+        delete incremental;
+    }
+    release_instances(device_instances);
 
-    status = clSetKernelArg(kernel1, argi++, sizeof(cl_mem), &new_centers_buf);
-    checkError(status, "Failed to set argument %d", argi - 1);
+    printf("\n%s after %u iteration(s)%s\n", converged ? "Converged" : "Stopped at iteration cap", iteration,
+            stack_ok ? "" : " (INCOMPLETE: filter0 stack overflow)");
+   
+    printf("new centers:\n");
+    for (uint i=0; i<k; i++) {
+        data_type c = vector_2_data_type(initial_centers[i]);        
+        printf("%3u: ", i); 
+        for (uint d=0; d<D; d++) {
+            printf("%8d ", c.value[d]);
+        }
+        printf(" (distortion: %12u)\n",distortion[i]);
+    }
+    printf("total distortion: %llu\n", (unsigned long long)prev_total_distortion);
 
-    status = clSetKernelArg(kernel1, argi++, sizeof(cl_mem), &distortion_buf);
-    checkError(status, "Failed to set argument %d", argi - 1);
+    // Wall-clock time taken.
+    printf("\nProgram start to end: %0.3f ms\n", (end_time - program_start_time) * 1e3);
+    printf("Time to first kernel: %0.3f ms\n", (first_kernel_time - program_start_time) * 1e3);
+    printf("Buffer setup to end: %0.3f ms\n", (end_time - start_buffer_time) * 1e3);
+    printf("Kernel enqueue to end: %0.3f ms\n", (end_time - start_kernel_time) * 1e3);
 
-    const double start_kernel_time = getCurrentTimestamp();
+    // Per-iteration breakdown: device time vs. host overhead
+    const double n_iter = (iteration > 0) ? (double)iteration : 1.0;
+    printf("Kernel time: %0.3f ms total, %0.3f ms per iteration\n", total.kernel_ms, total.kernel_ms / n_iter);
+    printf("Host overhead: %0.3f ms total, %0.3f ms per iteration (enqueue %0.3f, readback %0.3f, check %0.3f)\n",
+            total.iteration_ms - total.kernel_ms, (total.iteration_ms - total.kernel_ms) / n_iter,
+            total.enqueue_ms / n_iter, total.readback_ms / n_iter, total.check_ms / n_iter);
+    if (gaps > 0) {
+        printf("Gap between kernels (filter1 end to next filter0 start): %0.3f ms per iteration, iterations %s%s\n",
+                total.gap_ms / (double)gaps, overlap ? "overlapped" : "one at a time",
+                (discarded > 0) ? ", 1 speculative pass discarded" : "");
+    }
+
+    // Print profiling information (all iterations)
+    printf("LSU counters (%s, %u iteration(s)):\n", (software_device || host_only) ? "software model" : "device", iteration);
+    lsu_print(lsu_metrics(total.lsu, total.device_nodes));
+
+    if (!profile_file.empty()) {
+        lsu_log.write(profile_file.c_str());
+    }
+
+    if (result != NULL) {
+        result->converged = converged;
+        result->iterations = iteration;
+        result->kernel_ms = total.kernel_ms;
+        result->total_distortion = prev_total_distortion;
+        result->centres.assign(initial_centers, initial_centers + k);
+        result->distortion.assign(distortion, distortion + k);
+    }
+
+    // return buffers to the pools for the next run
+    if (!software_device && !host_only) {
+        cl_mem bufs[11] = {initial_centers_buf, roots_buf, z0_buf, visited_nodes_buf, profiling_data_buf, new_centers_buf, distortion_buf, distortion_b_buf, partial_sums_buf, partial_sums_b_buf, stack_info_buf};
+        for (uint i=0; i<11; i++) {
+            cl_runtime.release(bufs[i]);
+        }
+    }
+    void *host_bufs[3] = {initial_centers, roots_list, stack_info};
+    for (uint i=0; i<3; i++) {
+        cl_runtime.release_staging(host_bufs[i]);
+    }
+    for (uint s=0; s<2; s++) {
+        cl_runtime.release_staging(slots[s].visited_nodes);
+        cl_runtime.release_staging(slots[s].profiling_data);
+        cl_runtime.release_staging(slots[s].new_centers);
+        cl_runtime.release_staging(slots[s].distortion);
+        cl_runtime.release_staging(slots[s].partial_sums);
+    }
+
+    cl_runtime.report(cl_runtime.reusing() ? "this run, reuse on" : "this run, reuse off");
+}
+
+
+// Enqueue a filtering pass with buffer set s (see iteration_slot_t). upload:
+// the centres come from initial_centers on the host. Otherwise they come from
+// filter1 of the pass enqueued with set s^1, and filter0 is chained to it by
+// events, so the host does not stand between the two passes. Results are read
+// back on queue2 into the host copies of set s.
+void enqueue_iteration(uint s, bool upload) {
+
+    cl_int status;
+
+    iteration_slot_t &slot = slots[s];
+    iteration_slot_t &prev = slots[s^1];
+
+    slot.start_time = getCurrentTimestamp();
+
+    cl_event wait_list[3];
+    cl_uint n_wait = 0;
+    if (upload) {
+        status = cl_runtime.write(queue0, slot.centres_buf, CL_FALSE, 0, k_centres*sizeof(cl_int4), initial_centers, 0, NULL, &slot.write_event);
+        checkError(status, "Failed to transfer input A");
+        trace.command("write centres", TRACE_QUEUE0, slot.write_event);
+        wait_list[n_wait++] = slot.write_event;
+    } else {
+        // new centres of the previous pass; its visited nodes and LSU counters
+        // must be read out before filter0 overwrites them
+        slot.write_event = NULL;
+        wait_list[n_wait++] = prev.kernel_event[1];
+        wait_list[n_wait++] = prev.read_event[0];
+        wait_list[n_wait++] = prev.read_event[1];
+    }
+
+    // arguments are captured at enqueue time, the previous pass keeps its own
+    cl_runtime.set_arg(kernel0, 5, sizeof(cl_mem), &slot.centres_buf);
+    cl_runtime.set_arg(kernel1, 1, sizeof(cl_mem), &prev.centres_buf);
+    cl_runtime.set_arg(kernel1, 2, sizeof(cl_mem), &slot.distortion_buf);
+    cl_runtime.set_arg(kernel1, 3, sizeof(cl_mem), &slot.partial_sums_buf);
+
+    // a fresh tag per pass, the nodes of earlier passes keep stale ones (-labels)
+    const cl_uint pass_tag = (write_labels) ? ++label_pass : 0;
+    cl_runtime.set_arg(kernel0, 13, sizeof(cl_uint), &pass_tag);
 
     // Enqueue kernels
 
-    status = clEnqueueTask(queue1, kernel1, 0, NULL, &kernel1_event);
+    status = cl_runtime.task(queue1, kernel1, 0, NULL, &slot.kernel_event[1]);
     checkError(status, "Failed to launch kernel 1");   
+    trace.command("filter1", TRACE_QUEUE1, slot.kernel_event[1]);
 
-    status = clEnqueueTask(queue0, kernel0, 1, write_event, &kernel0_event);
+    status = cl_runtime.task(queue0, kernel0, n_wait, wait_list, &slot.kernel_event[0]);
     checkError(status, "Failed to launch kernel");     
-    
-
-    const double start_readout_time = getCurrentTimestamp();
+    trace.command("filter0", TRACE_QUEUE0, slot.kernel_event[0]);
   
-    status = clEnqueueReadBuffer(queue0, visited_nodes_buf, CL_FALSE, 0, 1*sizeof(cl_uint), visited_nodes, 1, &kernel0_event, &finish_event);
+    status = cl_runtime.read(queue2, visited_nodes_buf, CL_FALSE, 0, 1*sizeof(cl_uint), slot.visited_nodes, 1, &slot.kernel_event[0], &slot.read_event[0]);
     checkError(status, "Failed to transfer output"); 
 
-    status = clEnqueueReadBuffer(queue0, profiling_data_buf, CL_FALSE, 0, 1*sizeof(cl_uint16), profiling_data, 1, &kernel0_event, &finish_event);
+    status = cl_runtime.read(queue2, profiling_data_buf, CL_FALSE, 0, LSU_PROFILE_RECORDS*sizeof(cl_uint16), slot.profiling_data, 1, &slot.kernel_event[0], &slot.read_event[1]);
     checkError(status, "Failed to transfer output"); 
 
-    status = clEnqueueReadBuffer(queue1, new_centers_buf, CL_FALSE, 0, K*sizeof(cl_int4), new_centers, 1, &kernel1_event, &finish_event);
+    status = cl_runtime.read(queue2, prev.centres_buf, CL_FALSE, 0, k_centres*sizeof(cl_int4), slot.new_centers, 1, &slot.kernel_event[1], &slot.read_event[2]);
     checkError(status, "Failed to transfer output"); 
 
-    status = clEnqueueReadBuffer(queue1, distortion_buf, CL_FALSE, 0, K*sizeof(cl_uint), distortion, 1, &kernel1_event, &finish_event);
+    status = cl_runtime.read(queue2, slot.distortion_buf, CL_FALSE, 0, k_centres*sizeof(cl_uint), slot.distortion, 1, &slot.kernel_event[1], &slot.read_event[3]);
     checkError(status, "Failed to transfer output");  
 
+    status = cl_runtime.read(queue2, slot.partial_sums_buf, CL_FALSE, 0, k_centres*sizeof(cl_int4), slot.partial_sums, 1, &slot.kernel_event[1], &slot.read_event[4]);
+    checkError(status, "Failed to transfer output");  
 
-    // Wait for all devices to finish.
-    clWaitForEvents(1, &finish_event);
-    clWaitForEvents(1, &kernel0_event);
-    clWaitForEvents(1, &kernel1_event);
+    trace.command("read visited nodes", TRACE_QUEUE2, slot.read_event[0]);
+    trace.command("read LSU counters", TRACE_QUEUE2, slot.read_event[1]);
+    trace.command("read new centres", TRACE_QUEUE2, slot.read_event[2]);
+    trace.command("read distortion", TRACE_QUEUE2, slot.read_event[3]);
+    trace.command("read partial sums", TRACE_QUEUE2, slot.read_event[4]);
+
+    // submit now, the host is about to block on an earlier pass
+    clFlush(queue0);
+    clFlush(queue1);
+    clFlush(queue2);
+
+    const double enqueue_time = getCurrentTimestamp();
+    trace.span("enqueue", TRACE_HOST, slot.start_time, enqueue_time);
+    slot.enqueue_ms = (enqueue_time - slot.start_time) * 1e3;
+    slot.pending = true;
+}
+
+
+// Wait for the pass enqueued with buffer set s and make its results current
+// (visited_nodes, profiling_data, new_centers, distortion, partial_sums).
+void finish_iteration(uint s, iteration_stats_t *stats) {
+
+    iteration_slot_t &slot = slots[s];
+
+    const double wait_time = getCurrentTimestamp();
+
+    // Wait for all transfers (and hence both kernels) to finish.
+    clWaitForEvents(5, slot.read_event);
 
-   
     const double end_time = getCurrentTimestamp();
+    trace.span("wait", TRACE_HOST, wait_time, end_time);
+
+    visited_nodes   = slot.visited_nodes;
+    profiling_data  = slot.profiling_data;
+    new_centers     = slot.new_centers;
+    distortion      = slot.distortion;
+    partial_sums    = slot.partial_sums;
+
+    // idle time of the device between the passes
+    cl_ulong filter0_start, filter1_end;
+    clGetEventProfilingInfo(slot.kernel_event[0], CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &filter0_start, NULL);
+    clGetEventProfilingInfo(slot.kernel_event[1], CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &filter1_end, NULL);
+    stats->gap_ms = (last_filter1_end > 0) ? ((double)filter0_start - (double)last_filter1_end) * 1e-6 : -1.0;
+    last_filter1_end = filter1_end;
+
+    // Get kernel and transfer times using the OpenCL event profiling API. An
+    // overlapped pass was enqueued during the previous iteration; its host time
+    // starts where the previous iteration ended.
+    stats->enqueue_ms   = slot.enqueue_ms;
+    stats->kernel_ms    = double(getStartEndTime(slot.kernel_event, 2)) * 1e-6;
+    stats->readback_ms  = double(getStartEndTime(slot.read_event, 5)) * 1e-6;
+    stats->check_ms     = 0.0;
+    stats->iteration_ms = (end_time - ((slot.start_time > iteration_mark) ? slot.start_time : iteration_mark)) * 1e3;
+    stats->device_nodes = visited_nodes[0];
+    stats->lsu          = device_lsu_profile();
 
-    printf("visited nodes: %d\n",visited_nodes[0]);
-   
-    printf("new centers:\n");
+    // Release all events.  
+    if (slot.write_event != NULL) {
+        clReleaseEvent(slot.write_event);
+    }
+    for (uint i=0; i<2; i++) {
+        clReleaseEvent(slot.kernel_event[i]);
+    }
+    for (uint i=0; i<5; i++) {
+        clReleaseEvent(slot.read_event[i]);
+    }
+    slot.pending = false;
+}
+
+
+// Wait for a pass that turned out not to be needed and drop its results. Its
+// LSU counters still advance the snapshot the next deltas are taken from.
+void discard_iteration(uint s) {
+
+    cl_uint *current_visited = visited_nodes;
+    cl_uint16 *current_profiling = profiling_data;
+    cl_int4 *current_new_centers = new_centers;
+    cl_uint *current_distortion = distortion;
+    cl_int4 *current_partial_sums = partial_sums;
+
+    iteration_stats_t stats;
+    finish_iteration(s, &stats);
+
+    visited_nodes   = current_visited;
+    profiling_data  = current_profiling;
+    new_centers     = current_new_centers;
+    distortion      = current_distortion;
+    partial_sums    = current_partial_sums;
+}
+
+
+// Run a single filtering pass split between host and device (hybrid.hpp) on
+// the current contents of initial_centers. The merged partial sums give
+// new_centers, distortion and partial_sums, as in finish_iteration().
+void run_hybrid_iteration(hybrid_scheduler *scheduler, iteration_stats_t *stats) {
+
+    const double start_time = getCurrentTimestamp();
+
+    data_type centres[K];
+    for (uint i=0; i<k_centres; i++) {
+        centres[i] = vector_2_data_type(initial_centers[i]);
+    }
+
+    centroid_t centroids[K];
+    hybrid_stats_t h;
+    scheduler->iterate(centres, k_centres, centroids, &h);
+    trace.span("hybrid pass", TRACE_HOST_ENGINE, start_time, getCurrentTimestamp());
+    filter_cpu::centroids_2_centres(centroids, k_centres, new_centers, distortion);
+    centroids_2_partial_sums(centroids, k_centres, partial_sums);
+    visited_nodes[0] = h.host_nodes + h.device_nodes;
+
+    const double end_time = getCurrentTimestamp();
+
+    printf("hybrid: host %3u subtrees, %8llu nodes, %8.3f ms | device %3u subtrees, %8llu nodes, %8.3f ms\n",
+            h.host_subtrees, (unsigned long long)h.host_nodes, h.host_ms,
+            h.device_subtrees, (unsigned long long)h.device_nodes, h.device_ms);
+
+    // "kernel" time is the parallel section of host and device
+    stats->enqueue_ms   = 0.0;
+    stats->kernel_ms    = h.wall_ms;
+    stats->readback_ms  = 0.0;
+    stats->check_ms     = 0.0;
+    stats->iteration_ms = (end_time - start_time) * 1e3;
+    stats->device_nodes = h.device_nodes;
+    stats->lsu          = h.device_lsu;
+    stats->gap_ms       = -1.0;
+}
+
+
+// Run a single incremental filtering pass on the host engine (incremental.hpp)
+// on the current contents of initial_centers, as in run_hybrid_iteration().
+// visited_nodes counts the node fetches of the subtrees it traversed.
+void run_incremental_iteration(incremental_filter *incremental, iteration_stats_t *stats) {
+
+    const double start_time = getCurrentTimestamp();
+
+    data_type centres[K];
+    for (uint i=0; i<k_centres; i++) {
+        centres[i] = vector_2_data_type(initial_centers[i]);
+    }
+
+    centroid_t centroids[K];
+    incremental_stats_t inc;
+    incremental->iterate(centres, k_centres, centroids, &inc);
+    trace.span("incremental pass", TRACE_HOST_ENGINE, start_time, getCurrentTimestamp());
+    filter_cpu::centroids_2_centres(centroids, k_centres, new_centers, distortion);
+    centroids_2_partial_sums(centroids, k_centres, partial_sums);
+    visited_nodes[0] = inc.visited_nodes;
+
+    const double end_time = getCurrentTimestamp();
+
+    printf("incremental: %8u of %8u dead ends reused (%u full margins), %8u subtrees traversed%s, %8llu nodes, %8u dead ends cached, %8.3f ms\n",
+            inc.reused, inc.cached, inc.full_margins, inc.roots, (inc.full_pass) ? " (full pass)" : "",
+            (unsigned long long)inc.visited_nodes, inc.dead_ends, inc.ms);
+
+    stats->enqueue_ms   = 0.0;
+    stats->kernel_ms    = inc.ms;
+    stats->readback_ms  = 0.0;
+    stats->check_ms     = 0.0;
+    stats->iteration_ms = (end_time - start_time) * 1e3;
+    stats->device_nodes = 0;
+    stats->lsu.clear();
+    stats->gap_ms       = -1.0;
+}
+
+
+// Queues and kernels on device index, buffers from the pool under per-instance
+// tags. The kernel arguments that do not change between passes are bound here.
+opencl_hybrid_device::opencl_hybrid_device(cl_uint index) : index(index), n_roots(0), k(0), stack_overflow(false) {
+
+    cl_int status;
+
+    for (uint i=0; i<2; i++) {
+        queue[i] = clCreateCommandQueue(context, devices[index], CL_QUEUE_PROFILING_ENABLE, &status);
+        checkError(status, "Failed to create command queue");
+    }
+    kernel[0] = clCreateKernel(program, "filter0", &status);
+    checkError(status, "Failed to create kernel");
+    kernel[1] = clCreateKernel(program, "filter1", &status);
+    checkError(status, "Failed to create kernel");
+
+    centres_buf         = cl_runtime.buffer(CL_MEM_READ_ONLY, K*sizeof(cl_int4), tag("centres").c_str());
+    roots_buf           = cl_runtime.buffer(CL_MEM_READ_ONLY, HYBRID_MAX_ROOTS*sizeof(cl_uint), tag("roots").c_str());
+    z0_buf              = cl_runtime.buffer(CL_MEM_WRITE_ONLY, 1*sizeof(int), tag("z0").c_str());
+    visited_nodes_buf   = cl_runtime.buffer(CL_MEM_WRITE_ONLY, 1*sizeof(cl_uint), tag("visited_nodes").c_str());
+    profiling_data_buf  = cl_runtime.buffer(CL_MEM_READ_WRITE, LSU_PROFILE_RECORDS*sizeof(cl_uint16), tag("profiling_data").c_str());
+    new_centers_buf     = cl_runtime.buffer(CL_MEM_WRITE_ONLY, K*sizeof(cl_int4), tag("new_centers").c_str());
+    distortion_buf      = cl_runtime.buffer(CL_MEM_WRITE_ONLY, K*sizeof(cl_uint), tag("distortion").c_str());
+    partial_sums_buf    = cl_runtime.buffer(CL_MEM_WRITE_ONLY, K*sizeof(cl_int4), tag("partial_sums").c_str());
+    stack_info_buf      = cl_runtime.buffer(CL_MEM_READ_WRITE, STACK_INFO_WORDS*sizeof(cl_uint), tag("stack_info").c_str());
+
+    centres         = (cl_int4*) cl_runtime.staging(K*sizeof(cl_int4), tag("centres").c_str());
+    roots_list      = (cl_uint*) cl_runtime.staging(HYBRID_MAX_ROOTS*sizeof(cl_uint), tag("roots").c_str());
+    visited_nodes   = (cl_uint*) cl_runtime.staging(1*sizeof(cl_uint), tag("visited_nodes").c_str());
+    profiling_data  = (cl_uint16*) cl_runtime.staging(LSU_PROFILE_RECORDS*sizeof(cl_uint16), tag("profiling_data").c_str());
+    partial_sums    = (cl_int4*) cl_runtime.staging(K*sizeof(cl_int4), tag("partial_sums").c_str());
+    distortion      = (cl_uint*) cl_runtime.staging(K*sizeof(cl_uint), tag("distortion").c_str());
+    stack_info      = (cl_uint*) cl_runtime.staging(STACK_INFO_WORDS*sizeof(cl_uint), tag("stack_info").c_str());
+
+    memset(profiling_data, 0, LSU_PROFILE_RECORDS*sizeof(cl_uint16));
+    memset(&lsu_snapshot, 0, sizeof(cl_uint16));
+    status = cl_runtime.write(queue[0], profiling_data_buf, CL_TRUE, 0, LSU_PROFILE_RECORDS*sizeof(cl_uint16), profiling_data, 0, NULL, NULL);
+    checkError(status, "Failed to transfer input");
+
+    memset(stack_info, 0, STACK_INFO_WORDS*sizeof(cl_uint));
+    status = cl_runtime.write(queue[0], stack_info_buf, CL_TRUE, 0, STACK_INFO_WORDS*sizeof(cl_uint), stack_info, 0, NULL, NULL);
+    checkError(status, "Failed to transfer input");
+
+    spill_stack = alloc_spill_region((size_t)spill_records * 2*sizeof(cl_uint), "stack spill region");
+    set_spill = alloc_spill_region((size_t)set_spill_slots * CENTER_SET_SLOT_BYTES, "centre-set spill region");
+    const cl_uint spill_address = (cl_uint)spill_stack;
+    const cl_uint set_spill_address = (cl_uint)set_spill;
+
+    cl_runtime.set_arg(kernel[0], 0, sizeof(cl_mem), &z0_buf);
+    cl_runtime.set_arg(kernel[0], 1, sizeof(cl_mem), &roots_buf);
+    cl_runtime.set_arg(kernel[0], 3, sizeof(cl_uint), &ttbr0_value);
+    cl_runtime.set_arg(kernel[0], 5, sizeof(cl_mem), &centres_buf);
+    cl_runtime.set_arg(kernel[0], 6, sizeof(cl_mem), &visited_nodes_buf);
+    cl_runtime.set_arg(kernel[0], 7, sizeof(cl_mem), &profiling_data_buf);
+    cl_runtime.set_arg(kernel[0], 8, sizeof(cl_uint), &spill_address);
+    cl_runtime.set_arg(kernel[0], 9, sizeof(cl_uint), &spill_records);
+    cl_runtime.set_arg(kernel[0], 10, sizeof(cl_mem), &stack_info_buf);
+    cl_runtime.set_arg(kernel[0], 11, sizeof(cl_uint), &set_spill_address);
+    cl_runtime.set_arg(kernel[0], 12, sizeof(cl_uint), &set_spill_slots);
+    const cl_uint no_labels = 0;
+    cl_runtime.set_arg(kernel[0], 13, sizeof(cl_uint), &no_labels);
+    cl_runtime.set_arg(kernel[0], 14, sizeof(cl_uint), &batch_work);
+
+    cl_runtime.set_arg(kernel[1], 1, sizeof(cl_mem), &new_centers_buf);
+    cl_runtime.set_arg(kernel[1], 2, sizeof(cl_mem), &distortion_buf);
+    cl_runtime.set_arg(kernel[1], 3, sizeof(cl_mem), &partial_sums_buf);
+}
+
+
+opencl_hybrid_device::~opencl_hybrid_device() {
+
+    cl_mem bufs[9] = {centres_buf, roots_buf, z0_buf, visited_nodes_buf, profiling_data_buf, new_centers_buf, distortion_buf, partial_sums_buf, stack_info_buf};
+    for (uint i=0; i<9; i++) {
+        cl_runtime.release(bufs[i]);
+    }
+    void *host_bufs[7] = {centres, roots_list, visited_nodes, profiling_data, partial_sums, distortion, stack_info};
+    for (uint i=0; i<7; i++) {
+        cl_runtime.release_staging(host_bufs[i]);
+    }
+    free(spill_stack);
+    free(set_spill);
+    for (uint i=0; i<2; i++) {
+        clReleaseKernel(kernel[i]);
+        clReleaseCommandQueue(queue[i]);
+    }
+}
+
+
+// Enqueue a filtering pass over the given subtrees. The transfers of the
+// centres and of the subtree list are the only inputs.
+void opencl_hybrid_device::launch(const std::vector<const kdTree_t*> &roots, const data_type *centres, uint k) {
+
+    cl_int status;
+
+    this->k = k;
+    n_roots = roots.size();
+    if (n_roots == 0) {
+        return;
+    }
+
+    for (uint i=0; i<n_roots; i++) {
+        roots_list[i] = (cl_uint)roots[i];
+    }
     for (uint i=0; i<k; i++) {
-        data_type c = vector_2_data_type(new_centers[i]);        
-        printf("%3u: ", i); 
+        this->centres[i] = data_type_2_vector(centres[i]);
+    }
+
+    status = cl_runtime.write(queue[0], centres_buf, CL_FALSE, 0, k*sizeof(cl_int4), this->centres, 0, NULL, &write_event[0]);
+    checkError(status, "Failed to transfer input");
+
+    status = cl_runtime.write(queue[0], roots_buf, CL_FALSE, 0, n_roots*sizeof(cl_uint), roots_list, 0, NULL, &write_event[1]);
+    checkError(status, "Failed to transfer input");
+
+    cl_runtime.set_arg(kernel[0], 2, sizeof(cl_uint), &n_roots);
+    cl_runtime.set_arg(kernel[0], 4, sizeof(cl_uint), &k);
+    cl_runtime.set_arg(kernel[1], 0, sizeof(cl_uint), &k);
+
+    status = cl_runtime.task(queue[1], kernel[1], 0, NULL, &kernel_event[1]);
+    checkError(status, "Failed to launch kernel 1");
+
+    status = cl_runtime.task(queue[0], kernel[0], 2, write_event, &kernel_event[0]);
+    checkError(status, "Failed to launch kernel");
+
+    trace.command("write centres", TRACE_QUEUE0, write_event[0]);
+    trace.command("write subtree roots", TRACE_QUEUE0, write_event[1]);
+    trace.command("filter1", TRACE_QUEUE1, kernel_event[1]);
+    trace.command("filter0", TRACE_QUEUE0, kernel_event[0]);
+
+    status = cl_runtime.read(queue[0], visited_nodes_buf, CL_FALSE, 0, 1*sizeof(cl_uint), visited_nodes, 1, &kernel_event[0], &read_event[0]);
+    checkError(status, "Failed to transfer output");
+
+    status = cl_runtime.read(queue[0], profiling_data_buf, CL_FALSE, 0, LSU_PROFILE_RECORDS*sizeof(cl_uint16), profiling_data, 1, &kernel_event[0], &read_event[1]);
+    checkError(status, "Failed to transfer output");
+
+    status = cl_runtime.read(queue[0], stack_info_buf, CL_FALSE, 0, STACK_INFO_WORDS*sizeof(cl_uint), stack_info, 1, &kernel_event[0], &read_event[4]);
+    checkError(status, "Failed to transfer output");
+
+    status = cl_runtime.read(queue[1], partial_sums_buf, CL_FALSE, 0, k*sizeof(cl_int4), partial_sums, 1, &kernel_event[1], &read_event[2]);
+    checkError(status, "Failed to transfer output");
+
+    status = cl_runtime.read(queue[1], distortion_buf, CL_FALSE, 0, k*sizeof(cl_uint), distortion, 1, &kernel_event[1], &read_event[3]);
+    checkError(status, "Failed to transfer output");
+
+    trace.command("read visited nodes", TRACE_QUEUE0, read_event[0]);
+    trace.command("read LSU counters", TRACE_QUEUE0, read_event[1]);
+    trace.command("read partial sums", TRACE_QUEUE1, read_event[2]);
+    trace.command("read distortion", TRACE_QUEUE1, read_event[3]);
+
+    // make sure the device starts while the host works on its share (or launches the other instances)
+    clFlush(queue[0]);
+    clFlush(queue[1]);
+}
+
+
+// Wait for the pass and convert the device's partial sums.
+void opencl_hybrid_device::finish(centroid_t *centroids, cl_ulong *visited, double *time_ms) {
+
+    if (n_roots == 0) {
+        for (uint i=0; i<k; i++) {
+            for (uint d=0; d<D; d++) {
+                centroids[i].wgtCent.value[d] = 0;
+            }
+            centroids[i].sum_sq = 0;
+            centroids[i].count = 0;
+        }
+        *visited = 0;
+        *time_ms = 0.0;
+        return;
+    }
+
+    clWaitForEvents(5, read_event);
+
+    // the counters accumulate over the instance's passes, so an overflow is reported once
+    if ((stack_info[3] != 0) && !stack_overflow) {
+        char label[32];
+        snprintf(label, sizeof(label), "instance %u", index);
+        report_stack_info(label, stack_info);
+        stack_overflow = true;
+    }
+
+    for (uint i=0; i<k; i++) {
+        centroids[i].wgtCent = vector_2_data_type(partial_sums[i]);
+        centroids[i].sum_sq = distortion[i];
+        centroids[i].count = partial_sums[i].s[3];
+    }
+    *visited = visited_nodes[0];
+    *time_ms = double(getStartEndTime(kernel_event, 2)) * 1e-6;
+
+    for (uint i=0; i<2; i++) {
+        clReleaseEvent(write_event[i]);
+        clReleaseEvent(kernel_event[i]);
+    }
+    for (uint i=0; i<5; i++) {
+        clReleaseEvent(read_event[i]);
+    }
+}
+
+
+// LSU counters of the instance's last pass (nothing if it had no subtrees).
+lsu_profile_t opencl_hybrid_device::lsu_profile() {
+
+    if (n_roots == 0) {
+        lsu_profile_t p;
+        p.clear();
+        return p;
+    }
+    return lsu_run_profile(profiling_data, &lsu_snapshot);
+}
+
+
+// n instances of the device side of the traversal: host engine instances
+// sharing the cores (software device) or the FPGAs 0..n-1.
+std::vector<hybrid_device*> create_instances(uint n) {
+
+    std::vector<hybrid_device*> list;
+    for (uint j=0; j<n; j++) {
+        if (software_device) {
+            uint threads = cpu_threads;
+            if (threads == 0) {
+                threads = std::thread::hardware_concurrency() / n;
+                threads = (threads > 0) ? threads : 1;
+            }
+            list.push_back(new software_hybrid_device(threads, cpu_simd, cpu_bitmap));
+        } else {
+            while (fpga_instances.size() <= j) {
+                fpga_instances.push_back(new opencl_hybrid_device(fpga_instances.size()));
+            }
+            list.push_back(fpga_instances[j]);
+        }
+    }
+    return list;
+}
+
+
+// Delete the host engine instances; FPGA instances stay until cleanup().
+void release_instances(std::vector<hybrid_device*> &list) {
+
+    if (software_device) {
+        for (uint j=0; j<list.size(); j++) {
+            delete list[j];
+        }
+    }
+    list.clear();
+}
+
+
+// Cut depth of the multi-instance traversal: -hybrid-depth if given, otherwise
+// about SUBTREES_PER_INSTANCE subtrees per instance.
+uint multi_depth(uint n) {
+
+    if (hybrid_depth > 0) {
+        return hybrid_depth;
+    }
+    uint depth = 0;
+    while (((1u << depth) < SUBTREES_PER_INSTANCE*n) && (depth < MAX_HYBRID_DEPTH)) {
+        depth++;
+    }
+    return depth;
+}
+
+
+// Run a single filtering pass partitioned over all instances (multi_device.hpp)
+// on the current contents of initial_centers. The merged partial sums give
+// new_centers, distortion and partial_sums, as in run_hybrid_iteration().
+void run_multi_iteration(multi_scheduler *scheduler, iteration_stats_t *stats) {
+
+    const double start_time = getCurrentTimestamp();
+
+    data_type centres[K];
+    for (uint i=0; i<k_centres; i++) {
+        centres[i] = vector_2_data_type(initial_centers[i]);
+    }
+
+    centroid_t centroids[K];
+    multi_stats_t m;
+    scheduler->iterate(centres, k_centres, centroids, &m);
+    trace.span("multi-instance pass", TRACE_HOST_ENGINE, start_time, getCurrentTimestamp());
+    filter_cpu::centroids_2_centres(centroids, k_centres, new_centers, distortion);
+    centroids_2_partial_sums(centroids, k_centres, partial_sums);
+    visited_nodes[0] = m.total_nodes;
+
+    const double end_time = getCurrentTimestamp();
+
+    for (uint j=0; j<m.ms.size(); j++) {
+        printf("%sinstance %u: %3u subtrees, %8llu nodes, %8.3f ms", (j == 0) ? "" : " | ",
+                j, m.subtrees[j], (unsigned long long)m.nodes[j], m.ms[j]);
+    }
+    printf(" | imbalance %.3f\n", m.imbalance);
+
+    // "kernel" time is the parallel section of all instances
+    stats->enqueue_ms   = 0.0;
+    stats->kernel_ms    = m.wall_ms;
+    stats->readback_ms  = 0.0;
+    stats->check_ms     = 0.0;
+    stats->iteration_ms = (end_time - start_time) * 1e3;
+    stats->device_nodes = m.total_nodes;
+    stats->lsu          = m.lsu;
+    stats->gap_ms       = -1.0;
+}
+
+
+// Scaling report (-scaling): the first filtering pass (initial centres) on
+// 1..max_instances instances, best of SCALING_PASSES passes each. Speedup and
+// efficiency are relative to one instance over the same partition of the tree
+// (efficiency = T1 / (n * Tn)); the merged result must not depend on n.
+void run_scaling(uint max_instances) {
+
+    const uint k = k_centres;
+
+    data_type centres[K];
+    for (uint i=0; i<k; i++) {
+        centres[i] = data_points[cntr_idx[i]];
+    }
+
+    printf("Scaling report: 1..%u %s instance(s), balanced by %s, best of %u passes\n",
+            max_instances, software_device ? "software" : "fpga", balance_cost ? "measured cost" : "point count", SCALING_PASSES);
+
+    centroid_t reference[K];
+    double t1 = 0.0;
+    for (uint n=1; n<=max_instances; n++) {
+        std::vector<hybrid_device*> list = create_instances(n);
+        multi_scheduler scheduler(root, multi_depth(max_instances), list, balance_cost);
+
+        centroid_t centroids[K];
+        multi_stats_t m;
+        double best_ms = 0.0;
+        double imbalance = 1.0;
+        for (uint p=0; p<SCALING_PASSES; p++) {
+            scheduler.iterate(centres, k, centroids, &m);
+            if ((p == 0) || (m.wall_ms < best_ms)) {
+                best_ms = m.wall_ms;
+                imbalance = m.imbalance;
+            }
+        }
+
+        if (n == 1) {
+            t1 = best_ms;
+            for (uint i=0; i<k; i++) {
+                reference[i] = centroids[i];
+            }
+        }
+        uint mismatches = 0;
+        for (uint i=0; i<k; i++) {
+            bool match = (centroids[i].count == reference[i].count) && (centroids[i].sum_sq == reference[i].sum_sq);
+            for (uint d=0; d<D; d++) {
+                match = match && (centroids[i].wgtCent.value[d] == reference[i].wgtCent.value[d]);
+            }
+            mismatches += match ? 0 : 1;
+        }
+
+        printf("instances %2u: %3u subtrees, %8llu nodes, %8.3f ms, speedup %5.2f, efficiency %5.1f %%, imbalance %.3f, mismatching centres: %u\n",
+                n, scheduler.subtrees(), (unsigned long long)m.total_nodes, best_ms,
+                (best_ms > 0.0) ? t1 / best_ms : 0.0, (best_ms > 0.0) ? t1 * 100.0 / ((double)n * best_ms) : 0.0,
+                imbalance, mismatches);
+
+        release_instances(list);
+    }
+}
+
+
+// Multi-start K-means on the host engine: m initial centre sets (restarts)
+// iterate together, every iteration traverses the tree once for all restarts
+// that have not converged yet (filter_cpu::run_batch). The converged solution
+// with the lowest total distortion (pass_distortion) is selected at the end, or
+// the lowest of all if none converged within the iteration cap.
+void run_multistart(uint m) {
+
+    printf("Multi-start K-means: %u restarts\n", m);
+
+    std::vector<cl_int4> centres(m*K);
+    std::vector<cl_int4> next_centres(m*K);
+    std::vector<cl_uint> restart_distortion(m*K);
+    for (uint i=0; i<m*K; i++) {
+        centres[i] = data_type_2_vector(data_points[cntr_idx[i]]);
+    }
+
+    std::vector<bool> active(m, true);
+    std::vector<uint> restart_iterations(m, 0);
+    std::vector<cl_ulong> total_distortion(m, 0);
+    std::vector<cl_ulong> restart_fetches(m, 0);    // node fetches each restart needs on its own
+    cl_ulong batched_fetches = 0;
+
+    filter_cpu engine(cpu_threads, cpu_simd);
+    pointer_tree_t<kdTree_t> tree;
+    const cl_ulong sum_sq = points_sum_sq(root);
+
+    const double start_kernel_time = getCurrentTimestamp();
+
+    uint iteration;
+    uint n_active = m;
+    for (iteration=0; (iteration<max_iterations) && (n_active > 0); iteration++) {
+
+        if (iteration == 0) {
+            first_kernel_time = getCurrentTimestamp();
+        }
+
+        // centre sets of the restarts still running
+        std::vector<uint> batch;
+        std::vector<data_type> batch_centres;
+        for (uint r=0; r<m; r++) {
+            if (active[r]) {
+                batch.push_back(r);
+                for (uint i=0; i<K; i++) {
+                    batch_centres.push_back(vector_2_data_type(centres[r*K+i]));
+                }
+            }
+        }
+
+        std::vector<centroid_t> centroids(batch.size()*K);
+        std::vector<cl_ulong> fetches;
+        filter_cpu_stats_t stats;
+        const double start_batch_time = getCurrentTimestamp();
+        engine.run_batch(tree, root, &batch_centres[0], K, batch.size(), &centroids[0], &stats, &fetches);
+        trace.span("batched pass", TRACE_HOST_ENGINE, start_batch_time, getCurrentTimestamp());
+
+        cl_ulong independent_fetches = 0;
+        for (uint j=0; j<batch.size(); j++) {
+            const uint r = batch[j];
+            cl_int4 *c_old = &centres[r*K];
+            cl_int4 *c_new = &next_centres[r*K];
+            cl_uint *dist = &restart_distortion[r*K];
+            filter_cpu::centroids_2_centres(&centroids[j*K], K, c_new, dist);
+
+            cl_int4 sums[K];
+            centroids_2_partial_sums(&centroids[j*K], K, sums);
+            const cl_ulong sum = pass_distortion(c_old, sums, K, sum_sq);
+
+            coord_type max_shift;
+            bool converged = check_convergence(c_old, c_new, sum, total_distortion[r], (restart_iterations[r] > 0), &max_shift);
+            total_distortion[r] = sum;
+            for (uint i=0; i<K; i++) {
+                c_old[i] = c_new[i];
+            }
+
+            restart_iterations[r]++;
+            restart_fetches[r] += fetches[j];
+            independent_fetches += fetches[j];
+            if (converged) {
+                active[r] = false;
+                n_active--;
+            }
+        }
+        batched_fetches += stats.visited_nodes;
+
+        printf("iteration %3u: %3u restart(s), node fetches: %8llu batched vs %8llu independent, %8.3f ms\n",
+                iteration, (uint)batch.size(), (unsigned long long)stats.visited_nodes,
+                (unsigned long long)independent_fetches, stats.time_ms);
+    }
+
+    const double end_time = getCurrentTimestamp();
+
+    // select the best restart; one stopped by the iteration cap only competes if none converged
+    const bool any_converged = (std::find(active.begin(), active.end(), false) != active.end());
+    uint best = m;
+    for (uint r=0; r<m; r++) {
+        if (any_converged && active[r]) {
+            continue;
+        }
+        best = ((best == m) || (total_distortion[r] < total_distortion[best])) ? r : best;
+    }
+
+    printf("\n");
+    cl_ulong independent_total = 0;
+    for (uint r=0; r<m; r++) {
+        printf("restart %3u: %s after %3u iteration(s), distortion: %12llu, node fetches: %10llu%s\n",
+                r+1, active[r] ? "stopped" : "converged", restart_iterations[r],
+                (unsigned long long)total_distortion[r], (unsigned long long)restart_fetches[r],
+                (r == best) ? "  <- best" : "");
+        independent_total += restart_fetches[r];
+    }
+
+    if (!any_converged) {
+        printf("no restart converged within %u iteration(s), best of all of them\n", max_iterations);
+    }
+
+    printf("\nNode fetches: %llu batched (%.0f per restart), %llu if run independently (%.0f per restart), %.2fx fewer\n",
+            (unsigned long long)batched_fetches, (double)batched_fetches / m,
+            (unsigned long long)independent_total, (double)independent_total / m,
+            (batched_fetches > 0) ? (double)independent_total / (double)batched_fetches : 0.0);
+
+    printf("\nnew centers (restart %u):\n", best+1);
+    for (uint i=0; i<K; i++) {
+        data_type c = vector_2_data_type(centres[best*K+i]);
+        printf("%3u: ", i);
         for (uint d=0; d<D; d++) {
             printf("%8d ", c.value[d]);
         }
-        printf(" (distortion: %12u)\n",distortion[i]);
+        printf(" (distortion: %12u)\n",restart_distortion[best*K+i]);
     }
 
-    // Wall-clock time taken.
-    printf("\nData setup to end: %0.3f ms\n", (end_time - start_datasetup_time) * 1e3);
-    printf("Buffer setup to end: %0.3f ms\n", (end_time - start_buffer_time) * 1e3);
-    printf("Kernel enqueue to end: %0.3f ms\n", (end_time - start_kernel_time) * 1e3);
-    printf("Buffer readout to end: %0.3f ms\n", (end_time - start_readout_time) * 1e3);
+    printf("\nProgram start to end: %0.3f ms\n", (end_time - program_start_time) * 1e3);
+    printf("Time to first kernel: %0.3f ms\n", (first_kernel_time - program_start_time) * 1e3);
+    printf("Iterations: %0.3f ms\n", (end_time - start_kernel_time) * 1e3);
+}
 
-  
-    // Print profiling information
-    printf("rw: transferred data = %.2f MB\n",(double)profiling_data[0].s0 / (1024.0 * 1024.0));
-    printf("rw: number of transferred 32bit words = %u\n",profiling_data[0].s1);
-    printf("rw: average burst size = %.2f\n",(double)profiling_data[0].s2 / (double) profiling_data[0].s3);
-    printf("rw: cache hit rate = %.2f\n",(double)profiling_data[0].s4 * 100.0 / profiling_data[0].s1);
-
-    printf("read_pt_level1: transferred data = %.2f MB\n",(double)profiling_data[0].s5 / (1024.0 * 1024.0));
-    printf("read_pt_level1: number of transferred 32bit words = %u\n",profiling_data[0].s6);
-    printf("read_pt_level1: average burst size = %.2f\n",(double)profiling_data[0].s7 / (double) profiling_data[0].s8);
-    printf("read_pt_level1: cache hit rate = %.5f\n",(double)profiling_data[0].s9 * 100.0 / profiling_data[0].s6);
-
-    printf("read_pt_level0: transferred data = %.2f MB\n",(double)profiling_data[0].sa / (1024.0 * 1024.0));
-    printf("read_pt_level0: number of transferred 32bit words = %u\n",profiling_data[0].sb);
-    printf("read_pt_level0: average burst size = %.2f\n",(double)profiling_data[0].sc / (double) profiling_data[0].sd);
-    printf("read_pt_level0: cache hit rate = %.5f\n",(double)profiling_data[0].se * 100.0 / profiling_data[0].sb);
-
-    // Get kernel times using the OpenCL event profiling API.
-    cl_ulong time_ns = getStartEndTime(kernel0_event);
-    printf("Kernel time (device %d): %0.3f ms\n", 0, double(time_ns) * 1e-6);
 
-    // Release all events.  
-    clReleaseEvent(write_event[0]);
-    clReleaseEvent(kernel1_event);
-    clReleaseEvent(kernel0_event);
-    clReleaseEvent(finish_event);
-  
-   
+// Bounds benchmark (-bounds-bench): the Lloyd iterations of the host engine from
+// the first initial centre set, and on the same centres in each iteration
+// Hamerly's bounds over the points and the bounds combined with the engine
+// (bounds.hpp). Distance computations are the closest-centre distances (of the
+// engine, or of the points the bounds do not settle) and tooFar evaluations plus
+// the distances of the bounds; mismatching centres are those whose new position
+// or point count differs from the engine's. The iterations run until no centre
+// moves by more than -centre-tolerance or up to -iterations.
+void run_bounds_bench() {
+
+    filter_cpu engine(cpu_threads, cpu_simd, cpu_bitmap);
+    pointer_tree_t<kdTree_t> tree;
+    hamerly_points points(root);
+    hamerly_tree combined(engine, root, &label_pass);
+
+    printf("Bounds benchmark: %u points, %u centres, host engine (%u threads, %s, %s sets)\n",
+            N, K, engine.threads(), engine.isa(), engine.sets());
+
+    std::vector<cl_int4> centres_v(K);
+    for (uint i=0; i<K; i++) {
+        centres_v[i] = data_type_2_vector(data_points[cntr_idx[i]]);
+    }
+
+    cl_ulong total_filter = 0;
+    cl_ulong total_points = 0;
+    cl_ulong total_combined = 0;
+    double filter_ms = 0.0;
+    double points_ms = 0.0;
+    double combined_ms = 0.0;
+    bool converged = false;
+    uint iteration;
+    for (iteration=0; (iteration<max_iterations) && !converged; iteration++) {
+
+        data_type centres[K];
+        for (uint i=0; i<K; i++) {
+            centres[i] = vector_2_data_type(centres_v[i]);
+        }
+
+        centroid_t filter_c[K];
+        centroid_t points_c[K];
+        centroid_t combined_c[K];
+        filter_cpu_stats_t f;
+        bounds_stats_t p;
+        bounds_stats_t c;
+        engine.run(tree, (const kdTree_t*)root, centres, K, filter_c, &f);
+        points.iterate(centres, K, points_c, &p);
+        combined.iterate(centres, K, combined_c, &c);
+
+        cl_int4 next[K];
+        cl_int4 points_next[K];
+        cl_int4 combined_next[K];
+        cl_uint dist[K];
+        cl_uint other_dist[K];
+        filter_cpu::centroids_2_centres(filter_c, K, next, dist);
+        filter_cpu::centroids_2_centres(points_c, K, points_next, other_dist);
+        filter_cpu::centroids_2_centres(combined_c, K, combined_next, other_dist);
+        uint points_mismatches = 0;
+        uint combined_mismatches = 0;
+        for (uint i=0; i<K; i++) {
+            bool points_match = (points_c[i].count == filter_c[i].count);
+            bool combined_match = (combined_c[i].count == filter_c[i].count);
+            for (uint d=0; d<4; d++) {
+                points_match = points_match && (points_next[i].s[d] == next[i].s[d]);
+                combined_match = combined_match && (combined_next[i].s[d] == next[i].s[d]);
+            }
+            points_mismatches += (points_match) ? 0 : 1;
+            combined_mismatches += (combined_match) ? 0 : 1;
+        }
+
+        const cl_ulong filter_evals = f.distance_evals + f.toofar_evals;
+        const cl_ulong points_evals = p.bound_evals + p.distance_evals;
+        const cl_ulong combined_evals = c.bound_evals + c.distance_evals + c.toofar_evals;
+        printf("iteration %3u: filtering %10llu (%8llu nodes) | bounds only %10llu (bounds %10llu, %8u of %8u points settled) | combined %10llu (bounds %8llu, %8llu nodes, %7u of %7u dead ends settled) | mismatching centres %u, %u\n",
+                iteration, (unsigned long long)filter_evals, (unsigned long long)f.visited_nodes,
+                (unsigned long long)points_evals, (unsigned long long)p.bound_evals, p.settled, p.entries,
+                (unsigned long long)combined_evals, (unsigned long long)c.bound_evals, (unsigned long long)c.visited_nodes,
+                c.settled, c.entries, points_mismatches, combined_mismatches);
+        total_filter += filter_evals;
+        total_points += points_evals;
+        total_combined += combined_evals;
+        filter_ms += f.time_ms;
+        points_ms += p.ms;
+        combined_ms += c.ms;
+
+        // the centre-shift test alone: the bounds pay off in the late iterations,
+        // which the distortion test would cut short
+        coord_type max_shift;
+        converged = check_convergence(&centres_v[0], next, 0, 0, false, &max_shift);
+        for (uint i=0; i<K; i++) {
+            centres_v[i] = next[i];
+        }
+    }
+
+    printf("\n%s after %u iteration(s)\n", converged ? "Centres unchanged" : "Stopped at iteration cap", iteration);
+    printf("Distance computations over %u iteration(s): filtering %llu (%0.3f ms), bounds only %llu (%0.3f ms, %.2fx), combined %llu (%0.3f ms, %.2fx)\n",
+            iteration, (unsigned long long)total_filter, filter_ms,
+            (unsigned long long)total_points, points_ms, (total_filter > 0) ? (double)total_points / (double)total_filter : 0.0,
+            (unsigned long long)total_combined, combined_ms, (total_filter > 0) ? (double)total_combined / (double)total_filter : 0.0);
+}
+
+
+// Job service: context, program, kernels, queues and pooled buffers stay up
+// while jobs are taken from the spool directory. A builder thread loads the
+// data and builds the tree of the next job while the device runs the current
+// one; each job then goes through run() like a one-shot run.
+void run_service(const std::string &spool_dir) {
+
+    job_spool_t spool(spool_dir);
+    job_queue_t<job_t*> ready(1);
+    job_stats_t service_stats;
+    const uint default_iterations = max_iterations;
+
+    printf("Service: waiting for jobs in %s (device: %s, stop with %s/%s)\n",
+            spool_dir.c_str(), software_device ? "software" : "fpga", spool_dir.c_str(), JOB_STOP_FILE);
+
+    std::thread builder([&spool, &ready]() {
+        while (true) {
+            job_t *job = new job_t;
+            if (spool.next(job)) {
+                load_job(job, K);
+                trace.span(job->name.c_str(), TRACE_DATA, job->claim_time, job->ready_time);
+                ready.push(job);
+            } else {
+                delete job;
+                if (spool.stop_requested()) {
+                    ready.push(NULL);
+                    return;
+                }
+                waitMilliseconds(JOB_POLL_MS);
+            }
+        }
+    });
+
+    while (job_t *job = ready.pop()) {
+        job_result_t result;
+        job->start_time = getCurrentTimestamp();
+
+        if (job->ok) {
+            printf("\nService: job %s (n = %u, k = %u)\n", job->name.c_str(), job->n, job->k);
+            data_points     = job->data_points;
+            index_arr       = job->index_arr;
+            cntr_idx        = job->cntr_idx;
+            root            = job->root;
+            k_centres       = job->k;
+            max_iterations  = (job->iterations > 0) ? job->iterations : default_iterations;
+
+            run(&result);
+
+            // the tree is owned by the job
+            root = NULL;
+        } else {
+            printf("\nService: job %s failed: %s\n", job->name.c_str(), job->error.c_str());
+        }
+
+        job->done_time = getCurrentTimestamp();
+        trace.span(job->name.c_str(), TRACE_HOST, job->start_time, job->done_time);
+        spool.write_result(*job, result);
+        service_stats.add(*job);
+        release_job(job);
+        delete job;
+    }
+
+    builder.join();
+
+    data_points = NULL;
+    index_arr = NULL;
+    cntr_idx = NULL;
+    k_centres = K;
+    max_iterations = default_iterations;
+
+    service_stats.print();
+}
+
+
+// pointer_tree_t that records the dead ends of a pass with their owner, in the
+// order the engine threads reach them (filter0 streams them to filter1 likewise)
+struct dead_end_tree_t : public pointer_tree_t<kdTree_t> {
+
+    mutable std::vector<std::pair<const kdTree_t*, center_index_t> > dead_ends;
+    mutable std::mutex lock;
+
+    void own(node_ref u, center_index_t owner) const {
+        std::lock_guard<std::mutex> guard(lock);
+        dead_ends.push_back(std::make_pair(u, owner));
+    }
+};
+
+
+// Run the same filtering pass with the host engine (filter_cpu.hpp) on the
+// centres in initial_centers and compare with the device results in
+// new_centers/distortion. roots is the list of subtrees the pass started from
+// (only the root, unless the tree is split for the hybrid traversal).
+// Returns the number of centres whose position or sums (partial_sums) mismatch;
+// the per-centre distortion words are counted apart, as the incremental pass
+// rounds them per cached dead end. The dead ends of the pass also go through
+// filter1's banked accumulation (verify_banks).
+uint verify_iteration(const filter_cpu &engine, const std::vector<const kdTree_t*> &roots) {
+
+    data_type centres[K];
+    for (uint i=0; i<k_centres; i++) {
+        centres[i] = vector_2_data_type(initial_centers[i]);
+    }
+
+    centroid_t centroids[K];
+    cl_int4 ref_centers[K];
+    cl_uint ref_distortion[K];
+    filter_cpu_stats_t stats;
+
+    dead_end_tree_t tree;
+    engine.run(tree, roots, centres, k_centres, centroids, &stats);
+    filter_cpu::centroids_2_centres(centroids, k_centres, ref_centers, ref_distortion);
+    verify_banks(tree.dead_ends, centres, k_centres, centroids);
+    cl_int4 ref_sums[K];
+    centroids_2_partial_sums(centroids, k_centres, ref_sums);
+
+    uint mismatches = 0;
+    uint distortion_mismatches = 0;
+    for (uint i=0; i<k_centres; i++) {
+        bool match = true;
+        for (uint d=0; d<4; d++) {
+            match = match && (ref_centers[i].s[d] == new_centers[i].s[d]);
+            match = match && (ref_sums[i].s[d] == partial_sums[i].s[d]);
+        }
+        mismatches += (match) ? 0 : 1;
+        distortion_mismatches += (ref_distortion[i] == distortion[i]) ? 0 : 1;
+    }
+
+    printf("cpu reference (%u threads, %s, %s sets): %0.3f ms, visited nodes: %llu, candidates per node: %0.2f, mismatching centres: %u (distortion words: %u)\n",
+            engine.threads(), engine.isa(), engine.sets(), stats.time_ms, (unsigned long long)stats.visited_nodes,
+            (double)stats.distance_evals / (double)stats.visited_nodes, mismatches, distortion_mismatches);
+
+    return mismatches;
+}
+
+
+// Feed the dead ends of a pass to filter1's accumulation as the kernel does it:
+// record j goes to bank j % FILTER1_ACC_BANKS, and the banks are added up in
+// order at the end. The result must match the serial sums of the same records
+// exactly, and those the engine's centroids. Returns the number of centres
+// whose banked sums differ from either.
+uint verify_banks(const std::vector<std::pair<const kdTree_t*, center_index_t> > &dead_ends, const data_type *centres, uint k, const centroid_t *centroids) {
+
+    std::vector<centroid_t> banks(FILTER1_ACC_BANKS * k, filter_cpu_zero_centroid());
+    std::vector<centroid_t> serial(k, filter_cpu_zero_centroid());
+    pointer_tree_t<kdTree_t> tree;
+
+    for (uint j=0; j<dead_ends.size(); j++) {
+        filter_node_t tn;
+        const kdTree_t *left, *right;
+        tree.fetch(dead_ends[j].first, &tn, &left, &right);
+
+        // the record filter0 sends for this dead end
+        const center_index_t owner = dead_ends[j].second;
+        centroid_t record = filter_cpu_zero_centroid();
+        filter_cpu_accumulate(&record, centres[owner], tn);
+
+        centroid_t *bank = &banks[(j % FILTER1_ACC_BANKS) * k + owner];
+        centroid_t *sum = &serial[owner];
+        for (uint d=0; d<D; d++) {
+            bank->wgtCent.value[d] += record.wgtCent.value[d];
+            sum->wgtCent.value[d] += record.wgtCent.value[d];
+        }
+        bank->sum_sq += record.sum_sq;
+        bank->count += record.count;
+        sum->sum_sq += record.sum_sq;
+        sum->count += record.count;
+    }
+
+    uint mismatches = 0;
+    for (uint i=0; i<k; i++) {
+        centroid_t merged = banks[i];
+        for (uint b=1; b<FILTER1_ACC_BANKS; b++) {
+            for (uint d=0; d<D; d++) {
+                merged.wgtCent.value[d] += banks[b * k + i].wgtCent.value[d];
+            }
+            merged.sum_sq += banks[b * k + i].sum_sq;
+            merged.count += banks[b * k + i].count;
+        }
+
+        bool match = (merged.sum_sq == serial[i].sum_sq) && (merged.count == serial[i].count) &&
+                     (merged.sum_sq == centroids[i].sum_sq) && (merged.count == centroids[i].count);
+        for (uint d=0; d<D; d++) {
+            match = match && (merged.wgtCent.value[d] == serial[i].wgtCent.value[d]);
+            match = match && (merged.wgtCent.value[d] == centroids[i].wgtCent.value[d]);
+        }
+        mismatches += (match) ? 0 : 1;
+    }
+
+    printf("filter1 banks (%u): %u dead end(s), banked against serial sums, mismatching centres: %u\n",
+            (uint)FILTER1_ACC_BANKS, (uint)dead_ends.size(), mismatches);
+
+    return mismatches;
+}
+
+
+// LSU counters of the last filter0 run (profiling_data, lsu_profile.hpp): the
+// deltas filter0 accumulated per batch if it was compiled with
+// LSU_PROFILE_DELTAS, otherwise the difference to the previous run's snapshot.
+lsu_profile_t device_lsu_profile() {
+
+    return lsu_run_profile(profiling_data, &lsu_snapshot);
+}
+
+
+// Add the LSU metrics of an iteration to the trace.
+void trace_lsu_counters(double ts, const lsu_metrics_t &m) {
+
+    if (!trace.is_enabled()) {
+        return;
+    }
+
+    std::vector< std::pair<std::string, double> > values;
+    for (uint i=0; i<LSU_PORTS; i++) {
+        values.clear();
+        values.push_back(std::make_pair(std::string("MB"), m.port[i].mb));
+        values.push_back(std::make_pair(std::string("hit rate %"), m.port[i].hit_rate));
+        trace.counter((std::string("LSU ") + lsu_port_name[i]).c_str(), ts, values);
+    }
+
+    values.clear();
+    values.push_back(std::make_pair(std::string("node fetches"), (double)m.node_fetches));
+    values.push_back(std::make_pair(std::string("walks per fetch"), m.walks_per_fetch));
+    trace.counter("filter0", ts, values);
+}
+
+
+// Compare next_centers against the centres of the current iteration
+// (old_centers). The run has converged if no centre coordinate moved by more
+// than centre_tolerance or if the relative change in total distortion with
+// respect to the previous iteration (if any) is below distortion_tolerance.
+bool check_convergence(const cl_int4 *old_centers, const cl_int4 *next_centers, cl_ulong total_distortion, cl_ulong prev_total_distortion, bool have_prev, coord_type *max_shift) {
+
+    coord_type shift = 0;
+    for (uint i=0; i<k_centres; i++) {
+        data_type c_old = vector_2_data_type(old_centers[i]);
+        data_type c_new = vector_2_data_type(next_centers[i]);
+        for (uint d=0; d<D; d++) {
+            coord_type tmp = abs(c_new.value[d] - c_old.value[d]);
+            shift = (tmp > shift) ? tmp : shift;
+        }
+    }
+    *max_shift = shift;
+
+    if (shift <= centre_tolerance) {
+        return true;
+    }
+    if (!have_prev) {
+        return false;
+    }
+
+    double delta = fabs((double)total_distortion - (double)prev_total_distortion);
+    double rel_delta = (prev_total_distortion != 0) ? delta / (double)prev_total_distortion : delta;
+
+    return (rel_delta < distortion_tolerance);
+}
+
+
+// Sum of the squared norms of the points below u, in the unscaled fixed-point
+// products of the tree's sum_sq but in 64 bits (sum_sq of the nodes wraps).
+cl_ulong points_sum_sq(const kdTree_t *u) {
+
+    cl_ulong sum = 0;
+    for (uint j=0; j<u->count; j++) {
+        const data_type &x = data_points[u->idx[j]];
+        for (uint d=0; d<D; d++) {
+            sum += (cl_ulong)((cl_long)x.value[d] * (cl_long)x.value[d]);
+        }
+    }
+    return sum;
+}
+
+
+// Total distortion of a pass: the squared distance of every point to the centre
+// it was assigned to, in the units of filter_cpu::mul_scale. With the per-centre
+// sums (wgtCent in xyz, count in w) of the pass from centres and sum_sq of all
+// points (points_sum_sq), it is sum_sq - 2 sum_i z_i.S_i + sum_i n_i |z_i|^2,
+// exact in 64 bits. The per-centre figures of filter1 (distortion) add the
+// unscaled sum_sq of the nodes to scaled terms in 32 bits and are not used.
+cl_ulong pass_distortion(const cl_int4 *centres, const cl_int4 *sums, uint k, cl_ulong sum_sq) {
+
+    cl_long total = (cl_long)sum_sq;
+    for (uint i=0; i<k; i++) {
+        cl_long zs = 0;
+        cl_long zz = 0;
+        for (uint d=0; d<D; d++) {
+            zs += (cl_long)centres[i].s[d] * (cl_long)sums[i].s[d];
+            zz += (cl_long)centres[i].s[d] * (cl_long)centres[i].s[d];
+        }
+        total += (cl_long)(cl_uint)sums[i].s[3] * zz - 2*zs;
+    }
+    return (total > 0) ? (cl_ulong)total >> FRACTIONAL_BITS : 0;
+}
+
+
+// Per-centre sums of a host pass in the layout of filter1's partial_sums.
+void centroids_2_partial_sums(const centroid_t *centroids, uint k, cl_int4 *sums) {
+
+    for (uint i=0; i<k; i++) {
+        sums[i] = data_type_2_vector(centroids[i].wgtCent);
+        sums[i].s[3] = centroids[i].count;
+    }
+}
+
+
+// Host memory region for the spilled part of the filter0 stack or of its
+// centre-set heap. filter0 reaches it through the memory bridge's page table
+// walk, so the pages are touched here to make sure they are mapped; the 4 KB
+// alignment keeps every 512-bit fill line within one page.
+cl_uint *alloc_spill_region(size_t bytes, const char *what) {
+
+    cl_uint *region = NULL;
+    if (posix_memalign((void**)&region, 4096, (bytes > 0) ? bytes : 64) != 0) {
+        checkError(CL_OUT_OF_HOST_MEMORY, "Failed to allocate the %s (%lu bytes)", what, (unsigned long)bytes);
+    }
+    memset(region, 0, bytes);
+    return region;
+}
+
+
+// Per-point labels from node ownership: the points below the topmost node that
+// pass tagged as a dead end belong to its owner. Every path of a complete pass
+// ends in one; tags of earlier passes never match. labels[p] is the centre of
+// point p, or -1 if the pass did not reach it. Returns the number of labelled
+// points.
+uint resolve_labels(const kdTree_t *root, cl_uint pass, std::vector<uint> &labels, uint *dead_ends) {
+
+    uint labelled = 0;
+    *dead_ends = 0;
+    labels.assign(N, (uint)-1);
+
+    // explicit stack, the degenerate trees are as deep as they have points
+    std::vector<const kdTree_t*> stack(1, root);
+    while (!stack.empty()) {
+        const kdTree_t *u = stack.back();
+        stack.pop_back();
+        if (u->owner_pass == pass) {
+            for (uint j=0; j<u->count; j++) {
+                const uint p = u->idx[j];
+                if (p >= labels.size()) {
+                    labels.resize(p+1, (uint)-1);
+                }
+                labels[p] = u->owner;
+            }
+            labelled += u->count;
+            (*dead_ends)++;
+        } else if ((u->left != NULL) && (u->right != NULL)) {
+            stack.push_back(u->right);
+            stack.push_back(u->left);
+        }
+    }
+
+    return labelled;
+}
+
+
+// Count the labelled points that are farther from their centre than from the
+// closest one (ties are not counted).
+uint verify_labels(const std::vector<uint> &labels, const cl_int4 *centres, uint k) {
+
+    uint mismatches = 0;
+    for (uint p=0; p<labels.size(); p++) {
+        if (labels[p] >= k) {
+            continue;
+        }
+        long long min_dist = -1;
+        long long own_dist = 0;
+        for (uint i=0; i<k; i++) {
+            const data_type c = vector_2_data_type(centres[i]);
+            long long dist = 0;
+            for (uint d=0; d<D; d++) {
+                const long long t = (long long)data_points[p].value[d] - (long long)c.value[d];
+                dist += t*t;
+            }
+            min_dist = ((min_dist < 0) || (dist < min_dist)) ? dist : min_dist;
+            own_dist = (i == labels[p]) ? dist : own_dist;
+        }
+        mismatches += (own_dist > min_dist) ? 1 : 0;
+    }
+
+    return mismatches;
+}
+
+
+// Print filter0's stack statistics (spilled blocks, filled blocks, max depth,
+// overflow) and those of its centre-set heap (sets spilled to and filled from the
+// second tier, nodes processed with all k centres for lack of room, max sets on
+// chip) and its batches. Returns false if the spill region overflowed, in which
+// case the traversal was cut short and the results are incomplete.
+bool report_stack_info(const char *label, const cl_uint *info) {
+
+    printf("filter0 stack (%s): max depth %u, %u block(s) spilled, %u filled\n", label, info[2], info[0], info[1]);
+    printf("filter0 centre sets (%s): max %u on chip, %u spilled, %u filled, %u node(s) with all centres\n", label, info[7], info[4], info[5], info[6]);
+    printf("filter0 batches (%s): %u, %.1f candidates each (target %u), %u capped at BATCH_SIZE records, %u drained, occupancy %.1f%% at %u cycles per batch\n",
+            label, info[8], (info[8] > 0) ? (double)info[9] / (double)info[8] : 0.0, batch_work, info[10], info[11],
+            batch_occupancy(info[8], info[9], batch_overhead) * 100.0, batch_overhead);
+    if (info[3] != 0) {
+        printf("ERROR: filter0 stack spill region full (%u records), traversal cut short: raise -spill-records\n", spill_records);
+        return false;
+    }
+    return true;
 }
 
 
 // Free the resources allocated during initialization
 void cleanup() {
 
+    // all traced commands have completed, write the timeline before the events' context goes away
+    trace.close();
+
+    // FPGA instances of the multi-instance traversal (buffers back to the pool)
+    for (uint j=0; j<fpga_instances.size(); j++) {
+        delete fpga_instances[j];
+    }
+    fpga_instances.clear();
+
     if(kernel0) {
         clReleaseKernel(kernel0);
     }
@@ -395,25 +2432,12 @@ void cleanup() {
     if(queue1) {
         clReleaseCommandQueue(queue1);
     }
-    if(initial_centers_buf) {
-        clReleaseMemObject(initial_centers_buf);
-    }
-    if(visited_nodes_buf) {
-        clReleaseMemObject(visited_nodes_buf);
-    }
-    if(profiling_data_buf) {
-        clReleaseMemObject(profiling_data_buf);
-    }
-    if(new_centers_buf) {
-        clReleaseMemObject(new_centers_buf);
-    }
-    if(distortion_buf) {
-        clReleaseMemObject(distortion_buf);
+    if(queue2) {
+        clReleaseCommandQueue(queue2);
     }
 
-    if(z0_buf) {
-        clReleaseMemObject(z0_buf);
-    }
+    // pooled buffers, host staging buffers included
+    cl_runtime.cleanup();
 
     if(program) {
         clReleaseProgram(program);
@@ -427,25 +2451,15 @@ void cleanup() {
         deletekdTree(root);
     }
 
-    if (initial_centers != NULL) {
-        free(initial_centers);
-    }
-    if (visited_nodes != NULL) {
-        free(visited_nodes);
-    }
-    if (new_centers != NULL) {
-        free(new_centers);
-    }
-    if (distortion != NULL) {
-        free(distortion);
+    if (spill_stack != NULL) {
+        free(spill_stack);
+        free(set_spill);
     }
 
-    if (profiling_data != NULL) {
-        free(profiling_data);
+    if (device_initialized) {
+        cleanup_svm();
     }
 
-    cleanup_svm();
-
 }
 
 
@@ -0,0 +1,230 @@
+/**********************************************************************
+* Felix Winterstein, Imperial College London, 2016
+*
+* File: multi_device.hpp
+*
+* Revision 1.01
+* Additional Comments: distributed under an Apache-2.0 license, see LICENSE
+*
+**********************************************************************/
+
+/*
+ * Multi-instance traversal.
+ *
+ * The kd-tree is cut at a fixed depth, as for the hybrid traversal, and the
+ * subtrees are partitioned over N instances of the device interface of
+ * hybrid.hpp: one FPGA per OpenCL device, or software instances of the host
+ * engine with their own threads. All instances are launched before the first
+ * one is waited for, and their per-centre partial sums are added up on the
+ * host.
+ *
+ * Subtrees are assigned largest first to the instance with the earliest
+ * predicted finish time. In the first iteration the cost of a subtree is its
+ * number of points and all instances count as equally fast. With measured
+ * balancing, later iterations use the node fetches of the previous one (each
+ * instance's total spread over its subtrees in proportion to their previous
+ * estimates) and the node fetches per ms each instance achieved.
+ */
+
+#ifndef MULTI_DEVICE_H
+#define MULTI_DEVICE_H
+
+#include <vector>
+#include <algorithm>
+
+#include "my_util.hpp"
+#include "filter_cpu.hpp"
+#include "hybrid.hpp"
+#include "lsu_profile.hpp"
+
+
+// statistics of one multi-instance iteration
+struct multi_stats_t {
+    std::vector<uint> subtrees;     // per instance
+    std::vector<cl_ulong> nodes;
+    std::vector<double> ms;
+    cl_ulong total_nodes;
+    double wall_ms;                 // first launch to merged result
+    double imbalance;               // slowest instance over the mean
+    lsu_profile_t lsu;              // bridge LSU counters, all instances
+};
+
+
+class multi_scheduler {
+public:
+
+    multi_scheduler(const kdTree_t *root, uint depth, const std::vector<hybrid_device*> &instances, bool measured)
+        : instances(instances), measured(measured), rate(instances.size(), 1.0)
+    {
+        collect(root, depth);
+        assign();
+    }
+
+    uint subtrees() const { return subtree_list.size(); }
+
+    // all subtree roots, in tree order
+    std::vector<const kdTree_t*> roots() const {
+        std::vector<const kdTree_t*> result;
+        for (uint i=0; i<subtree_list.size(); i++) {
+            result.push_back(subtree_list[i].root);
+        }
+        return result;
+    }
+
+    // One filtering pass on all instances. centroids receives the merged
+    // partial sums; with measured balancing the partition is updated.
+    void iterate(const data_type *centres, uint k, centroid_t *centroids, multi_stats_t *stats);
+
+private:
+
+    struct subtree_t {
+        const kdTree_t *root;
+        double cost;        // estimated node fetches (points before the first pass)
+        uint instance;
+    };
+
+    void collect(const kdTree_t *u, uint depth) {
+        bool leaf = (u->left == 0) && (u->right == 0);
+        if ((depth == 0) || leaf) {
+            subtree_t s;
+            s.root = u;
+            s.cost = (double)u->count;
+            s.instance = 0;
+            subtree_list.push_back(s);
+        } else {
+            collect(u->left, depth-1);
+            collect(u->right, depth-1);
+        }
+    }
+
+    void update(const multi_stats_t &stats);
+    void assign();
+
+    std::vector<hybrid_device*> instances;
+    bool measured;
+    std::vector<subtree_t> subtree_list;
+    std::vector<double> rate;       // node fetches per ms (all equal until measured)
+};
+
+
+void multi_scheduler::iterate(const data_type *centres, uint k, centroid_t *centroids, multi_stats_t *stats)
+{
+    const uint n = instances.size();
+
+    std::vector< std::vector<const kdTree_t*> > roots(n);
+    for (uint i=0; i<subtree_list.size(); i++) {
+        roots[subtree_list[i].instance].push_back(subtree_list[i].root);
+    }
+
+    const double start_time = aocl_utils::getCurrentTimestamp();
+
+    for (uint j=0; j<n; j++) {
+        instances[j]->launch(roots[j], centres, k);
+    }
+
+    for (uint i=0; i<k; i++) {
+        for (uint d=0; d<D; d++) {
+            centroids[i].wgtCent.value[d] = 0;
+        }
+        centroids[i].sum_sq = 0;
+        centroids[i].count = 0;
+    }
+
+    stats->subtrees.assign(n, 0);
+    stats->nodes.assign(n, 0);
+    stats->ms.assign(n, 0.0);
+    stats->total_nodes = 0;
+    stats->lsu.clear();
+
+    // reduce in instance order, so that the result does not depend on timing
+    std::vector<centroid_t> partial(k);
+    for (uint j=0; j<n; j++) {
+        instances[j]->finish(partial.data(), &stats->nodes[j], &stats->ms[j]);
+        stats->lsu.add(instances[j]->lsu_profile());
+        for (uint i=0; i<k; i++) {
+            for (uint d=0; d<D; d++) {
+                centroids[i].wgtCent.value[d] += partial[i].wgtCent.value[d];
+            }
+            centroids[i].sum_sq += partial[i].sum_sq;
+            centroids[i].count += partial[i].count;
+        }
+        stats->subtrees[j] = roots[j].size();
+        stats->total_nodes += stats->nodes[j];
+    }
+
+    stats->wall_ms = (aocl_utils::getCurrentTimestamp() - start_time) * 1e3;
+
+    double max_ms = 0.0;
+    double sum_ms = 0.0;
+    for (uint j=0; j<n; j++) {
+        max_ms = (stats->ms[j] > max_ms) ? stats->ms[j] : max_ms;
+        sum_ms += stats->ms[j];
+    }
+    stats->imbalance = (sum_ms > 0.0) ? max_ms * (double)n / sum_ms : 1.0;
+
+    if (measured) {
+        update(*stats);
+        assign();
+    }
+}
+
+
+// refresh subtree costs and instance throughput from the last iteration
+void multi_scheduler::update(const multi_stats_t &stats)
+{
+    const uint n = instances.size();
+
+    std::vector<double> estimate(n, 0.0);
+    for (uint i=0; i<subtree_list.size(); i++) {
+        estimate[subtree_list[i].instance] += subtree_list[i].cost;
+    }
+    for (uint i=0; i<subtree_list.size(); i++) {
+        const uint j = subtree_list[i].instance;
+        double cost = (estimate[j] > 0.0) ? subtree_list[i].cost * (double)stats.nodes[j] / estimate[j] : subtree_list[i].cost;
+        subtree_list[i].cost = (cost < 1.0) ? 1.0 : cost;
+    }
+
+    for (uint j=0; j<n; j++) {
+        if ((stats.nodes[j] > 0) && (stats.ms[j] > 0.0)) {
+            rate[j] = (double)stats.nodes[j] / stats.ms[j];
+        }
+    }
+}
+
+
+// greedy partition: largest subtree first, to the instance with the earliest predicted finish time
+void multi_scheduler::assign()
+{
+    const uint n = instances.size();
+
+    std::vector<uint> order(subtree_list.size());
+    for (uint i=0; i<order.size(); i++) {
+        order[i] = i;
+    }
+    const std::vector<subtree_t> &s = subtree_list;
+    std::sort(order.begin(), order.end(), [&s](uint a, uint b) { return s[a].cost > s[b].cost; });
+
+    std::vector<double> finish(n, 0.0);
+    std::vector<uint> count(n, 0);
+    for (uint i=0; i<order.size(); i++) {
+        subtree_t &t = subtree_list[order[i]];
+        int best = -1;
+        double best_finish = 0.0;
+        for (uint j=0; j<n; j++) {
+            if (count[j] == HYBRID_MAX_ROOTS) {
+                continue;
+            }
+            double f = finish[j] + t.cost / rate[j];
+            if ((best < 0) || (f < best_finish)) {
+                best = j;
+                best_finish = f;
+            }
+        }
+        t.instance = (best < 0) ? 0 : (uint)best;
+        finish[t.instance] = best_finish;
+        count[t.instance]++;
+    }
+}
+
+
+#endif
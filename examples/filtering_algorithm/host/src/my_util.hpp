@@ -49,9 +49,11 @@ typedef struct __attribute__((packed)) _kdTree_t {
     distance_type sum_sq;
     data_type bnd_lo;
     data_type bnd_hi;
-    uint *idx;
+    uint *idx;                  // indices of the points below the node, idx[0..count-1]
     _kdTree_t *left;
     _kdTree_t *right;
+    uint owner;                 // closest centre, written by filter0 if the node was a dead end of pass owner_pass
+    uint owner_pass;            // 0: never
 } kdTree_t;
 
 
@@ -132,12 +134,12 @@ bool read_data_points(uint n, uint k, double std_dev, data_type* points, uint* i
     return true;
 }
 
-bool read_initial_centres(uint n, uint k, double std_dev, uint* cntr_idx)
+bool read_initial_centres(uint n, uint k, double std_dev, uint* cntr_idx, uint index = 1)
 {
     FILE *fp;
 
     char filename[256];
-    make_initial_centres_file_name(filename,n,k,D,std_dev,1);
+    make_initial_centres_file_name(filename,n,k,D,std_dev,index);
     fp=fopen(filename, "r");
 
     if (!fp)
@@ -9,7 +9,8 @@
 #----------------------------------------------------------------------------------
 export AOCL_BOARD_PACKAGE_ROOT=$ALTERAOCLSDKROOT/board/s5_ref
 echo Setting AOCL_BOARD_PACKAGE_ROOT to $AOCL_BOARD_PACKAGE_ROOT
-aoc -march=emulator -g -v --profile device/filter_stream_opt1.cl -o sim/filter_stream_opt1.aocx --board s5_ref
+# extra kernel defines, e.g. AOC_FLAGS="-DBATCH_SIZE=1 -DSTACK_SIZE=128" makes filter0 spill its stack on a -degenerate tree
+aoc -march=emulator -g -v --profile $AOC_FLAGS device/filter_stream_opt1.cl -o sim/filter_stream_opt1.aocx --board s5_ref
 
 export LD_LIBRARY_PATH=$AOCL_BOARD_PACKAGE_ROOT/linux64/lib:$LD_LIBRARY_PATH
 make -f Makefile_x86 clean
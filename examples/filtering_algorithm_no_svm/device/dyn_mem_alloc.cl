@@ -59,3 +59,96 @@ center_set_pointer_t fused_kernel_conditional_free_malloc(center_set_pointer_t*
 }
 
 
+// Bitmap sets (CENTER_SET_BITMAP). The candidates are taken in index order, like
+// the entries of a list: the lowest set bit, located with a popcount of the bits
+// below it.
+#ifdef CENTER_SET_BITMAP
+
+center_index_t center_set_first(center_set_t s)
+{
+    center_index_t first = 0;
+    bool found = false;
+    #pragma unroll
+    for (uint w=0; w<CENTER_SET_WORDS; w++) {
+        uint x = s.w[w];
+        if (!found && (x != 0)) {
+            first = (w << 5) + popcount((x & (0-x)) - 1);
+            found = true;
+        }
+    }
+    return first;
+}
+
+void center_set_remove(center_set_t *s, center_index_t i)
+{
+    s->w[i >> 5] &= ~(1u << (i & 31));
+}
+
+void center_set_insert(center_set_t *s, center_index_t i)
+{
+    s->w[i >> 5] |= (1u << (i & 31));
+}
+
+void center_set_clear(center_set_t *s)
+{
+    #pragma unroll
+    for (uint w=0; w<CENTER_SET_WORDS; w++) {
+        s->w[w] = 0;
+    }
+}
+
+// centres 0..k-1
+void center_set_all(center_set_t *s, uint k)
+{
+    #pragma unroll
+    for (uint w=0; w<CENTER_SET_WORDS; w++) {
+        uint lo = w << 5;
+        s->w[w] = (k >= lo+32) ? 0xFFFFFFFF : ((k > lo) ? ((1u << (k-lo)) - 1) : 0);
+    }
+}
+
+#endif
+
+
+// Second tier of the centre-set heap: sets are evicted from the on-chip pool to
+// slots of KMAX indices (or a whole bitmap) in a global buffer and loaded back
+// when they are needed again. Slots are handed out with kernel_malloc/kernel_free
+// on their own free list.
+
+#ifdef CENTER_SET_BITMAP
+
+void center_set_spill(center_set_t* pool, center_set_pointer_t address, uint k,
+                      __global uint *restrict tier2, center_set_pointer_t slot)
+{
+    for (uint w=0; w<CENTER_SET_WORDS; w++) {
+        tier2[slot*CENTER_SET_WORDS + w] = pool[address].w[w];
+    }
+}
+
+void center_set_fill(center_set_t* pool, center_set_pointer_t address, uint k,
+                     __global uint *restrict tier2, center_set_pointer_t slot)
+{
+    for (uint w=0; w<CENTER_SET_WORDS; w++) {
+        pool[address].w[w] = tier2[slot*CENTER_SET_WORDS + w];
+    }
+}
+
+#else
+
+void center_set_spill(center_index_t* pool, center_set_pointer_t address, uint k,
+                      __global center_index_t *restrict tier2, center_set_pointer_t slot)
+{
+    for (uint i=0; i<k; i++) {
+        tier2[(slot << KMAX_BITS) + i] = pool[(address << KMAX_BITS) + i];
+    }
+}
+
+void center_set_fill(center_index_t* pool, center_set_pointer_t address, uint k,
+                     __global center_index_t *restrict tier2, center_set_pointer_t slot)
+{
+    for (uint i=0; i<k; i++) {
+        pool[(address << KMAX_BITS) + i] = tier2[(slot << KMAX_BITS) + i];
+    }
+}
+
+#endif
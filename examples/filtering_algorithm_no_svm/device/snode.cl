@@ -32,6 +32,28 @@ int4 data_type_2_vector(data_type d) {
 }
 
 
+// stack_t as a spilled record: u, then c (bits 0-14), d (bit 15) and k (bits 16-31)
+uint2 stack_t_2_vector(stack_t s) {
+    uint2 v;
+
+    v.s0 = s.u;
+    v.s1 = (s.c & 0x7FFF) | ((s.d ? 1 : 0) << 15) | ((uint)s.k << 16);
+
+    return v;
+}
+
+stack_t vector_2_stack_t(uint2 v) {
+    stack_t s;
+
+    s.u = v.s0;
+    s.c = v.s1 & 0x7FFF;
+    s.d = ((v.s1 >> 15) & 0x1) != 0;
+    s.k = v.s1 >> 16;
+
+    return s;
+}
+
+
 kdTree_t vector_2_kdTree_t(uint16 v) {
     kdTree_t tn;
 
@@ -0,0 +1,142 @@
+/**********************************************************************
+* Felix Winterstein, Imperial College London, 2016
+*
+* File: backend.hpp
+*
+* Revision 1.01
+* Additional Comments: distributed under an Apache-2.0 license, see LICENSE
+*
+**********************************************************************/
+
+/*
+ * Compute backends of the no_svm host, selected at run time with
+ * -backend=<name>:
+ *
+ *   fpga       filter0/filter1 on the board (opencl_backend in main.cpp)
+ *   emulator   the same OpenCL path on the AOCL emulator, with the aocx built
+ *              by build_emulation.sh (sets CL_CONTEXT_EMULATOR_DEVICE_ALTERA)
+ *   cpu        the multi-threaded host engine (filter_cpu.hpp), no OpenCL
+ *
+ * A backend owns the memory the kd-tree is built into. tree_storage() hands
+ * it out, tree_chunk() is called for every completed range of nodes while the
+ * build is still running (so a backend may start moving them), prepare() once
+ * the tree is complete. filter() then runs one pass of the filtering algorithm
+ * for a set of centres and returns the per-centre partial sums, which is what
+ * all backends can produce alike; the new centres follow with
+ * filter_cpu::centroids_2_centres. release() frees everything that belongs to
+ * the tree.
+ */
+
+#ifndef BACKEND_H
+#define BACKEND_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include "CL/opencl.h"
+#include "my_util.hpp"
+#include "filter_cpu.hpp"
+
+// named values reported by a backend (same form as trace_t::counter)
+typedef std::vector< std::pair<std::string, double> > backend_counters_t;
+
+// result of one filter() call besides the partial sums
+struct backend_pass_t {
+    cl_ulong visited_nodes;
+    double time_ms;         // pass on the backend (kernels, or the host engine)
+};
+
+
+class filter_backend {
+public:
+    virtual ~filter_backend() {}
+
+    virtual const char *name() const = 0;
+
+    // memory for a tree of the given size, written by buildkdTree
+    virtual cl_uint16 *tree_storage(size_t bytes) = 0;
+
+    // nodes [first, last) will not change any more; only called if streams_tree()
+    virtual bool streams_tree() const { return false; }
+    virtual void tree_chunk(uint first, uint last) {}
+
+    // the tree is complete; root is its root node, used_nodes the number of nodes written
+    virtual void prepare(uint root, uint used_nodes) = 0;
+
+    // One filtering pass with the given centres. centroids receives k partial
+    // sums (wgtCent, sum_sq, count).
+    virtual void filter(const data_type *centres, uint k, centroid_t *centroids, backend_pass_t *pass) = 0;
+
+    // backend specific statistics of the tree and the last pass
+    virtual backend_counters_t counters() const = 0;
+
+    // free the tree and all resources that belong to it
+    virtual void release() = 0;
+};
+
+
+// host engine on the packed tree, for machines without board or SDK
+class cpu_backend : public filter_backend {
+public:
+
+    cpu_backend(uint num_threads, bool simd, bool bitmap) : engine(num_threads, simd, bitmap), tree(NULL), root(0), used_nodes(0) {
+        memset(&stats, 0, sizeof(filter_cpu_stats_t));
+    }
+
+    ~cpu_backend() {
+        release();
+    }
+
+    const char *name() const { return "cpu"; }
+
+    cl_uint16 *tree_storage(size_t bytes) {
+        release();
+        if (posix_memalign((void**)(&tree), 64, bytes) != 0) {
+            tree = NULL;
+        }
+        return tree;
+    }
+
+    void prepare(uint root, uint used_nodes) {
+        this->root = root;
+        this->used_nodes = used_nodes;
+    }
+
+    void filter(const data_type *centres, uint k, centroid_t *centroids, backend_pass_t *pass) {
+        tree_memory_tree_t t(tree);
+        engine.run(t, root, centres, k, centroids, &stats);
+        pass->visited_nodes = stats.visited_nodes;
+        pass->time_ms = stats.time_ms;
+    }
+
+    backend_counters_t counters() const {
+        backend_counters_t c;
+        c.push_back(std::make_pair(std::string("tree nodes"), (double)used_nodes));
+        c.push_back(std::make_pair(std::string("distance evaluations"), (double)stats.distance_evals));
+        c.push_back(std::make_pair(std::string("tooFar checks"), (double)stats.toofar_evals));
+        c.push_back(std::make_pair(std::string("dead ends"), (double)stats.deadends));
+        c.push_back(std::make_pair(std::string("work items stolen"), (double)stats.steals));
+        c.push_back(std::make_pair(std::string("thread balance (%)"), (stats.max_thread_evals > 0) ? (double)stats.distance_evals * 100.0 / ((double)stats.max_thread_evals * (double)engine.threads()) : 0.0));
+        return c;
+    }
+
+    void release() {
+        if (tree != NULL) {
+            free(tree);
+            tree = NULL;
+        }
+    }
+
+private:
+    filter_cpu engine;
+    cl_uint16 *tree;
+    uint root;
+    uint used_nodes;
+    filter_cpu_stats_t stats;
+};
+
+
+#endif
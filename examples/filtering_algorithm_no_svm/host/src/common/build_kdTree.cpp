@@ -12,9 +12,26 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <math.h>
+#include <algorithm>
 #include "build_kdTree.h"
 
 
+// state of buildkdTree_chunked (no callback: plain build)
+static uint chunk_size = 0;
+static uint chunk_first = 0;
+static tree_chunk_callback_t chunk_callback = NULL;
+static void *chunk_arg = NULL;
+
+// report the completed range if it has grown to a full chunk
+static void chunk_written(uint ptr)
+{
+    if ((chunk_callback != NULL) && (ptr+1 - chunk_first >= chunk_size)) {
+        chunk_callback(chunk_first, ptr+1, chunk_arg);
+        chunk_first = ptr+1;
+    }
+}
+
+
 uint buildkdTree(data_type *data_points, uint *idx, uint n, data_type *bnd_lo, data_type *bnd_hi, uint *heap_ptr, cl_uint16 *tree_memory)
 {        
     if (n <= 1) {
@@ -41,6 +58,7 @@ uint buildkdTree(data_type *data_points, uint *idx, uint n, data_type *bnd_lo, d
         uint tmp_ptr = *heap_ptr+1;        
         *heap_ptr = tmp_ptr;  
         tree_memory[tmp_ptr] = leaf_node_conv;           
+        chunk_written(tmp_ptr);
 
         return tmp_ptr;        
 
@@ -93,6 +111,7 @@ uint buildkdTree(data_type *data_points, uint *idx, uint n, data_type *bnd_lo, d
         uint tmp_ptr = *heap_ptr+1;        
         *heap_ptr = tmp_ptr;                  
         tree_memory[tmp_ptr] = int_node_conv;
+        chunk_written(tmp_ptr);
 
         return tmp_ptr;
 
@@ -101,3 +120,93 @@ uint buildkdTree(data_type *data_points, uint *idx, uint n, data_type *bnd_lo, d
 }
 
 
+uint buildkdTree_chunked(data_type *data_points, uint *idx, uint n, data_type *bnd_lo, data_type *bnd_hi, uint *heap_ptr, cl_uint16 *tree_memory,
+                         uint chunk_nodes, tree_chunk_callback_t callback, void *arg)
+{
+    chunk_size = (chunk_nodes > 0) ? chunk_nodes : 1;
+    chunk_first = 0;    // node 0 is unused but uploaded, so that offsets match
+    chunk_callback = callback;
+    chunk_arg = arg;
+
+    uint root = buildkdTree(data_points, idx, n, bnd_lo, bnd_hi, heap_ptr, tree_memory);
+
+    // remainder
+    if (*heap_ptr+1 > chunk_first) {
+        callback(chunk_first, *heap_ptr+1, arg);
+    }
+
+    chunk_callback = NULL;
+    chunk_arg = NULL;
+
+    return root;
+}
+
+
+// leaf holding point idx[i] in the box [bnd_lo, bnd_hi]
+static uint write_chain_leaf(data_type *data_points, uint *idx, uint i, data_type bnd_lo, data_type bnd_hi, uint *heap_ptr, cl_uint16 *tree_memory)
+{
+    kdTree_t leaf_node;
+
+    distance_type tmp_sum_sq = 0;
+    for(uint d=0; d<D; d++) {
+        distance_type tmp = get_coord(data_points,idx,i,d);
+        tmp_sum_sq += tmp*tmp;
+    }
+
+    leaf_node.bnd_hi    = bnd_hi;
+    leaf_node.bnd_lo    = bnd_lo;
+    leaf_node.left      = 0;
+    leaf_node.right     = 0;
+    leaf_node.wgtCent   = data_points[*(idx+i)];
+    leaf_node.sum_sq    = tmp_sum_sq;
+    leaf_node.count     = 1;
+
+    uint tmp_ptr = *heap_ptr+1;
+    *heap_ptr = tmp_ptr;
+    tree_memory[tmp_ptr] = kdTree_t_2_vector(leaf_node);
+    return tmp_ptr;
+}
+
+
+uint buildkdTree_chain(data_type *data_points, uint *idx, uint n, data_type *bnd_lo, data_type *bnd_hi, uint *heap_ptr, cl_uint16 *tree_memory)
+{
+    std::sort(idx, idx+n, [data_points](uint a, uint b) { return data_points[a].value[0] < data_points[b].value[0]; });
+
+    // node m holds the first m points; its box ends where its parent split off point m
+    data_type lo = *bnd_lo;
+    data_type hi = *bnd_hi;
+    hi.value[0] = (n > 1) ? get_coord(data_points,idx,1,0) : bnd_hi->value[0];
+    uint node = write_chain_leaf(data_points, idx, 0, lo, hi, heap_ptr, tree_memory);
+    kdTree_t sub = vector_2_kdTree_t(tree_memory[node]);
+
+    for (uint m=2; m<=n; m++) {
+        data_type node_hi = *bnd_hi;
+        if (m < n) {
+            node_hi.value[0] = get_coord(data_points,idx,m,0);
+        }
+        data_type leaf_lo = *bnd_lo;
+        leaf_lo.value[0] = get_coord(data_points,idx,m-1,0);
+        uint right = write_chain_leaf(data_points, idx, m-1, leaf_lo, node_hi, heap_ptr, tree_memory);
+        kdTree_t leaf = vector_2_kdTree_t(tree_memory[right]);
+
+        kdTree_t int_node;
+        for (uint d=0; d<D; d++) {
+            int_node.wgtCent.value[d] = sub.wgtCent.value[d] + leaf.wgtCent.value[d];
+        }
+        int_node.sum_sq     = sub.sum_sq + leaf.sum_sq;
+        int_node.left       = node;
+        int_node.right      = right;
+        int_node.bnd_hi     = node_hi;
+        int_node.bnd_lo     = *bnd_lo;
+        int_node.count      = m;
+
+        uint tmp_ptr = *heap_ptr+1;
+        *heap_ptr = tmp_ptr;
+        tree_memory[tmp_ptr] = kdTree_t_2_vector(int_node);
+
+        node = tmp_ptr;
+        sub = int_node;
+    }
+
+    return node;
+}
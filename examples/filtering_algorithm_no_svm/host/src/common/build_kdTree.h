@@ -19,6 +19,21 @@ extern "C" {
 
 uint buildkdTree(data_type *data_points, uint *idx, uint n, data_type *bnd_lo, data_type *bnd_hi, uint *heap_ptr, cl_uint16 *tree_memory);
 
+// Nodes are written in post-order and never modified afterwards, so
+// tree_memory[0..heap_ptr] is final at any time. The chunked build reports
+// each completed range [first, last) of at least chunk_nodes nodes (the
+// last one may be shorter) as soon as it is written.
+typedef void (*tree_chunk_callback_t)(uint first, uint last, void *arg);
+
+uint buildkdTree_chunked(data_type *data_points, uint *idx, uint n, data_type *bnd_lo, data_type *bnd_hi, uint *heap_ptr, cl_uint16 *tree_memory,
+                         uint chunk_nodes, tree_chunk_callback_t callback, void *arg);
+
+// Degenerate (linked-list-shaped) tree for testing deep traversals: the
+// points sorted along the first dimension, every inner node of m points splits
+// off point m-1 as its right child (a leaf) and keeps the others in its left
+// child, so the depth is n-1. Reorders idx; nodes are written in post-order.
+uint buildkdTree_chain(data_type *data_points, uint *idx, uint n, data_type *bnd_lo, data_type *bnd_hi, uint *heap_ptr, cl_uint16 *tree_memory);
+
 #ifdef	__cplusplus
 }
 #endif
@@ -0,0 +1,215 @@
+/**********************************************************************
+* Felix Winterstein, Imperial College London, 2016
+*
+* File: trace.hpp
+*
+* Revision 1.01
+* Additional Comments: distributed under an Apache-2.0 license, see LICENSE
+*
+**********************************************************************/
+
+/*
+ * Host/device timeline in Chrome trace event format (load the file in
+ * chrome://tracing or ui.perfetto.dev).
+ *
+ * Host spans are given as getCurrentTimestamp() values. OpenCL commands are
+ * recorded by their cl_event, which is retained and only queried when the
+ * trace is written, so recording never waits for the device. Each command
+ * shows up on the track of its queue as three slices: queued (QUEUED to
+ * SUBMIT), submitted (SUBMIT to START) and the command itself (START to END).
+ * Device timestamps are moved onto the host clock with the smallest observed
+ * difference between the host time at which a command was recorded (right
+ * after its enqueue) and its QUEUED timestamp.
+ *
+ * Until open() is called every entry point returns after testing one flag.
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <mutex>
+
+#include "CL/opencl.h"
+#include "AOCLUtils/aocl_utils.h"
+
+// tracks (Chrome trace "threads")
+#define TRACE_HOST          1
+#define TRACE_DATA          2       // data pipeline (load, bounding box, tree build)
+#define TRACE_HOST_ENGINE   3       // host side of the filtering algorithm
+#define TRACE_QUEUE0        10
+#define TRACE_QUEUE1        11
+#define TRACE_QUEUE2        12
+
+
+class trace_t {
+public:
+
+    trace_t() : enabled(false), offset_valid(false), offset_ns(0.0) {}
+
+    bool is_enabled() const { return enabled; }
+
+    // start recording; the trace is written to file_name by close()
+    void open(const char *file_name) {
+        this->file_name = file_name;
+        enabled = true;
+    }
+
+    // host-side span between two getCurrentTimestamp() values
+    void span(const char *name, int track, double start, double end) {
+        if (!enabled) {
+            return;
+        }
+        std::lock_guard<std::mutex> guard(lock);
+        span_t s = {name, track, start * 1e6, (end - start) * 1e6};
+        spans.push_back(s);
+    }
+
+    // OpenCL command, call right after the enqueue that produced event
+    void command(const char *name, int track, cl_event event) {
+        if (!enabled) {
+            return;
+        }
+        std::lock_guard<std::mutex> guard(lock);
+        clRetainEvent(event);
+        command_t c = {name, track, event, aocl_utils::getCurrentTimestamp()};
+        commands.push_back(c);
+    }
+
+    // counter values (e.g. LSU statistics) at host time ts
+    void counter(const char *name, double ts, const std::vector< std::pair<std::string, double> > &values) {
+        if (!enabled) {
+            return;
+        }
+        std::lock_guard<std::mutex> guard(lock);
+        counter_t c = {name, ts * 1e6, values};
+        counters.push_back(c);
+    }
+
+    // query all recorded commands (they must have completed) and write the trace
+    void close();
+
+private:
+
+    struct span_t {
+        std::string name;
+        int track;
+        double ts_us;
+        double dur_us;
+    };
+
+    struct command_t {
+        std::string name;
+        int track;
+        cl_event event;
+        double recorded;
+    };
+
+    struct counter_t {
+        std::string name;
+        double ts_us;
+        std::vector< std::pair<std::string, double> > values;
+    };
+
+    void write_slice(FILE *fp, bool *first, const std::string &name, const char *cat, int track, double ts_us, double dur_us) {
+        fprintf(fp, "%s\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+                (*first) ? "" : ",", name.c_str(), cat, track, ts_us, (dur_us > 0.0) ? dur_us : 0.0);
+        *first = false;
+    }
+
+    void write_track_name(FILE *fp, bool *first, int track, const char *name) {
+        fprintf(fp, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                (*first) ? "" : ",", track, name);
+        *first = false;
+    }
+
+    bool enabled;
+    std::string file_name;
+    std::mutex lock;
+
+    std::vector<span_t> spans;
+    std::vector<command_t> commands;
+    std::vector<counter_t> counters;
+
+    bool offset_valid;
+    double offset_ns;   // host clock (ns) minus device clock (ns)
+};
+
+
+void trace_t::close()
+{
+    if (!enabled) {
+        return;
+    }
+    enabled = false;
+
+    // profiling timestamps of all commands: QUEUED, SUBMIT, START, END
+    std::vector< std::vector<cl_ulong> > times(commands.size(), std::vector<cl_ulong>(4, 0));
+    const cl_profiling_info info[4] = {CL_PROFILING_COMMAND_QUEUED, CL_PROFILING_COMMAND_SUBMIT, CL_PROFILING_COMMAND_START, CL_PROFILING_COMMAND_END};
+    for (uint i=0; i<commands.size(); i++) {
+        for (uint j=0; j<4; j++) {
+            clGetEventProfilingInfo(commands[i].event, info[j], sizeof(cl_ulong), &times[i][j], NULL);
+        }
+        double offset = commands[i].recorded * 1e9 - (double)times[i][0];
+        if (!offset_valid || (offset < offset_ns)) {
+            offset_ns = offset;
+            offset_valid = true;
+        }
+    }
+
+    FILE *fp = fopen(file_name.c_str(), "w");
+    if (fp == NULL) {
+        printf("Cannot write trace file %s\n", file_name.c_str());
+    } else {
+        bool first = true;
+        fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+
+        write_track_name(fp, &first, TRACE_HOST, "host");
+        write_track_name(fp, &first, TRACE_DATA, "data pipeline");
+        write_track_name(fp, &first, TRACE_HOST_ENGINE, "host engine");
+        write_track_name(fp, &first, TRACE_QUEUE0, "queue0");
+        write_track_name(fp, &first, TRACE_QUEUE1, "queue1");
+        write_track_name(fp, &first, TRACE_QUEUE2, "queue2");
+
+        for (uint i=0; i<spans.size(); i++) {
+            write_slice(fp, &first, spans[i].name, "host", spans[i].track, spans[i].ts_us, spans[i].dur_us);
+        }
+
+        for (uint i=0; i<commands.size(); i++) {
+            double t[4];
+            for (uint j=0; j<4; j++) {
+                t[j] = ((double)times[i][j] + offset_ns) * 1e-3;
+            }
+            write_slice(fp, &first, commands[i].name + " (queued)", "queued", commands[i].track, t[0], t[1] - t[0]);
+            write_slice(fp, &first, commands[i].name + " (submitted)", "submitted", commands[i].track, t[1], t[2] - t[1]);
+            write_slice(fp, &first, commands[i].name, "device", commands[i].track, t[2], t[3] - t[2]);
+        }
+
+        for (uint i=0; i<counters.size(); i++) {
+            fprintf(fp, ",\n{\"name\":\"%s\",\"ph\":\"C\",\"pid\":1,\"ts\":%.3f,\"args\":{", counters[i].name.c_str(), counters[i].ts_us);
+            for (uint j=0; j<counters[i].values.size(); j++) {
+                fprintf(fp, "%s\"%s\":%g", (j == 0) ? "" : ",", counters[i].values[j].first.c_str(), counters[i].values[j].second);
+            }
+            fprintf(fp, "}}");
+        }
+
+        fprintf(fp, "\n]}\n");
+        fclose(fp);
+
+        printf("Trace: %u host spans, %u OpenCL commands, %u counter samples written to %s\n",
+                (uint)spans.size(), (uint)commands.size(), (uint)counters.size(), file_name.c_str());
+    }
+
+    for (uint i=0; i<commands.size(); i++) {
+        clReleaseEvent(commands[i].event);
+    }
+    commands.clear();
+}
+
+
+trace_t trace;
+
+
+#endif
@@ -17,15 +17,39 @@
 #include <mutex>          // std::mutex, std::lock
 #include <atomic>
 #include <pthread.h>
+#include <vector>
 
 #include "../common/my_util.hpp"
 #include "../common/build_kdTree.h"
+#include "../common/trace.hpp"
+#include "../common/filter_cpu.hpp"
+#include "../../../../filtering_algorithm/host/src/batch_occupancy.hpp"
+#include "../common/backend.hpp"
 
 #define N 1024*1024 // number of data points
-#define K 128       // number of centres
+#ifndef K
+#define K 128       // number of centres (-DK=<k>, at most the KMAX of the kernel: 256, or 4096 with CENTER_SET_BITMAP)
+#endif
 #define S 0.08      // standard deviation (determines the clusteredness of the data set)
 
-//#define SHARED_PHYSICAL_MEMORY
+#define TREE_CHUNK_NODES 16384  // nodes per streamed tree upload chunk (1 MB) in copy mode (-chunk=<nodes>, 0: one write after the build)
+#define SPILL_RECORDS    (1<<20) // capacity of filter0's stack spill buffer in records of 8 bytes (-spill-records=<n>)
+#define SET_SPILL_SLOTS  4096    // slots of filter0's second-tier centre-set heap (-set-spill=<slots>, at most CENTER_SET_SPILL_SLOTS of the kernel)
+#define CENTER_SET_SLOT_BYTES 512 // one slot: KMAX=256 one-byte centre indices, or a bitmap of up to 4096 centres (device/dyn_mem_alloc.cl)
+#define STACK_INFO_WORDS 12      // filter0 statistics: stack spills, fills, max depth, overflow, centre sets spilled, filled, fallback nodes, max on chip, batches, batch work, capped, drained
+#define BATCH_WORK       1024    // candidates per filter0 batch to aim for, batch_work of the kernel (-batch-work=<n>, 0: BATCH_SIZE records)
+#define BATCH_OVERHEAD   200     // cycles a batch adds to its candidates in loops 0 and 1, an estimate for the occupancy figure (-batch-overhead=<n>)
+#define SET_BENCH_RUNS   3       // -set-bench: passes per representation and k, best one counts
+#define SET_BENCH_POOL   512     // -set-bench: CENTER_SET_POOL_SIZE for the on-chip storage column
+
+//#define SHARED_PHYSICAL_MEMORY      // default tree placement: build into a mapped CL_MEM_ALLOC_HOST_PTR buffer instead of copying (see -tree=<mode>)
+
+// where the tree lives and how the device gets to see it
+enum tree_placement_t {
+    TREE_COPY,              // host buffer, copied into a device buffer with clEnqueueWriteBuffer
+    TREE_ALLOC_HOST_PTR,    // built straight into a mapped CL_MEM_ALLOC_HOST_PTR buffer
+    TREE_USE_HOST_PTR       // built into an aligned host buffer wrapped by CL_MEM_USE_HOST_PTR
+};
 
 using namespace aocl_utils;
 
@@ -36,28 +60,53 @@ cl_context context = NULL;
 cl_program program = NULL;
 cl_command_queue queue0;
 cl_command_queue queue1;
+cl_command_queue queue2;    // tree upload
 cl_kernel kernel0 = NULL; 
 cl_kernel kernel1 = NULL; 
 
 cl_mem tree_memory_buf;
-cl_mem initial_centers_buf;
 
 
-cl_mem visited_nodes_buf; 
-cl_mem new_centers_buf; 
-cl_mem distortion_buf; 
-
+// streamed tree upload (copy mode): one non-blocking write on queue2 per completed chunk
+struct tree_upload_t {
+    std::vector<cl_event> events;
+    size_t bytes;
+};
 
 // Function prototypes
 bool init_opencl();
 void run();
+cl_uint16 *place_tree_memory(size_t bytes, size_t *bytes_shared);
+void tree_chunk_ready(uint first, uint last, void *arg);
+void upload_tree_chunk(uint first, uint last, void *arg);
+void publish_tree_memory(uint used_nodes, tree_upload_t *upload, cl_event *event, size_t *bytes_copied);
+void bench_candidate_sets(const cl_uint16 *tree, uint root);
 void cleanup();
 
+#ifndef SHARED_PHYSICAL_MEMORY
+tree_placement_t tree_placement = TREE_COPY;
+#else
+tree_placement_t tree_placement = TREE_ALLOC_HOST_PTR;
+#endif
+uint tree_chunk_nodes = TREE_CHUNK_NODES;
+
 cl_uint16 *tree_memory;
-cl_int4 *initial_centers;
-cl_uint *visited_nodes;
-cl_int4 *new_centers;
-cl_uint *distortion;
+cl_uint16 *tree_memory_host = NULL; // host allocation behind tree_memory (copy and USE_HOST_PTR modes)
+
+// compute backend (backend.hpp), -backend=<fpga|emulator|cpu>
+filter_backend *backend = NULL;
+uint cpu_threads        = 0;    // cpu backend: 0 = one thread per core
+bool cpu_simd           = true; // cpu backend: SIMD candidate evaluation (-scalar to disable)
+bool cpu_bitmap         = false;// cpu backend: bitmap candidate sets instead of index lists (-bitmap-sets)
+bool set_bench          = false;// -set-bench: host engine throughput with both candidate-set representations over k
+bool verify_cpu         = false;// -verify: compare the pass with the host engine on the same tree
+
+// filter0 spills the bottom of its traversal stack and centre sets to device buffers (filter_stream_opt1.cl)
+uint spill_records      = SPILL_RECORDS;
+uint set_spill_slots    = SET_SPILL_SLOTS;
+uint batch_work         = BATCH_WORK;
+uint batch_overhead     = BATCH_OVERHEAD;
+uint degenerate_points  = 0;    // -degenerate=<points>: linked-list-shaped tree over the first points (buildkdTree_chain)
 
 uint root;
 data_type *data_points  = NULL;
@@ -65,6 +114,52 @@ uint *index_arr         = NULL;
 uint *cntr_idx          = NULL;
 
 
+// filter0/filter1 through OpenCL, on the board or on the AOCL emulator. The
+// tree is placed according to tree_placement; in copy mode completed chunks
+// are uploaded on queue2 while the build goes on.
+class opencl_backend : public filter_backend {
+public:
+
+    opencl_backend(bool emulator);
+
+    const char *name() const { return emulator ? "emulator" : "fpga"; }
+
+    cl_uint16 *tree_storage(size_t bytes);
+    void tree_chunk(uint first, uint last);
+    bool streams_tree() const { return tree_placement == TREE_COPY; }
+    void prepare(uint root, uint used_nodes);
+    void filter(const data_type *centres, uint k, centroid_t *centroids, backend_pass_t *pass);
+    backend_counters_t counters() const;
+    void release();
+
+private:
+    bool emulator;
+
+    cl_mem initial_centers_buf;
+    cl_mem visited_nodes_buf;
+    cl_mem new_centers_buf;
+    cl_mem distortion_buf;
+    cl_mem partial_sums_buf;
+    cl_mem spill_stack_buf;
+    cl_mem stack_info_buf;
+    cl_mem set_spill_buf;
+
+    cl_int4 *initial_centers;
+    cl_uint *visited_nodes;
+    cl_uint *distortion;
+    cl_int4 *partial_sums;
+    cl_uint *stack_info;        // filter0 statistics of the last pass (STACK_INFO_WORDS)
+
+    tree_upload_t upload;
+    cl_event tree_event;        // tree copied or unmapped
+    uint used_nodes;
+    uint chunks_done;           // upload chunks complete when the build finished
+    uint passes;
+    size_t bytes_copied;
+    size_t bytes_shared;
+    double first_chunk_to_kernel_ms;
+    double last_chunk_to_kernel_ms;
+};
 
 
 // Entry point.
@@ -76,6 +171,66 @@ int main(int argc, char **argv) {
     const uint k = K;
     const double std_dev = S;
 
+    if (options.has("tree")) {
+        std::string mode = options.get<std::string>("tree");
+        if (mode == "copy") {
+            tree_placement = TREE_COPY;
+        } else if (mode == "alloc") {
+            tree_placement = TREE_ALLOC_HOST_PTR;
+        } else if (mode == "use") {
+            tree_placement = TREE_USE_HOST_PTR;
+        } else {
+            printf("Unknown tree placement '%s' (copy, alloc or use)\n", mode.c_str());
+            return -1;
+        }
+    }
+    if (options.has("chunk")) {
+        tree_chunk_nodes = options.get<uint>("chunk");
+    }
+    if (options.has("trace")) {
+        trace.open(options.get<std::string>("trace").c_str());
+    }
+    std::string backend_name = "fpga";
+    if (options.has("backend")) {
+        backend_name = options.get<std::string>("backend");
+    }
+    if (options.has("threads")) {
+        cpu_threads = options.get<uint>("threads");
+    }
+    if (options.has("scalar")) {
+        cpu_simd = false;
+    }
+    if (options.has("bitmap-sets")) {
+        cpu_bitmap = true;
+    }
+    if (options.has("set-bench")) {
+        set_bench = true;
+    }
+    if (options.has("verify")) {
+        verify_cpu = true;
+    }
+    if (options.has("spill-records")) {
+        spill_records = options.get<uint>("spill-records");
+    }
+    if (options.has("set-spill")) {
+        set_spill_slots = options.get<uint>("set-spill");
+    }
+    if (options.has("batch-work")) {
+        batch_work = options.get<uint>("batch-work");
+    }
+    if (options.has("batch-overhead")) {
+        batch_overhead = options.get<uint>("batch-overhead");
+    }
+    if (options.has("degenerate")) {
+        degenerate_points = options.get<uint>("degenerate");
+    }
+    if ((backend_name != "fpga") && (backend_name != "emulator") && (backend_name != "cpu")) {
+        printf("Unknown backend '%s' (fpga, emulator or cpu)\n", backend_name.c_str());
+        return -1;
+    }
+
+    const double start_load_time = getCurrentTimestamp();
+
     // input data points
     data_points = new data_type[N];
 
@@ -95,10 +250,25 @@ int main(int argc, char **argv) {
         return -1;
     }
 
-    // Initialize OpenCL.
-    if(!init_opencl()) {
-        printf("OpenCL initialization failed\n");
-        return -1;
+    const double start_opencl_time = getCurrentTimestamp();
+    trace.span("data load", TRACE_DATA, start_load_time, start_opencl_time);
+
+    if (backend_name == "cpu") {
+        backend = new cpu_backend(cpu_threads, cpu_simd, cpu_bitmap);
+    } else {
+        // the emulator device is only listed by the runtime if this is set (see run_emulation.sh)
+        if (backend_name == "emulator") {
+            setenv("CL_CONTEXT_EMULATOR_DEVICE_ALTERA", "1", 1);
+        }
+
+        // Initialize OpenCL.
+        if(!init_opencl()) {
+            printf("OpenCL initialization failed\n");
+            return -1;
+        }
+        trace.span("init_opencl", TRACE_HOST, start_opencl_time, getCurrentTimestamp());
+
+        backend = new opencl_backend(backend_name == "emulator");
     }
 
 
@@ -115,6 +285,50 @@ int main(int argc, char **argv) {
 
 
 
+// Host engine with index-list and bitmap candidate sets on the same tree, for a
+// range of k (centres sampled evenly from the data points). The storage columns
+// are the bytes of one set in filter0's pool with the smallest KMAX that holds k,
+// and of the whole pool of SET_BENCH_POOL sets.
+void bench_candidate_sets(const cl_uint16 *tree, uint root) {
+    const uint ks[5] = {16, 64, 256, 1024, 4096};
+    tree_memory_tree_t t(tree);
+
+    filter_cpu probe(cpu_threads, cpu_simd);
+    printf("candidate sets: %u threads, %s\n", probe.threads(), probe.isa());
+    printf("%6s %8s %12s %14s %10s %12s %10s\n", "k", "sets", "time (ms)", "nodes/ms", "cands/node", "bytes/set", "pool (KB)");
+    for (uint j=0; j<5; j++) {
+        const uint kb = ks[j];
+        if (kb > N) {
+            break;
+        }
+        std::vector<data_type> centres(kb);
+        for (uint i=0; i<kb; i++) {
+            centres[i] = data_points[(uint)(((cl_ulong)i * N) / kb)];
+        }
+        std::vector<centroid_t> centroids(kb);
+
+        uint kmax = 256;
+        while (kmax < kb) {
+            kmax <<= 1;
+        }
+
+        for (uint bitmap=0; bitmap<2; bitmap++) {
+            filter_cpu engine(cpu_threads, cpu_simd, bitmap != 0);
+            filter_cpu_stats_t stats;
+            double best_ms = 0.0;
+            for (uint r=0; r<SET_BENCH_RUNS; r++) {
+                engine.run(t, root, centres.data(), kb, centroids.data(), &stats);
+                best_ms = ((r == 0) || (stats.time_ms < best_ms)) ? stats.time_ms : best_ms;
+            }
+            const uint set_bytes = (bitmap) ? kmax/8 : kmax*((kmax <= 256) ? 1 : 2);
+            printf("%6u %8s %12.3f %14.0f %10.2f %12u %10.1f\n", kb, engine.sets(), best_ms,
+                   (double)stats.visited_nodes / best_ms, (double)stats.distance_evals / (double)stats.visited_nodes,
+                   set_bytes, (double)set_bytes * SET_BENCH_POOL / 1024.0);
+        }
+    }
+}
+
+
 // Initializes the OpenCL objects.
 bool init_opencl() {
     cl_int status;
@@ -165,6 +379,9 @@ bool init_opencl() {
     queue1 = clCreateCommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE, &status);
     checkError(status, "Failed to create command queue");
 
+    queue2 = clCreateCommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE, &status);
+    checkError(status, "Failed to create command queue");
+
 
     // Kernels
     const char *kernel0_name = "filter0";
@@ -186,60 +403,175 @@ void run() {
 
     const uint k = K;
 
-    cl_int status;
-
-    printf("Launching device\n");
+    printf("Launching %s backend\n", backend->name());
 
     const double start_datasetup_time = getCurrentTimestamp();
 
+    // -degenerate: a chain over the first points instead of the balanced tree
+    const uint n_tree = ((degenerate_points > 0) && (degenerate_points < N)) ? degenerate_points : N;
+
     data_type bnd_lo, bnd_hi;   
     //compute axis-aligned hyper rectangle enclosing all data points
-    compute_bounding_box(data_points, index_arr, N, &bnd_lo, &bnd_hi);
+    compute_bounding_box(data_points, index_arr, n_tree, &bnd_lo, &bnd_hi);
     
-    // build up data structure
-    root = 0;       
+    const double start_build_time = getCurrentTimestamp();
+    trace.span("bounding box", TRACE_DATA, start_datasetup_time, start_build_time);
 
+    // build up data structure, directly into the memory the backend will read
+    root = 0;       
 
-    #ifndef SHARED_PHYSICAL_MEMORY
-    posix_memalign ((void**)(&tree_memory), 64, 2*N*sizeof(cl_uint16));
-    #else
-    tree_memory_buf= clCreateBuffer(context, CL_MEM_ALLOC_HOST_PTR, 2*N*sizeof(cl_uint16), NULL, &status);
-    checkError(status, "Failed to create buffer for input");
-    tree_memory = (cl_uint16*) clEnqueueMapBuffer(queue0, tree_memory_buf, CL_TRUE, CL_MAP_READ, 0, 2*N*sizeof(cl_uint16), 0, NULL, NULL, NULL);
-    #endif
+    const size_t tree_bytes = 2*N*sizeof(cl_uint16);
+    tree_memory = backend->tree_storage(tree_bytes);
+
+    // completed parts of the tree are handed to the backend while the rest is being built
+    if (degenerate_points > 0) {
+        buildkdTree_chain(data_points,index_arr,n_tree, &bnd_lo, &bnd_hi, &root, tree_memory);
+        printf("Degenerate kd-tree: %u points, depth %u\n", n_tree, n_tree-1);
+    } else if (backend->streams_tree() && (tree_chunk_nodes > 0)) {
+        buildkdTree_chunked(data_points,index_arr,N, &bnd_lo, &bnd_hi, &root, tree_memory, tree_chunk_nodes, tree_chunk_ready, backend);
+    } else {
+        buildkdTree(data_points,index_arr,N, &bnd_lo, &bnd_hi, &root, tree_memory);
+    }
 
-    buildkdTree(data_points,index_arr,N, &bnd_lo, &bnd_hi, &root, tree_memory);
+    trace.span("tree build", TRACE_DATA, start_build_time, getCurrentTimestamp());
 
-    // Launch the problem for each device.
-    cl_event kernel0_event;
-    cl_event kernel1_event;
-    cl_event finish_event;    
+    // nodes are allocated in post-order, the root is the last one
+    const uint used_nodes = root+1;
 
     // sample initial centers from data points 
-    posix_memalign ((void**)(&initial_centers), 64, K*sizeof(cl_int4));
+    data_type centres[K];
     for (uint i=0; i<k; i++) {
-        initial_centers[i] = data_type_2_vector(data_points[cntr_idx[i]]);
+        centres[i] = data_points[cntr_idx[i]];
     }    
 
-    posix_memalign ((void**)(&visited_nodes), 64, 1*sizeof(cl_uint));
-    posix_memalign ((void**)(&new_centers), 64, K*sizeof(cl_int4));
-    posix_memalign ((void**)(&distortion), 64, K*sizeof(cl_uint));
-
+    // host reference, before prepare() hands the tree to the device (the zero-copy modes unmap it)
+    centroid_t reference[K];
+    if (verify_cpu) {
+        filter_cpu engine(cpu_threads, cpu_simd, cpu_bitmap);
+        filter_cpu_stats_t stats;
+        tree_memory_tree_t t(tree_memory);
+        engine.run(t, root, centres, k, reference, &stats);
+    }
+    if (set_bench) {
+        bench_candidate_sets(tree_memory, root);
+    }
 
     const double start_buffer_time = getCurrentTimestamp(); 
 
+    backend->prepare(root, used_nodes);
+
+    const double start_kernel_time = getCurrentTimestamp();
+    trace.span("buffer setup", TRACE_HOST, start_buffer_time, start_kernel_time);
+
+    centroid_t centroids[K];
+    backend_pass_t pass;
+    backend->filter(centres, k, centroids, &pass);
+
+    const double end_time = getCurrentTimestamp();
+
+    std::vector<cl_int4> new_centers(K);
+    std::vector<cl_uint> distortion(K);
+    filter_cpu::centroids_2_centres(centroids, k, new_centers.data(), distortion.data());
+
+    std::vector< std::pair<std::string, double> > values;
+    values.push_back(std::make_pair(std::string("visited nodes"), (double)pass.visited_nodes));
+    trace.counter("filter0", end_time, values);
+
+    printf("visited nodes: %llu\n", (unsigned long long)pass.visited_nodes);
+
+    if (verify_cpu) {
+        cl_int4 ref_centers[K];
+        cl_uint ref_distortion[K];
+        filter_cpu::centroids_2_centres(reference, k, ref_centers, ref_distortion);
+        uint mismatches = 0;
+        for (uint i=0; i<k; i++) {
+            bool match = (ref_distortion[i] == distortion[i]);
+            for (uint d=0; d<4; d++) {
+                match = match && (ref_centers[i].s[d] == new_centers[i].s[d]);
+            }
+            mismatches += (match) ? 0 : 1;
+        }
+        printf("cpu reference: mismatching centres: %u\n", mismatches);
+    }
+
+    printf("new centers:\n");
+    for (uint i=0; i<k; i++) {
+        data_type c = vector_2_data_type(new_centers[i]);        
+        printf("%3u: ", i); 
+        for (uint d=0; d<D; d++) {
+            printf("%8d ", c.value[d]);
+        }
+        printf(" (distortion: %12u)\n",distortion[i]);
+    }
+
+    // Wall-clock time taken.
+    printf("\nData setup to end: %0.3f ms\n", (end_time - start_datasetup_time) * 1e3);
+    printf("Buffer setup to end: %0.3f ms\n", (end_time - start_buffer_time) * 1e3);
+    printf("Kernel enqueue to end: %0.3f ms\n", (end_time - start_kernel_time) * 1e3);
+    printf("Kernel time (%s): %0.3f ms\n", backend->name(), pass.time_ms);
+
+    const backend_counters_t counters = backend->counters();
+    for (uint i=0; i<counters.size(); i++) {
+        printf("%s: %.3f\n", counters[i].first.c_str(), counters[i].second);
+    }
+}
+
+
+// Callback of buildkdTree_chunked, arg is the backend.
+void tree_chunk_ready(uint first, uint last, void *arg) {
+    ((filter_backend*)arg)->tree_chunk(first, last);
+}
+
+
+opencl_backend::opencl_backend(bool emulator) : emulator(emulator), initial_centers_buf(NULL), visited_nodes_buf(NULL),
+        new_centers_buf(NULL), distortion_buf(NULL), partial_sums_buf(NULL), spill_stack_buf(NULL), stack_info_buf(NULL), set_spill_buf(NULL),
+        initial_centers(NULL), visited_nodes(NULL), distortion(NULL), partial_sums(NULL), stack_info(NULL), tree_event(NULL), used_nodes(0), chunks_done(0), passes(0),
+        bytes_copied(0), bytes_shared(0), first_chunk_to_kernel_ms(0.0), last_chunk_to_kernel_ms(0.0) {
+    upload.bytes = 0;
+}
+
+
+cl_uint16 *opencl_backend::tree_storage(size_t bytes) {
+    const char *placement_name[] = {"copy", "CL_MEM_ALLOC_HOST_PTR", "CL_MEM_USE_HOST_PTR"};
+    printf("Tree placement: %s\n", placement_name[tree_placement]);
+    return place_tree_memory(bytes, &bytes_shared);
+}
+
+
+void opencl_backend::tree_chunk(uint first, uint last) {
+    upload_tree_chunk(first, last, &upload);
+}
+
+
+// Publish the tree, create the centre and result buffers and bind the kernel
+// arguments that stay the same for all passes.
+void opencl_backend::prepare(uint root, uint used_nodes) {
+
+    cl_int status;
+
+    this->used_nodes = used_nodes;
+
+    // upload progress at the end of the build
+    chunks_done = 0;
+    for (uint i=0; i<upload.events.size(); i++) {
+        cl_int event_status;
+        clGetEventInfo(upload.events[i], CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(cl_int), &event_status, NULL);
+        chunks_done += (event_status == CL_COMPLETE) ? 1 : 0;
+    }
+
+    posix_memalign ((void**)(&initial_centers), 64, K*sizeof(cl_int4));
+    posix_memalign ((void**)(&visited_nodes), 64, 1*sizeof(cl_uint));
+    posix_memalign ((void**)(&distortion), 64, K*sizeof(cl_uint));
+    posix_memalign ((void**)(&partial_sums), 64, K*sizeof(cl_int4));
+    posix_memalign ((void**)(&stack_info), 64, STACK_INFO_WORDS*sizeof(cl_uint));
+    memset(stack_info, 0, STACK_INFO_WORDS*sizeof(cl_uint));
+
     // Input buffers.
     initial_centers_buf= clCreateBuffer(context, CL_MEM_READ_ONLY /*| CL_MEM_USE_HOST_PTR*/, K*sizeof(cl_int4), /*initial_centers*/ NULL, &status);
     checkError(status, "Failed to create buffer for input");
 
-    #ifndef SHARED_PHYSICAL_MEMORY
-    tree_memory_buf= clCreateBuffer(context, CL_MEM_READ_ONLY /*| CL_MEM_USE_HOST_PTR*/, 2*N*sizeof(cl_uint16), /*tree_memory*/ NULL, &status);
-    checkError(status, "Failed to create buffer for input");
-    #endif
-
     // Output buffers
 
-
     visited_nodes_buf = clCreateBuffer(context, CL_MEM_WRITE_ONLY /*| CL_MEM_USE_HOST_PTR*/, 1 * sizeof(cl_uint), NULL, &status);
     checkError(status, "Failed to create buffer for output");
 
@@ -249,22 +581,24 @@ void run() {
     distortion_buf = clCreateBuffer(context, CL_MEM_WRITE_ONLY /*| CL_MEM_USE_HOST_PTR*/, K * sizeof(cl_uint), NULL, &status);
     checkError(status, "Failed to create buffer for output");   
 
-    #ifndef SHARED_PHYSICAL_MEMORY
-    cl_event write_event[2];
+    partial_sums_buf = clCreateBuffer(context, CL_MEM_WRITE_ONLY, K * sizeof(cl_int4), NULL, &status);
+    checkError(status, "Failed to create buffer for output");   
 
-    status = clEnqueueWriteBuffer(queue0, tree_memory_buf, CL_FALSE, 0, 2*N*sizeof(cl_uint16), tree_memory, 0, NULL, &write_event[0]);
-    checkError(status, "Failed to transfer input");
+    // filter0's stack below the on-chip part, and its statistics
+    spill_stack_buf = clCreateBuffer(context, CL_MEM_READ_WRITE, (size_t)spill_records * sizeof(cl_uint2), NULL, &status);
+    checkError(status, "Failed to create buffer for the stack spill region");
 
-    status = clEnqueueWriteBuffer(queue0, initial_centers_buf, CL_FALSE, 0, K*sizeof(cl_int4), initial_centers, 0, NULL, &write_event[1]);
-    checkError(status, "Failed to transfer input");
-    #else
-    cl_event write_event[1];
+    stack_info_buf = clCreateBuffer(context, CL_MEM_READ_WRITE, STACK_INFO_WORDS * sizeof(cl_uint), NULL, &status);
+    checkError(status, "Failed to create buffer for output");   
 
-    status = clEnqueueWriteBuffer(queue0, initial_centers_buf, CL_FALSE, 0, K*sizeof(cl_int4), initial_centers, 0, NULL, &write_event[0]);
-    checkError(status, "Failed to transfer input");
-    #endif
+    // second tier of filter0's centre-set heap (at least one slot, the buffer must not be empty)
+    set_spill_buf = clCreateBuffer(context, CL_MEM_READ_WRITE, (size_t)((set_spill_slots > 0) ? set_spill_slots : 1) * CENTER_SET_SLOT_BYTES, NULL, &status);
+    checkError(status, "Failed to create buffer for the centre-set spill region");
+
+    // tree: copy or unmap
+    publish_tree_memory(used_nodes, &upload, &tree_event, &bytes_copied);
 
-    // Set kernel arguments.
+    // Set kernel arguments (k is set per pass).
     unsigned argi;
 
     // kernel0
@@ -273,8 +607,7 @@ void run() {
     status = clSetKernelArg(kernel0, argi++, sizeof(cl_uint), (void*)&root);
     checkError(status, "Failed to set argument %d", argi - 1);
 
-    status = clSetKernelArg(kernel0, argi++, sizeof(cl_uint), (void*)&k);
-    checkError(status, "Failed to set argument %d", argi - 1);
+    argi++;
 
     status = clSetKernelArg(kernel0, argi++, sizeof(cl_mem), &tree_memory_buf);
     checkError(status, "Failed to set argument %d", argi - 1);
@@ -285,96 +618,306 @@ void run() {
     status = clSetKernelArg(kernel0, argi++, sizeof(cl_mem), &visited_nodes_buf);
     checkError(status, "Failed to set argument %d", argi - 1);
 
-   
-    // kernel1
-    argi = 0;
+    status = clSetKernelArg(kernel0, argi++, sizeof(cl_mem), &spill_stack_buf);
+    checkError(status, "Failed to set argument %d", argi - 1);
+
+    status = clSetKernelArg(kernel0, argi++, sizeof(cl_uint), (void*)&spill_records);
+    checkError(status, "Failed to set argument %d", argi - 1);
+
+    status = clSetKernelArg(kernel0, argi++, sizeof(cl_mem), &stack_info_buf);
+    checkError(status, "Failed to set argument %d", argi - 1);
+
+    status = clSetKernelArg(kernel0, argi++, sizeof(cl_mem), &set_spill_buf);
+    checkError(status, "Failed to set argument %d", argi - 1);
 
-    status = clSetKernelArg(kernel1, argi++, sizeof(cl_uint), (void*)&k);
+    status = clSetKernelArg(kernel0, argi++, sizeof(cl_uint), (void*)&set_spill_slots);
     checkError(status, "Failed to set argument %d", argi - 1);
 
+    status = clSetKernelArg(kernel0, argi++, sizeof(cl_uint), (void*)&batch_work);
+    checkError(status, "Failed to set argument %d", argi - 1);
+
+   
+    // kernel1
+    argi = 1;
+
     status = clSetKernelArg(kernel1, argi++, sizeof(cl_mem), &new_centers_buf);
     checkError(status, "Failed to set argument %d", argi - 1);
 
     status = clSetKernelArg(kernel1, argi++, sizeof(cl_mem), &distortion_buf);
     checkError(status, "Failed to set argument %d", argi - 1);
-    
 
-    const double start_kernel_time = getCurrentTimestamp();
+    status = clSetKernelArg(kernel1, argi++, sizeof(cl_mem), &partial_sums_buf);
+    checkError(status, "Failed to set argument %d", argi - 1);
+}
+
+
+void opencl_backend::filter(const data_type *centres, uint k, centroid_t *centroids, backend_pass_t *pass) {
+
+    cl_int status;
+
+    for (uint i=0; i<k; i++) {
+        initial_centers[i] = data_type_2_vector(centres[i]);
+    }
+
+    // centres: copy (event 0), tree: published by prepare() (event 1)
+    cl_event write_event[2];
+
+    status = clEnqueueWriteBuffer(queue0, initial_centers_buf, CL_FALSE, 0, k*sizeof(cl_int4), initial_centers, 0, NULL, &write_event[0]);
+    checkError(status, "Failed to transfer input");
+    trace.command("write centres", TRACE_QUEUE0, write_event[0]);
+    bytes_copied += k*sizeof(cl_int4);
+    write_event[1] = tree_event;
+
+    // filter0 adds to its stack statistics; queue0 is in order, so this completes before the kernel starts
+    memset(stack_info, 0, STACK_INFO_WORDS*sizeof(cl_uint));
+    status = clEnqueueWriteBuffer(queue0, stack_info_buf, CL_FALSE, 0, STACK_INFO_WORDS*sizeof(cl_uint), stack_info, 0, NULL, NULL);
+    checkError(status, "Failed to transfer input");
 
+    status = clSetKernelArg(kernel0, 1, sizeof(cl_uint), (void*)&k);
+    checkError(status, "Failed to set argument %d", 1);
+
+    status = clSetKernelArg(kernel1, 0, sizeof(cl_uint), (void*)&k);
+    checkError(status, "Failed to set argument %d", 0);
 
     // Enqueue kernel.
     //
     // Events are used to ensure that the kernel is not launched until
     // the writes to the input buffers have completed.
+    cl_event kernel0_event;
+    cl_event kernel1_event;
+    cl_event read_event[4];
 
     status = clEnqueueTask(queue1, kernel1, 0, NULL, &kernel1_event);
     checkError(status, "Failed to launch kernel 1");   
+    trace.command("filter1", TRACE_QUEUE1, kernel1_event);
 
-    #ifndef SHARED_PHYSICAL_MEMORY
     status = clEnqueueTask(queue0, kernel0, 2, write_event, &kernel0_event);
     checkError(status, "Failed to launch kernel 0");   
-    #else
-    status = clEnqueueTask(queue0, kernel0, 1, write_event, &kernel0_event);
-    checkError(status, "Failed to launch kernel 0");   
-    #endif
+    trace.command("filter0", TRACE_QUEUE0, kernel0_event);
 
     const double start_readout_time = getCurrentTimestamp(); 
 
-    status = clEnqueueReadBuffer(queue0, visited_nodes_buf, CL_FALSE, 0, 1*sizeof(cl_uint), visited_nodes, 1, &kernel0_event, &finish_event);
+    status = clEnqueueReadBuffer(queue0, visited_nodes_buf, CL_FALSE, 0, 1*sizeof(cl_uint), visited_nodes, 1, &kernel0_event, &read_event[0]);
     checkError(status, "Failed to transfer output"); 
 
-    status = clEnqueueReadBuffer(queue1, new_centers_buf, CL_FALSE, 0, K*sizeof(cl_int4), new_centers, 1, &kernel1_event, &finish_event);
+    status = clEnqueueReadBuffer(queue0, stack_info_buf, CL_FALSE, 0, STACK_INFO_WORDS*sizeof(cl_uint), stack_info, 1, &kernel0_event, &read_event[3]);
+    checkError(status, "Failed to transfer output");
+
+    status = clEnqueueReadBuffer(queue1, partial_sums_buf, CL_FALSE, 0, k*sizeof(cl_int4), partial_sums, 1, &kernel1_event, &read_event[1]);
     checkError(status, "Failed to transfer output"); 
 
-    status = clEnqueueReadBuffer(queue1, distortion_buf, CL_FALSE, 0, K*sizeof(cl_uint), distortion, 1, &kernel1_event, &finish_event);
+    status = clEnqueueReadBuffer(queue1, distortion_buf, CL_FALSE, 0, k*sizeof(cl_uint), distortion, 1, &kernel1_event, &read_event[2]);
     checkError(status, "Failed to transfer output");  
 
+    trace.command("read visited nodes", TRACE_QUEUE0, read_event[0]);
+    trace.command("read partial sums", TRACE_QUEUE1, read_event[1]);
+    trace.command("read distortion", TRACE_QUEUE1, read_event[2]);
+
+    bytes_copied += 1*sizeof(cl_uint) + k*sizeof(cl_int4) + k*sizeof(cl_uint);
+
     // Wait for all devices to finish.
-    clWaitForEvents(1, &finish_event);
+    clWaitForEvents(4, read_event);
     clWaitForEvents(1, &kernel0_event);
     clWaitForEvents(1, &kernel1_event);
-   
-    const double end_time = getCurrentTimestamp();
 
-    printf("visited nodes: %d\n",visited_nodes[0]);
+    trace.span("wait", TRACE_HOST, start_readout_time, getCurrentTimestamp());
 
-    printf("new centers:\n");
-    for (uint i=0; i<k; i++) {
-        data_type c = vector_2_data_type(new_centers[i]);        
-        printf("%3u: ", i); 
-        for (uint d=0; d<D; d++) {
-            printf("%8d ", c.value[d]);
-        }
-        printf(" (distortion: %12u)\n",distortion[i]);
+    if (stack_info[3] != 0) {
+        printf("ERROR: filter0 stack spill buffer full (%u records), traversal cut short: raise -spill-records\n", spill_records);
     }
 
-    // Wall-clock time taken.
-    printf("\nData setup to end: %0.3f ms\n", (end_time - start_datasetup_time) * 1e3);
-    printf("Buffer setup to end: %0.3f ms\n", (end_time - start_buffer_time) * 1e3);
-    printf("Kernel enqueue to end: %0.3f ms\n", (end_time - start_kernel_time) * 1e3);
-    printf("Buffer readout to end: %0.3f ms\n", (end_time - start_readout_time) * 1e3);
+    for (uint i=0; i<k; i++) {
+        centroids[i].wgtCent = vector_2_data_type(partial_sums[i]);
+        centroids[i].sum_sq = distortion[i];
+        centroids[i].count = partial_sums[i].s[3];
+    }
 
     // Get kernel times using the OpenCL event profiling API.
-    cl_ulong time_ns = getStartEndTime(kernel0_event);
-    printf("Kernel time (device %d): %0.3f ms\n", 0, double(time_ns) * 1e-6);
-
+    pass->visited_nodes = visited_nodes[0];
+    pass->time_ms = double(getStartEndTime(kernel0_event)) * 1e-6;
+
+    // span from the first/last tree chunk's start/end to the first kernel's start
+    if ((passes == 0) && !upload.events.empty()) {
+        cl_ulong first_start, last_end, kernel_start;
+        clGetEventProfilingInfo(upload.events.front(), CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &first_start, NULL);
+        clGetEventProfilingInfo(upload.events.back(), CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &last_end, NULL);
+        clGetEventProfilingInfo(kernel0_event, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &kernel_start, NULL);
+        first_chunk_to_kernel_ms = double(kernel_start - first_start) * 1e-6;
+        last_chunk_to_kernel_ms = double(kernel_start - last_end) * 1e-6;
+    }
+    passes++;
 
     // Release all events.  
     clReleaseEvent(write_event[0]);
-    #ifndef SHARED_PHYSICAL_MEMORY
-    clReleaseEvent(write_event[1]);
-    #endif
     clReleaseEvent(kernel1_event);
     clReleaseEvent(kernel0_event);
-    clReleaseEvent(finish_event);
-  
-   
+    for (uint i=0; i<4; i++) {
+        clReleaseEvent(read_event[i]);
+    }
+}
+
+
+backend_counters_t opencl_backend::counters() const {
+
+    backend_counters_t c;
+    c.push_back(std::make_pair(std::string("tree nodes"), (double)used_nodes));
+    c.push_back(std::make_pair(std::string("bytes copied (MB)"), (double)bytes_copied / (1024.0 * 1024.0)));
+    c.push_back(std::make_pair(std::string("bytes shared (MB)"), (double)bytes_shared / (1024.0 * 1024.0)));
+    if (stack_info != NULL) {
+        c.push_back(std::make_pair(std::string("filter0 stack max depth"), (double)stack_info[2]));
+        c.push_back(std::make_pair(std::string("filter0 stack blocks spilled"), (double)stack_info[0]));
+        c.push_back(std::make_pair(std::string("filter0 stack blocks filled"), (double)stack_info[1]));
+        c.push_back(std::make_pair(std::string("filter0 stack overflow"), (double)stack_info[3]));
+        c.push_back(std::make_pair(std::string("filter0 centre sets max on chip"), (double)stack_info[7]));
+        c.push_back(std::make_pair(std::string("filter0 centre sets spilled"), (double)stack_info[4]));
+        c.push_back(std::make_pair(std::string("filter0 centre sets filled"), (double)stack_info[5]));
+        c.push_back(std::make_pair(std::string("filter0 nodes with all centres"), (double)stack_info[6]));
+        c.push_back(std::make_pair(std::string("filter0 batches"), (double)stack_info[8]));
+        c.push_back(std::make_pair(std::string("filter0 candidates per batch"), (stack_info[8] > 0) ? (double)stack_info[9] / (double)stack_info[8] : 0.0));
+        c.push_back(std::make_pair(std::string("filter0 batches capped at BATCH_SIZE records"), (double)stack_info[10]));
+        c.push_back(std::make_pair(std::string("filter0 batches drained"), (double)stack_info[11]));
+        c.push_back(std::make_pair(std::string("filter0 pipeline occupancy (%)"), batch_occupancy(stack_info[8], stack_info[9], batch_overhead) * 100.0));
+    }
+
+    if (!upload.events.empty()) {
+        cl_ulong busy_ns = 0;
+        for (uint i=0; i<upload.events.size(); i++) {
+            busy_ns += getStartEndTime(upload.events[i]);
+        }
+        c.push_back(std::make_pair(std::string("tree upload chunks"), (double)upload.events.size()));
+        c.push_back(std::make_pair(std::string("chunks complete when the build finished"), (double)chunks_done));
+        c.push_back(std::make_pair(std::string("tree upload transfer (ms)"), double(busy_ns) * 1e-6));
+        c.push_back(std::make_pair(std::string("first chunk to kernel start (ms)"), first_chunk_to_kernel_ms));
+        c.push_back(std::make_pair(std::string("last chunk to kernel start (ms)"), last_chunk_to_kernel_ms));
+    }
+    return c;
+}
+
+
+void opencl_backend::release() {
+
+    for (uint i=0; i<upload.events.size(); i++) {
+        clReleaseEvent(upload.events[i]);
+    }
+    upload.events.clear();
+    if (tree_event != NULL) {
+        clReleaseEvent(tree_event);
+        tree_event = NULL;
+    }
+
+    cl_mem *bufs[9] = {&tree_memory_buf, &initial_centers_buf, &visited_nodes_buf, &new_centers_buf, &distortion_buf, &partial_sums_buf, &spill_stack_buf, &stack_info_buf, &set_spill_buf};
+    for (uint i=0; i<9; i++) {
+        if (*bufs[i] != NULL) {
+            clReleaseMemObject(*bufs[i]);
+            *bufs[i] = NULL;
+        }
+    }
+
+    // the zero-copy modes were unmapped before the kernel ran
+    if (tree_memory_host != NULL) {
+        free(tree_memory_host);
+        tree_memory_host = NULL;
+    }
+
+    void **host_bufs[5] = {(void**)&initial_centers, (void**)&visited_nodes, (void**)&distortion, (void**)&partial_sums, (void**)&stack_info};
+    for (uint i=0; i<5; i++) {
+        if (*host_bufs[i] != NULL) {
+            free(*host_bufs[i]);
+            *host_bufs[i] = NULL;
+        }
+    }
+}
+
+
+// Allocate the tree buffer according to tree_placement and return the host
+// pointer the tree is to be built into.
+cl_uint16 *place_tree_memory(size_t bytes, size_t *bytes_shared) {
+
+    cl_int status;
+    cl_uint16 *ptr = NULL;
+
+    switch (tree_placement) {
+
+    case TREE_COPY:
+        posix_memalign ((void**)(&tree_memory_host), 64, bytes);
+        tree_memory_buf= clCreateBuffer(context, CL_MEM_READ_ONLY, bytes, NULL, &status);
+        checkError(status, "Failed to create buffer for input");
+        ptr = tree_memory_host;
+        *bytes_shared = 0;
+        break;
+
+    case TREE_ALLOC_HOST_PTR:
+        tree_memory_buf= clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_ALLOC_HOST_PTR, bytes, NULL, &status);
+        checkError(status, "Failed to create buffer for input");
+        ptr = (cl_uint16*) clEnqueueMapBuffer(queue0, tree_memory_buf, CL_TRUE, CL_MAP_WRITE, 0, bytes, 0, NULL, NULL, &status);
+        checkError(status, "Failed to map buffer");
+        *bytes_shared = bytes;
+        break;
+
+    case TREE_USE_HOST_PTR:
+        // 64-byte alignment lets the runtime use the allocation in place
+        posix_memalign ((void**)(&tree_memory_host), 64, bytes);
+        tree_memory_buf= clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_USE_HOST_PTR, bytes, tree_memory_host, &status);
+        checkError(status, "Failed to create buffer for input");
+        ptr = (cl_uint16*) clEnqueueMapBuffer(queue0, tree_memory_buf, CL_TRUE, CL_MAP_WRITE, 0, bytes, 0, NULL, NULL, &status);
+        checkError(status, "Failed to map buffer");
+        *bytes_shared = bytes;
+        break;
+    }
+
+    return ptr;
+}
+
+
+// Called by buildkdTree_chunked for each completed range of nodes: start a
+// non-blocking copy on queue2, the range is never written again.
+void upload_tree_chunk(uint first, uint last, void *arg) {
+
+    tree_upload_t *upload = (tree_upload_t*)arg;
+    cl_int status;
+    cl_event event;
+
+    const size_t bytes = (last-first)*sizeof(cl_uint16);
+    status = clEnqueueWriteBuffer(queue2, tree_memory_buf, CL_FALSE, first*sizeof(cl_uint16), bytes, tree_memory+first, 0, NULL, &event);
+    checkError(status, "Failed to transfer input");
+    clFlush(queue2);
+    trace.command("write tree chunk", TRACE_QUEUE2, event);
+
+    upload->events.push_back(event);
+    upload->bytes += bytes;
+}
+
+
+// Make the tree built into tree_memory visible to the device: the used prefix
+// is copied for TREE_COPY (unless it has been streamed during the build), the
+// zero-copy modes unmap. event completes once the kernel may read the tree;
+// queue2 is in order, so that is the last chunk's write.
+void publish_tree_memory(uint used_nodes, tree_upload_t *upload, cl_event *event, size_t *bytes_copied) {
+
+    cl_int status;
+
+    if (tree_placement == TREE_COPY) {
+        if (upload->events.empty()) {
+            upload_tree_chunk(0, used_nodes, upload);
+        }
+        *event = upload->events.back();
+        clRetainEvent(*event);
+        *bytes_copied += upload->bytes;
+    } else {
+        status = clEnqueueUnmapMemObject(queue0, tree_memory_buf, tree_memory, 0, NULL, event);
+        checkError(status, "Failed to unmap buffer");
+        trace.command("unmap tree", TRACE_QUEUE0, *event);
+        tree_memory = NULL;
+    }
 }
 
 
 // Free the resources allocated during initialization
 void cleanup() {
 
+    // all traced commands have completed, write the timeline before the events' context goes away
+    trace.close();
+
     if(kernel0) {
         clReleaseKernel(kernel0);
     }
@@ -387,22 +930,16 @@ void cleanup() {
     if(queue1) {
         clReleaseCommandQueue(queue1);
     }
-    if(tree_memory_buf) {
-        clReleaseMemObject(tree_memory_buf);
-    }
-    if(initial_centers_buf) {
-        clReleaseMemObject(initial_centers_buf);
-    }
-    if(visited_nodes_buf) {
-        clReleaseMemObject(visited_nodes_buf);
-    }
-    if(new_centers_buf) {
-        clReleaseMemObject(new_centers_buf);
-    }
-    if(distortion_buf) {
-        clReleaseMemObject(distortion_buf);
+    if(queue2) {
+        clReleaseCommandQueue(queue2);
     }
 
+    // tree and per-tree buffers
+    if (backend != NULL) {
+        backend->release();
+        delete backend;
+        backend = NULL;
+    }
 
     if(program) {
         clReleaseProgram(program);
@@ -412,30 +949,6 @@ void cleanup() {
         clReleaseContext(context);
     }    
 
-    if (tree_memory != NULL) {
-        #ifndef SHARED_PHYSICAL_MEMORY
-        free(tree_memory);
-        #else
-        clEnqueueUnmapMemObject(queue0, tree_memory_buf, tree_memory, 0, NULL, NULL);
-        #endif
-    }
-
-    if (initial_centers != NULL) {
-        free(initial_centers);
-    }
-
-    if (visited_nodes != NULL) {
-        free(visited_nodes);
-    }
-
-    if (new_centers != NULL) {
-        free(new_centers);
-    }
-
-    if (distortion != NULL) {
-        free(distortion);
-    }
-
 }
 
 
@@ -36,6 +36,11 @@ ulong16 host_memory_bridge_ld_512bit (__global int *p0,  uint ttbr0, uint va)
     return 0;
 }
 
+ulong16 host_memory_bridge_st_512bit (__global int *p0,  uint ttbr0, uint va, uint16 write_data)
+{
+    return 0;
+}
+
 
 
 uint host_memory_bridge_aa_32bit (__global int *p0, svm_pointer_t ttbr0, svm_pointer_t lock_location, svm_pointer_t va, uint increment)
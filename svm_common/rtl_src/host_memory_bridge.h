@@ -31,6 +31,7 @@ uint4 host_memory_bridge_st_32bit (__global int *p0, svm_pointer_t ttbr0, svm_po
 
 //uint16 host_memory_bridge_512bit (__global int *p0, uint ttbr0, uint va, uint write, uint16 write_data);
 ulong16 host_memory_bridge_ld_512bit (__global int *p0, svm_pointer_t ttbr0, svm_pointer_t va);
+ulong16 host_memory_bridge_st_512bit (__global int *p0, svm_pointer_t ttbr0, svm_pointer_t va, uint16 write_data);
 
 uint host_memory_bridge_aa_32bit (__global int *p0, svm_pointer_t ttbr0, svm_pointer_t lock_location, svm_pointer_t va, uint increment);
 
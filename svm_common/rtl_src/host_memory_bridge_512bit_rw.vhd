@@ -17,6 +17,7 @@ use ieee.numeric_std.all;
 entity host_memory_bridge_a0b1c2d3_512bit_rw is
     generic (
         READ : integer := 1;
+        WRITE_ACK : integer := 0;                   -- 1: the data LSU acknowledges each write (stores, READ = 0)
         KERNEL_SIDE_MEM_LATENCY : integer := 160;
         MEMORY_SIDE_MEM_LATENCY : integer := 131;
         ACTUAL_NUMBER_OF_32BIT_WORDS : integer := 16
@@ -653,7 +654,7 @@ begin
         BURSTCOUNT_WIDTH => 5,                      -- Determines max burst size
         KERNEL_SIDE_MEM_LATENCY => KERNEL_SIDE_MEM_LATENCY,               -- Effective Latency in cycles as seen by the kernel pipeline
         MEMORY_SIDE_MEM_LATENCY => MEMORY_SIDE_MEM_LATENCY,               -- Latency in cycles between LSU and memory
-        USE_WRITE_ACK => 0,                         -- Enable the write-acknowledge signal
+        USE_WRITE_ACK => WRITE_ACK,                 -- Enable the write-acknowledge signal
         ENABLE_BANKED_MEMORY => 0,                  -- Flag enables address permutation for banked local memory config
         ABITS_PER_LMEM_BANK => 0,                   -- Used when permuting lmem address bits to stride across banks
         NUMBER_BANKS => 1,                          -- Number of memory banks - used in address permutation (1-disable)